@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "vmc_types.h"
+#include "fat.h"
+#include "ps2mcfs.h"
+#include "defrag.h"
+#include "utils.h"
+
+
+#define DEFRAG_NONE UINT32_MAX
+
+/**
+ * Where the directory entry that points to the first cluster of a chain is
+*/
+struct defrag_owner {
+	uint32_t parent; // directory that holds the entry, DEFRAG_NONE for the root and for clusters that don't start a chain
+	uint32_t index;  // index of the entry in that directory
+	uint32_t dir;    // directory of the chain itself, DEFRAG_NONE for files
+};
+
+struct defrag_state {
+	const struct vmc_meta* vmc_meta;
+	cluster_t count;             // number of allocatable clusters
+	cluster_t* prev;             // cluster before each cluster in its chain, DEFRAG_NONE for the first ones
+	struct defrag_owner* owners; // indexed by the first cluster of each chain
+	cluster_t* dir_heads;        // first cluster of each directory, indexed by the `dir` of its owner
+	uint32_t dir_count;
+	cluster_t cursor;            // where the next cluster goes, the clusters before it are in place
+	struct defrag_stats* stats;
+};
+
+static const struct defrag_owner NO_OWNER = {.parent = DEFRAG_NONE, .index = DEFRAG_NONE, .dir = DEFRAG_NONE};
+
+/**
+ * Links every cluster to the one before it in its chain. Every cluster must be in at most one chain
+*/
+static int defrag_link_chains(struct defrag_state* state) {
+	for (cluster_t clus = 0; clus < state->count; ++clus)
+		state->prev[clus] = DEFRAG_NONE;
+	for (cluster_t clus = 0; clus < state->count; ++clus) {
+		const union fat_entry value = fat_get_table_entry(state->vmc_meta, clus);
+		if (!value.entry.occupied || value.raw == FAT_ENTRY_TERMINATOR.raw)
+			continue;
+		const cluster_t next = value.entry.next_cluster;
+		if (next >= state->count || !fat_get_table_entry(state->vmc_meta, next).entry.occupied || state->prev[next] != DEFRAG_NONE) {
+			fprintf(stderr, "Cluster %u links to cluster %u, which is free or already linked\n", clus, next);
+			return -EUCLEAN;
+		}
+		state->prev[next] = clus;
+	}
+	return 0;
+}
+
+/**
+ * Records the owner of a chain, which must start at an allocated cluster that no other entry points to
+*/
+static int defrag_set_owner(struct defrag_state* state, cluster_t clus, struct defrag_owner owner) {
+	if (clus >= state->count || !fat_get_table_entry(state->vmc_meta, clus).entry.occupied || state->prev[clus] != DEFRAG_NONE || state->owners[clus].dir != DEFRAG_NONE || state->owners[clus].parent != DEFRAG_NONE) {
+		fprintf(stderr, "Cluster %u doesn't start a chain or starts more than one\n", clus);
+		return -EUCLEAN;
+	}
+	if (owner.dir != DEFRAG_NONE)
+		state->dir_heads[owner.dir] = clus;
+	state->owners[clus] = owner;
+	return 0;
+}
+
+/**
+ * Finds the owners of the chains of the entries of a directory and of all its subdirectories
+*/
+static int defrag_scan_dir(struct defrag_state* state, uint32_t dir_id, const dir_entry_t* dir) {
+	dir_iterator_t it;
+	if (ps2mcfs_dir_iterator_init(state->vmc_meta, dir, 2, &it) != 0)
+		return -ENOMEM;
+	int err = 0;
+	dir_entry_t* child;
+	size_t index;
+	while (!err && (child = ps2mcfs_dir_iterator_next(&it, &index)) != NULL) {
+		if (child->cluster == CLUSTER_INVALID)
+			continue;
+		const bool is_dir = ps2mcfs_is_directory(child);
+		struct defrag_owner owner = {.parent = dir_id, .index = index, .dir = is_dir ? state->dir_count++ : DEFRAG_NONE};
+		err = defrag_set_owner(state, child->cluster, owner);
+		if (!err && is_dir)
+			err = defrag_scan_dir(state, owner.dir, child);
+	}
+	ps2mcfs_dir_iterator_free(&it);
+	return err;
+}
+
+/**
+ * Points the "." and ".." entries of a directory to the slot of its entry in its parent, if they don't already
+*/
+static void defrag_set_dir_location(const struct vmc_meta* vmc_meta, cluster_t dir_cluster, cluster_t parent_cluster, size_t index) {
+	dir_entry_t dot;
+	for (unsigned i = 0; i < 2; ++i) {
+		if (ps2mcfs_get_child(vmc_meta, dir_cluster, i, &dot) != 0)
+			continue;
+		if (dot.cluster == parent_cluster && dot.dir_entry == index)
+			continue;
+		dot.cluster = parent_cluster;
+		dot.dir_entry = index;
+		ps2mcfs_set_child(vmc_meta, dir_cluster, i, &dot);
+	}
+}
+
+/**
+ * Points the "." and ".." entries of the subdirectories of `dir` to its first cluster, after it moved
+*/
+static int defrag_set_subdir_locations(const struct vmc_meta* vmc_meta, const dir_entry_t* dir) {
+	dir_iterator_t it;
+	if (ps2mcfs_dir_iterator_init(vmc_meta, dir, 2, &it) != 0)
+		return -ENOMEM;
+	dir_entry_t* child;
+	size_t index;
+	while ((child = ps2mcfs_dir_iterator_next(&it, &index)) != NULL) {
+		if (ps2mcfs_is_directory(child) && child->cluster != CLUSTER_INVALID)
+			defrag_set_dir_location(vmc_meta, child->cluster, dir->cluster, index);
+	}
+	ps2mcfs_dir_iterator_free(&it);
+	return 0;
+}
+
+/**
+ * Moves the data of the allocated cluster `from` into the free cluster `to`, and everything that pointed to `from`
+*/
+static int defrag_move(struct defrag_state* state, cluster_t from, cluster_t to) {
+	const struct vmc_meta* vmc_meta = state->vmc_meta;
+	if (fat_copy_cluster(vmc_meta, from, to) != 0)
+		return -EIO;
+	state->stats->clusters_moved++;
+
+	const union fat_entry value = fat_get_table_entry(vmc_meta, from);
+	fat_set_table_entry(vmc_meta, to, value);
+	fat_set_table_entry(vmc_meta, from, FAT_ENTRY_FREE);
+	if (value.raw != FAT_ENTRY_TERMINATOR.raw)
+		state->prev[value.entry.next_cluster] = to;
+
+	const cluster_t prev = state->prev[from];
+	state->prev[to] = prev;
+	state->prev[from] = DEFRAG_NONE;
+	if (prev != DEFRAG_NONE) {
+		fat_set_table_entry(vmc_meta, prev, (union fat_entry) {.entry = {.next_cluster = to, .occupied = 1}});
+		return 0;
+	}
+
+	// the first cluster of a chain moved
+	const struct defrag_owner owner = state->owners[from];
+	state->owners[to] = owner;
+	state->owners[from] = NO_OWNER;
+	if (owner.dir != DEFRAG_NONE)
+		state->dir_heads[owner.dir] = to;
+	dir_entry_t dirent;
+	if (owner.parent != DEFRAG_NONE) {
+		const cluster_t parent_cluster = state->dir_heads[owner.parent];
+		if (ps2mcfs_get_child(vmc_meta, parent_cluster, owner.index, &dirent) != 0)
+			return -EIO;
+		dirent.cluster = to;
+		ps2mcfs_set_child(vmc_meta, parent_cluster, owner.index, &dirent);
+	}
+	else if (owner.dir != DEFRAG_NONE) {
+		// the entry of the root directory is its own "." entry
+		if (ps2mcfs_get_child(vmc_meta, to, 0, &dirent) != 0)
+			return -EIO;
+		dirent.cluster = to;
+	}
+	// the "." and ".." entries of the subdirectories point to the first cluster of their parent
+	if (owner.dir != DEFRAG_NONE)
+		return defrag_set_subdir_locations(vmc_meta, &dirent);
+	return 0;
+}
+
+/**
+ * Moves the chain that starts at `clus` to the cursor, making room for it by moving away the clusters that are there
+*/
+static int defrag_place_chain(struct defrag_state* state, cluster_t clus) {
+	const struct vmc_meta* vmc_meta = state->vmc_meta;
+	bool moved = false;
+	for (;;) {
+		const cluster_t target = state->cursor;
+		if (clus != target) {
+			if (target >= state->count)
+				return -EUCLEAN;
+			if (fat_get_table_entry(vmc_meta, target).entry.occupied) {
+				const cluster_t free_clus = fat_find_free_cluster(vmc_meta, target);
+				if (free_clus == CLUSTER_INVALID)
+					return -ENOSPC;
+				int err = defrag_move(state, target, free_clus);
+				if (err)
+					return err;
+			}
+			int err = defrag_move(state, clus, target);
+			if (err)
+				return err;
+			clus = target;
+			moved = true;
+		}
+		state->cursor++;
+		const union fat_entry value = fat_get_table_entry(vmc_meta, clus);
+		if (value.raw == FAT_ENTRY_TERMINATOR.raw)
+			break;
+		clus = value.entry.next_cluster;
+	}
+	if (moved)
+		state->stats->chains_moved++;
+	return 0;
+}
+
+/**
+ * Places the chains of the entries of a directory, which is already in place, each followed by its subtree.
+ * The entries are read again one by one, as moving the clusters that are in the way rewrites other entries
+*/
+static int defrag_place_dir(struct defrag_state* state, uint32_t dir_id, size_t length) {
+	const struct vmc_meta* vmc_meta = state->vmc_meta;
+	const cluster_t dir_cluster = state->dir_heads[dir_id];
+	for (size_t index = 2; index < length; ++index) {
+		dir_entry_t child;
+		if (ps2mcfs_get_child(vmc_meta, dir_cluster, index, &child) != 0)
+			return -EIO;
+		if (!(child.mode & DF_EXISTS) || child.cluster == CLUSTER_INVALID)
+			continue;
+		const uint32_t child_dir = state->owners[child.cluster].dir;
+		int err = defrag_place_chain(state, child.cluster);
+		if (err)
+			return err;
+		if (child_dir == DEFRAG_NONE)
+			continue;
+		err = defrag_place_dir(state, child_dir, child.length);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+int defrag_card(const struct vmc_meta* vmc_meta, struct defrag_stats* stats) {
+	*stats = (struct defrag_stats) {0};
+	struct defrag_state state = {
+		.vmc_meta = vmc_meta,
+		.count = vmc_meta->superblock.last_allocatable,
+		.cursor = vmc_meta->superblock.root_cluster,
+		.stats = stats,
+	};
+	state.prev = malloc(state.count * sizeof(cluster_t));
+	state.owners = malloc(state.count * sizeof(struct defrag_owner));
+	state.dir_heads = malloc(state.count * sizeof(cluster_t));
+	int err = -ENOMEM;
+	if (!state.prev || !state.owners || !state.dir_heads)
+		goto end;
+	for (cluster_t clus = 0; clus < state.count; ++clus)
+		state.owners[clus] = NO_OWNER;
+
+	// the first cluster of the root directory is in the superblock and stays where it is
+	dir_entry_t root;
+	const cluster_t root_cluster = vmc_meta->superblock.root_cluster;
+	err = -EIO;
+	if (ps2mcfs_get_child(vmc_meta, root_cluster, 0, &root) != 0)
+		goto end;
+	root.cluster = root_cluster;
+	err = defrag_link_chains(&state);
+	if (!err)
+		err = defrag_set_owner(&state, root_cluster, (struct defrag_owner) {.parent = DEFRAG_NONE, .index = 0, .dir = state.dir_count++});
+	if (!err)
+		err = defrag_scan_dir(&state, 0, &root);
+	if (!err)
+		err = defrag_place_chain(&state, root_cluster);
+	if (!err)
+		err = defrag_place_dir(&state, 0, root.length);
+
+end:
+	free(state.prev);
+	free(state.owners);
+	free(state.dir_heads);
+	return err;
+}
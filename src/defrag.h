@@ -0,0 +1,26 @@
+#ifndef __DEFRAG_H__
+#define __DEFRAG_H__
+
+#include <stddef.h>
+
+#include "vmc_types.h"
+
+
+struct defrag_stats {
+	size_t chains_moved;   // chains that had at least one cluster moved
+	size_t clusters_moved; // cluster copies, including the ones that only made room for another chain
+};
+
+/**
+ * Moves the cluster chains of all the files and directories of the card into contiguous runs, packed from the
+ * root directory onwards in the order of a depth-first walk of the tree, and points the FAT, the directory entries
+ * and the "." and ".." entries to the new clusters. Clusters are moved one at a time and the card is consistent
+ * after every move, as the "." and ".." entries of its subdirectories follow a directory whose first cluster moves.
+ * Besides the FAT, it only needs a few bytes per cluster of memory.
+ * Must not run while the card is mounted. The FAT is not flushed.
+ * Returns 0 on success, -ENOMEM, -ENOSPC if the card has no free cluster to move data through,
+ * or -EUCLEAN if the FAT or the directory tree are inconsistent
+*/
+int defrag_card(const struct vmc_meta* vmc_meta, struct defrag_stats* stats);
+
+#endif
@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+#include "vmc_types.h"
+#include "fat.h"
+#include "ps2mcfs.h"
+#include "mc_image.h"
+#include "defrag.h"
+
+
+static const struct option CLI_OPTIONS[] = {
+    {.name = "output",  .has_arg = required_argument, .flag = NULL, .val = 0},
+    {.name = "dry-run", .has_arg = no_argument,       .flag = NULL, .val = 0},
+    {.name = "help",    .has_arg = no_argument,       .flag = NULL, .val = 0},
+    {.name = NULL,      .has_arg = 0,                 .flag = NULL, .val = 0}
+};
+
+void usage(FILE* stream, const char* program_name, int exit_code) {
+    fprintf(
+        stream,
+        "Usage: %s [-o OUTPUT_FILE] [-n] [-h] IMAGE_FILE\n"
+        "Move the files of a virtual memory card image file into contiguous clusters.\n"
+        "The image is defragmented in a temporary copy, which then replaces the output file.\n"
+        "\n"
+        "  -o, --output=FILE\tSet the output file (default: replace IMAGE_FILE)\n"
+        "  -n, --dry-run    \tOnly report the fragmentation of the image\n"
+        "  -h, --help       \tShow this help\n",
+        program_name
+    );
+    exit(exit_code);
+}
+
+void print_fragmentation(const char* label, const struct vmc_meta* vmc_meta) {
+    struct fat_fragmentation stats;
+    fat_fragmentation(vmc_meta, &stats);
+    printf(
+        "%s: %lu chains in %lu extents, %lu free clusters in %lu runs (largest: %lu clusters)\n",
+        label, stats.chains, stats.extents, fat_free_cluster_count(vmc_meta), stats.free_runs, stats.largest_free_run
+    );
+}
+
+/**
+ * Copies the whole input file into a new temporary file next to `output_filename`, and returns its path
+ */
+char* copy_to_temp_file(const char* input_filename, const char* output_filename) {
+    char* temp_filename = malloc(strlen(output_filename) + sizeof(".XXXXXX"));
+    sprintf(temp_filename, "%s.XXXXXX", output_filename);
+    int input_fd = open(input_filename, O_RDONLY);
+    int temp_fd = input_fd == -1 ? -1 : mkstemp(temp_filename);
+    if (input_fd == -1 || temp_fd == -1) {
+        fprintf(stderr, "Could not copy %s to a temporary file: %s\n", input_filename, strerror(errno));
+        if (input_fd != -1)
+            close(input_fd);
+        free(temp_filename);
+        return NULL;
+    }
+
+    // keep the permissions of the input, mkstemp() makes the file private
+    struct stat st;
+    if (fstat(input_fd, &st) == 0)
+        fchmod(temp_fd, st.st_mode & 0777);
+
+    char buf[65536];
+    ssize_t size;
+    while ((size = read(input_fd, buf, sizeof(buf))) > 0) {
+        if (write(temp_fd, buf, size) != size) {
+            size = -1;
+            break;
+        }
+    }
+    if (size == -1) {
+        fprintf(stderr, "Could not copy %s to %s: %s\n", input_filename, temp_filename, strerror(errno));
+        unlink(temp_filename);
+        free(temp_filename);
+        temp_filename = NULL;
+    }
+    close(input_fd);
+    close(temp_fd);
+    return temp_filename;
+}
+
+/**
+ * Writes the directory that holds `filename` to the disk, so that a rename into it survives a crash
+ */
+int sync_parent_dir(const char* filename) {
+    char* path = strdup(filename);
+    if (path == NULL)
+        return -1;
+    int dir_fd = open(dirname(path), O_RDONLY | O_DIRECTORY);
+    free(path);
+    if (dir_fd == -1)
+        return -1;
+    int res = fsync(dir_fd);
+    close(dir_fd);
+    return res;
+}
+
+int main(int argc, char** argv) {
+    // parse options
+    const char* option_output_filename = NULL;
+    int option_dry_run = 0;
+    int opt;
+    int long_option_index = 0;
+    while ((opt = getopt_long(argc, argv, "o:nh", CLI_OPTIONS, &long_option_index)) != -1) {
+        // parse -o / --output option
+        if ((opt == 0 && long_option_index == 0) || opt == 'o') {
+            option_output_filename = optarg;
+        }
+        // parse -n / --dry-run option
+        else if ((opt == 0 && long_option_index == 1) || opt == 'n') {
+            option_dry_run = 1;
+        }
+        // parse -h / --help option
+        else if ((opt == 0 && long_option_index == 2) || opt == 'h') {
+            usage(stdout, argv[0], 0);
+        }
+        // handle invalid option
+        else {
+            fprintf(stderr, "Unrecognized option: %s.\n", argv[optind - 1]);
+            usage(stderr, argv[0], EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Expected exactly one IMAGE_FILE\n");
+        usage(stderr, argv[0], EXIT_FAILURE);
+    }
+    const char* input_filename = argv[optind];
+    if (option_output_filename == NULL)
+        option_output_filename = input_filename;
+
+    // the input is never written to: a crash leaves either the old image or the defragmented one at the output
+    char* temp_filename = NULL;
+    if (!option_dry_run) {
+        temp_filename = copy_to_temp_file(input_filename, option_output_filename);
+        if (temp_filename == NULL)
+            exit(EXIT_FAILURE);
+    }
+
+    struct vmc_meta vmc_meta = {0};
+    vmc_meta.fd = -1;
+    const char* image_filename = option_dry_run ? input_filename : temp_filename;
+    if (mc_image_open(&vmc_meta, image_filename, option_dry_run ? MC_IMAGE_PRIVATE : MC_IMAGE_SHARED) != 0) {
+        fprintf(stderr, "Could not open %s: %s\n", image_filename, strerror(errno));
+        goto fail;
+    }
+    if (ps2mcfs_get_superblock(&vmc_meta) != 0 || fat_load(&vmc_meta) != 0) {
+        fprintf(stderr, "Could not read the superblock and the FAT of %s\n", input_filename);
+        goto fail;
+    }
+
+    print_fragmentation("Before", &vmc_meta);
+    if (option_dry_run) {
+        fat_unload(&vmc_meta);
+        mc_image_close(&vmc_meta);
+        return EXIT_SUCCESS;
+    }
+
+    struct defrag_stats stats;
+    int err = defrag_card(&vmc_meta, &stats);
+    if (err) {
+        fprintf(stderr, "Could not defragment %s: %s\n", input_filename, strerror(-err));
+        if (err == -EUCLEAN)
+            fprintf(stderr, "The image has to be repaired first\n");
+        goto fail;
+    }
+    if (fat_flush(&vmc_meta) != 0 || mc_image_sync(&vmc_meta) != 0 || fsync(vmc_meta.fd) != 0) {
+        fprintf(stderr, "Could not write %s: %s\n", temp_filename, strerror(errno));
+        goto fail;
+    }
+    printf("Moved %lu clusters of %lu chains\n", stats.clusters_moved, stats.chains_moved);
+    print_fragmentation("After", &vmc_meta);
+    fat_unload(&vmc_meta);
+    mc_image_close(&vmc_meta);
+
+    if (rename(temp_filename, option_output_filename) != 0) {
+        fprintf(stderr, "Could not replace %s: %s\n", option_output_filename, strerror(errno));
+        unlink(temp_filename);
+        exit(EXIT_FAILURE);
+    }
+    free(temp_filename);
+    if (sync_parent_dir(option_output_filename) != 0) {
+        fprintf(stderr, "Could not write the directory of %s: %s\n", option_output_filename, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return EXIT_SUCCESS;
+
+fail:
+    fat_unload(&vmc_meta);
+    mc_image_close(&vmc_meta);
+    if (temp_filename) {
+        unlink(temp_filename);
+        free(temp_filename);
+    }
+    exit(EXIT_FAILURE);
+}
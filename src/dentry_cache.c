@@ -0,0 +1,240 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dentry_cache.h"
+#include "vmc_types.h"
+
+
+#define DENTRY_NONE UINT32_MAX
+
+struct dentry {
+	cluster_t dir_cluster; // first cluster of the directory that holds the entry, CLUSTER_INVALID when the slot is unused
+	size_t index;          // position of the entry in its directory
+	char name[32];
+	uint32_t name_next;    // next slot in the same bucket of the name table
+	uint32_t location_next; // next slot in the same bucket of the location table
+	uint32_t lru_prev;     // more recently used slot
+	uint32_t lru_next;     // less recently used slot, or the next unused slot
+	dir_entry_t dirent;
+};
+
+struct dentry_cache {
+	pthread_mutex_t mutex;
+	struct dentry* slots;
+	size_t capacity;
+	uint32_t* name_buckets;     // slots hashed by (directory, name)
+	uint32_t* location_buckets; // slots hashed by (directory, index)
+	size_t bucket_mask;
+	uint32_t lru_head;
+	uint32_t lru_tail;
+	uint32_t unused; // list of unused slots, linked through `lru_next`
+	size_t hits;
+	size_t misses;
+};
+
+
+static size_t dentry_name_hash(const struct dentry_cache* cache, cluster_t dir_cluster, const char* name, size_t name_len) {
+	// FNV-1a
+	uint32_t hash = 2166136261u ^ dir_cluster;
+	for (size_t i = 0; i < name_len; ++i)
+		hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+	return hash & cache->bucket_mask;
+}
+
+static size_t dentry_location_hash(const struct dentry_cache* cache, cluster_t dir_cluster, size_t index) {
+	return ((dir_cluster * 2654435761u) ^ index) & cache->bucket_mask;
+}
+
+static void dentry_lru_remove(struct dentry_cache* cache, uint32_t slot) {
+	struct dentry* d = &cache->slots[slot];
+	if (d->lru_prev == DENTRY_NONE)
+		cache->lru_head = d->lru_next;
+	else
+		cache->slots[d->lru_prev].lru_next = d->lru_next;
+	if (d->lru_next == DENTRY_NONE)
+		cache->lru_tail = d->lru_prev;
+	else
+		cache->slots[d->lru_next].lru_prev = d->lru_prev;
+}
+
+static void dentry_lru_push(struct dentry_cache* cache, uint32_t slot) {
+	struct dentry* d = &cache->slots[slot];
+	d->lru_prev = DENTRY_NONE;
+	d->lru_next = cache->lru_head;
+	if (cache->lru_head != DENTRY_NONE)
+		cache->slots[cache->lru_head].lru_prev = slot;
+	cache->lru_head = slot;
+	if (cache->lru_tail == DENTRY_NONE)
+		cache->lru_tail = slot;
+}
+
+/**
+ * Unlinks a slot from both hash tables and from the LRU list, and puts it back in the list of unused slots
+*/
+static void dentry_release(struct dentry_cache* cache, uint32_t slot) {
+	struct dentry* d = &cache->slots[slot];
+	uint32_t* link = &cache->name_buckets[dentry_name_hash(cache, d->dir_cluster, d->name, strlen(d->name))];
+	while (*link != slot)
+		link = &cache->slots[*link].name_next;
+	*link = d->name_next;
+	link = &cache->location_buckets[dentry_location_hash(cache, d->dir_cluster, d->index)];
+	while (*link != slot)
+		link = &cache->slots[*link].location_next;
+	*link = d->location_next;
+
+	dentry_lru_remove(cache, slot);
+	d->dir_cluster = CLUSTER_INVALID;
+	d->lru_next = cache->unused;
+	cache->unused = slot;
+}
+
+static uint32_t dentry_find(const struct dentry_cache* cache, cluster_t dir_cluster, const char* name, size_t name_len) {
+	uint32_t slot = cache->name_buckets[dentry_name_hash(cache, dir_cluster, name, name_len)];
+	for (; slot != DENTRY_NONE; slot = cache->slots[slot].name_next) {
+		const struct dentry* d = &cache->slots[slot];
+		if (d->dir_cluster == dir_cluster && strncmp(d->name, name, name_len) == 0 && d->name[name_len] == '\0')
+			return slot;
+	}
+	return DENTRY_NONE;
+}
+
+int dentry_cache_init(struct vmc_meta* vmc_meta, size_t capacity) {
+	struct dentry_cache* cache = malloc(sizeof(struct dentry_cache));
+	if (cache == NULL)
+		return -1;
+	size_t bucket_count = 1;
+	while (bucket_count < 2 * capacity)
+		bucket_count *= 2;
+	cache->capacity = capacity;
+	cache->bucket_mask = bucket_count - 1;
+	cache->slots = malloc(capacity * sizeof(struct dentry));
+	cache->name_buckets = malloc(bucket_count * sizeof(uint32_t));
+	cache->location_buckets = malloc(bucket_count * sizeof(uint32_t));
+	if (cache->slots == NULL || cache->name_buckets == NULL || cache->location_buckets == NULL) {
+		free(cache->slots);
+		free(cache->name_buckets);
+		free(cache->location_buckets);
+		free(cache);
+		return -1;
+	}
+	for (size_t i = 0; i < bucket_count; ++i) {
+		cache->name_buckets[i] = DENTRY_NONE;
+		cache->location_buckets[i] = DENTRY_NONE;
+	}
+	for (size_t i = 0; i < capacity; ++i) {
+		cache->slots[i].dir_cluster = CLUSTER_INVALID;
+		cache->slots[i].lru_next = i + 1 < capacity ? i + 1 : DENTRY_NONE;
+	}
+	cache->unused = capacity > 0 ? 0 : DENTRY_NONE;
+	cache->lru_head = DENTRY_NONE;
+	cache->lru_tail = DENTRY_NONE;
+	cache->hits = 0;
+	cache->misses = 0;
+	pthread_mutex_init(&cache->mutex, NULL);
+	vmc_meta->dentries = cache;
+	return 0;
+}
+
+void dentry_cache_free(struct vmc_meta* vmc_meta) {
+	if (vmc_meta->dentries == NULL)
+		return;
+	pthread_mutex_destroy(&vmc_meta->dentries->mutex);
+	free(vmc_meta->dentries->slots);
+	free(vmc_meta->dentries->name_buckets);
+	free(vmc_meta->dentries->location_buckets);
+	free(vmc_meta->dentries);
+	vmc_meta->dentries = NULL;
+}
+
+bool dentry_cache_lookup(const struct vmc_meta* vmc_meta, cluster_t dir_cluster, const char* name, size_t name_len, dir_entry_t* dirent, size_t* index) {
+	struct dentry_cache* cache = vmc_meta->dentries;
+	if (cache == NULL || name_len >= sizeof(cache->slots[0].name))
+		return false;
+	pthread_mutex_lock(&cache->mutex);
+	uint32_t slot = dentry_find(cache, dir_cluster, name, name_len);
+	if (slot == DENTRY_NONE) {
+		cache->misses++;
+		pthread_mutex_unlock(&cache->mutex);
+		return false;
+	}
+	cache->hits++;
+	dentry_lru_remove(cache, slot);
+	dentry_lru_push(cache, slot);
+	*dirent = cache->slots[slot].dirent;
+	if (index)
+		*index = cache->slots[slot].index;
+	pthread_mutex_unlock(&cache->mutex);
+	return true;
+}
+
+void dentry_cache_insert(const struct vmc_meta* vmc_meta, cluster_t dir_cluster, size_t index, const char* name, size_t name_len, const dir_entry_t* dirent) {
+	struct dentry_cache* cache = vmc_meta->dentries;
+	if (cache == NULL || cache->capacity == 0 || name_len >= sizeof(cache->slots[0].name))
+		return;
+	pthread_mutex_lock(&cache->mutex);
+	uint32_t slot = dentry_find(cache, dir_cluster, name, name_len);
+	if (slot != DENTRY_NONE)
+		dentry_release(cache, slot);
+	if (cache->unused == DENTRY_NONE)
+		dentry_release(cache, cache->lru_tail);
+	slot = cache->unused;
+	struct dentry* d = &cache->slots[slot];
+	cache->unused = d->lru_next;
+
+	d->dir_cluster = dir_cluster;
+	d->index = index;
+	memcpy(d->name, name, name_len);
+	d->name[name_len] = '\0';
+	d->dirent = *dirent;
+	uint32_t* bucket = &cache->name_buckets[dentry_name_hash(cache, dir_cluster, name, name_len)];
+	d->name_next = *bucket;
+	*bucket = slot;
+	bucket = &cache->location_buckets[dentry_location_hash(cache, dir_cluster, index)];
+	d->location_next = *bucket;
+	*bucket = slot;
+	dentry_lru_push(cache, slot);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+void dentry_cache_invalidate_entry(const struct vmc_meta* vmc_meta, cluster_t dir_cluster, size_t index, const char* name) {
+	struct dentry_cache* cache = vmc_meta->dentries;
+	if (cache == NULL)
+		return;
+	pthread_mutex_lock(&cache->mutex);
+	uint32_t slot = dentry_find(cache, dir_cluster, name, strnlen(name, sizeof(cache->slots[0].name) - 1));
+	if (slot != DENTRY_NONE)
+		dentry_release(cache, slot);
+	slot = cache->location_buckets[dentry_location_hash(cache, dir_cluster, index)];
+	while (slot != DENTRY_NONE) {
+		const uint32_t next = cache->slots[slot].location_next;
+		if (cache->slots[slot].dir_cluster == dir_cluster && cache->slots[slot].index == index)
+			dentry_release(cache, slot);
+		slot = next;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+void dentry_cache_invalidate_dir(const struct vmc_meta* vmc_meta, cluster_t dir_cluster) {
+	struct dentry_cache* cache = vmc_meta->dentries;
+	if (cache == NULL || dir_cluster == CLUSTER_INVALID)
+		return;
+	pthread_mutex_lock(&cache->mutex);
+	for (uint32_t slot = 0; slot < cache->capacity; ++slot) {
+		if (cache->slots[slot].dir_cluster == dir_cluster)
+			dentry_release(cache, slot);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+void dentry_cache_stats(const struct vmc_meta* vmc_meta, size_t* hits, size_t* misses) {
+	*hits = 0;
+	*misses = 0;
+	if (vmc_meta->dentries == NULL)
+		return;
+	pthread_mutex_lock(&vmc_meta->dentries->mutex);
+	*hits = vmc_meta->dentries->hits;
+	*misses = vmc_meta->dentries->misses;
+	pthread_mutex_unlock(&vmc_meta->dentries->mutex);
+}
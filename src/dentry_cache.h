@@ -0,0 +1,51 @@
+#ifndef __DENTRY_CACHE_H__
+#define __DENTRY_CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "vmc_types.h"
+
+#define DENTRY_CACHE_DEFAULT_CAPACITY 512
+
+
+/**
+ * Creates a cache of `capacity` directory entries, keyed by the first cluster of their directory and their name.
+ * Returns 0 on success or -1 if out of memory
+*/
+int dentry_cache_init(struct vmc_meta* vmc_meta, size_t capacity);
+
+/**
+ * Frees the cache. Lookups are not cached afterwards
+*/
+void dentry_cache_free(struct vmc_meta* vmc_meta);
+
+/**
+ * Looks up the first `name_len` characters of `name` in the directory that starts at `dir_cluster`.
+ * On a hit, the entry and its index in the directory are copied to `dirent` and `index` (if not NULL)
+*/
+bool dentry_cache_lookup(const struct vmc_meta* vmc_meta, cluster_t dir_cluster, const char* name, size_t name_len, dir_entry_t* dirent, size_t* index);
+
+/**
+ * Remembers that the entry at `index` of the directory that starts at `dir_cluster` is `dirent`, under `name`.
+ * The least recently used entry is evicted when the cache is full
+*/
+void dentry_cache_insert(const struct vmc_meta* vmc_meta, cluster_t dir_cluster, size_t index, const char* name, size_t name_len, const dir_entry_t* dirent);
+
+/**
+ * Forgets the entries of the directory that starts at `dir_cluster` that are either at `index` or named `name`.
+ * Must be called whenever a directory entry is written
+*/
+void dentry_cache_invalidate_entry(const struct vmc_meta* vmc_meta, cluster_t dir_cluster, size_t index, const char* name);
+
+/**
+ * Forgets all the entries of the directory that starts at `dir_cluster`. Must be called when the directory is removed
+*/
+void dentry_cache_invalidate_dir(const struct vmc_meta* vmc_meta, cluster_t dir_cluster);
+
+/**
+ * Returns the number of lookups that were served by the cache and the number of lookups that weren't
+*/
+void dentry_cache_stats(const struct vmc_meta* vmc_meta, size_t* hits, size_t* misses);
+
+#endif
@@ -0,0 +1,307 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dir_index.h"
+#include "fat.h"
+#include "vmc_types.h"
+
+
+#define DIR_INDEX_NONE UINT32_MAX
+
+struct dir_index {
+	cluster_t dir_cluster; // first cluster of the indexed directory, CLUSTER_INVALID when the slot is unused
+	size_t length;         // number of entries of the directory
+	size_t capacity;       // number of entries that fit in `names` and `next`
+	size_t free_count;     // number of deleted entries, not counting the "." and ".." entries
+	char (*names)[32];     // name of each entry, empty for deleted entries
+	uint32_t* next;        // next entry in the same bucket
+	uint32_t* buckets;     // first entry of each bucket, with `capacity` buckets
+	unsigned long last_used;
+};
+
+struct dir_index_cache {
+	pthread_mutex_t mutex;
+	struct dir_index dirs[DIR_INDEX_SLOTS];
+	unsigned long clock;
+};
+
+
+static size_t dir_index_hash(const struct dir_index* index, const char* name, size_t name_len) {
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < name_len && name[i] != '\0'; ++i)
+		hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+	return hash & (index->capacity - 1);
+}
+
+static bool dir_index_name_equals(const char* entry_name, const char* name, size_t name_len) {
+	return strncmp(entry_name, name, name_len) == 0 && (name_len == 32 || entry_name[name_len] == '\0');
+}
+
+static void dir_index_link(struct dir_index* index, size_t i) {
+	if (index->names[i][0] == '\0')
+		return;
+	uint32_t* bucket = &index->buckets[dir_index_hash(index, index->names[i], 32)];
+	index->next[i] = *bucket;
+	*bucket = i;
+}
+
+static void dir_index_unlink(struct dir_index* index, size_t i) {
+	if (index->names[i][0] == '\0')
+		return;
+	uint32_t* link = &index->buckets[dir_index_hash(index, index->names[i], 32)];
+	while (*link != DIR_INDEX_NONE && *link != i)
+		link = &index->next[*link];
+	if (*link == i)
+		*link = index->next[i];
+}
+
+static void dir_index_clear(struct dir_index* index) {
+	free(index->names);
+	free(index->next);
+	free(index->buckets);
+	index->names = NULL;
+	index->next = NULL;
+	index->buckets = NULL;
+	index->dir_cluster = CLUSTER_INVALID;
+	index->length = 0;
+	index->capacity = 0;
+	index->free_count = 0;
+}
+
+/**
+ * Makes room for at least `length` entries. The capacity is kept a power of two and all the entries are rehashed.
+ * Returns 0 on success or -1 if out of memory
+*/
+static int dir_index_reserve(struct dir_index* index, size_t length) {
+	if (length <= index->capacity)
+		return 0;
+	size_t capacity = index->capacity ? index->capacity : 16;
+	while (capacity < length)
+		capacity *= 2;
+	char (*names)[32] = realloc(index->names, capacity * sizeof(*names));
+	if (names == NULL)
+		return -1;
+	index->names = names;
+	uint32_t* next = realloc(index->next, capacity * sizeof(uint32_t));
+	if (next == NULL)
+		return -1;
+	index->next = next;
+	uint32_t* buckets = realloc(index->buckets, capacity * sizeof(uint32_t));
+	if (buckets == NULL)
+		return -1;
+	index->buckets = buckets;
+	index->capacity = capacity;
+	for (size_t i = 0; i < capacity; ++i)
+		index->buckets[i] = DIR_INDEX_NONE;
+	for (size_t i = 0; i < index->length; ++i)
+		dir_index_link(index, i);
+	return 0;
+}
+
+/**
+ * Stores the name of the entry at `i`, growing the index if the entry is past its end
+*/
+static int dir_index_store(struct dir_index* index, size_t i, const dir_entry_t* dirent) {
+	if (i >= index->length) {
+		if (dir_index_reserve(index, i + 1) != 0)
+			return -1;
+		for (size_t j = index->length; j <= i; ++j) {
+			index->names[j][0] = '\0';
+			if (j >= 2)
+				index->free_count++;
+		}
+		index->length = i + 1;
+	}
+	dir_index_unlink(index, i);
+	const bool was_free = index->names[i][0] == '\0';
+	if (dirent->mode & DF_EXISTS)
+		strncpy(index->names[i], dirent->name, sizeof(index->names[i]));
+	else
+		index->names[i][0] = '\0';
+	const bool is_free = index->names[i][0] == '\0';
+	if (i >= 2 && was_free != is_free) {
+		if (is_free)
+			index->free_count++;
+		else
+			index->free_count--;
+	}
+	dir_index_link(index, i);
+	return 0;
+}
+
+static struct dir_index* dir_index_get(struct dir_index_cache* cache, cluster_t dir_cluster) {
+	for (unsigned i = 0; i < DIR_INDEX_SLOTS; ++i) {
+		if (cache->dirs[i].dir_cluster == dir_cluster) {
+			cache->dirs[i].last_used = ++cache->clock;
+			return &cache->dirs[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Reads all the entries of `dir`, one cluster at a time, into the least recently used slot
+*/
+static struct dir_index* dir_index_build(const struct vmc_meta* vmc_meta, struct dir_index_cache* cache, const dir_entry_t* dir) {
+	struct dir_index* index = &cache->dirs[0];
+	for (unsigned i = 1; i < DIR_INDEX_SLOTS; ++i) {
+		if (cache->dirs[i].last_used < index->last_used)
+			index = &cache->dirs[i];
+	}
+	dir_index_clear(index);
+	if (dir_index_reserve(index, dir->length) != 0) {
+		dir_index_clear(index);
+		return NULL;
+	}
+
+	const size_t k_capacity = fat_cluster_capacity(vmc_meta);
+	const size_t dirents_per_cluster = k_capacity / sizeof(dir_entry_t);
+	dir_entry_t* entries = malloc(k_capacity);
+	if (entries == NULL) {
+		dir_index_clear(index);
+		return NULL;
+	}
+	for (size_t i = 0; i < dir->length; i += dirents_per_cluster) {
+		const size_t count = dir->length - i < dirents_per_cluster ? dir->length - i : dirents_per_cluster;
+		if (fat_read_bytes(vmc_meta, dir->cluster, i * sizeof(dir_entry_t), count * sizeof(dir_entry_t), entries) != count * sizeof(dir_entry_t)) {
+			free(entries);
+			dir_index_clear(index);
+			return NULL;
+		}
+		for (size_t j = 0; j < count; ++j)
+			dir_index_store(index, i + j, &entries[j]);
+	}
+	free(entries);
+	index->dir_cluster = dir->cluster;
+	index->last_used = ++cache->clock;
+	return index;
+}
+
+int dir_index_init(struct vmc_meta* vmc_meta) {
+	struct dir_index_cache* cache = malloc(sizeof(struct dir_index_cache));
+	if (cache == NULL)
+		return -1;
+	for (unsigned i = 0; i < DIR_INDEX_SLOTS; ++i)
+		cache->dirs[i] = (struct dir_index) { .dir_cluster = CLUSTER_INVALID, .length = 0, .capacity = 0, .free_count = 0, .names = NULL, .next = NULL, .buckets = NULL, .last_used = 0 };
+	cache->clock = 0;
+	pthread_mutex_init(&cache->mutex, NULL);
+	vmc_meta->dir_indexes = cache;
+	return 0;
+}
+
+void dir_index_free(struct vmc_meta* vmc_meta) {
+	if (vmc_meta->dir_indexes == NULL)
+		return;
+	for (unsigned i = 0; i < DIR_INDEX_SLOTS; ++i)
+		dir_index_clear(&vmc_meta->dir_indexes->dirs[i]);
+	pthread_mutex_destroy(&vmc_meta->dir_indexes->mutex);
+	free(vmc_meta->dir_indexes);
+	vmc_meta->dir_indexes = NULL;
+}
+
+/**
+ * Returns the index of `dir` with the cache locked, building it if needed. Returns NULL with the cache unlocked on error
+*/
+static struct dir_index* dir_index_lock(const struct vmc_meta* vmc_meta, const dir_entry_t* dir) {
+	struct dir_index_cache* cache = vmc_meta->dir_indexes;
+	if (cache == NULL || dir->cluster == CLUSTER_INVALID)
+		return NULL;
+	pthread_mutex_lock(&cache->mutex);
+	struct dir_index* index = dir_index_get(cache, dir->cluster);
+	if (index == NULL)
+		index = dir_index_build(vmc_meta, cache, dir);
+	if (index == NULL)
+		pthread_mutex_unlock(&cache->mutex);
+	return index;
+}
+
+int dir_index_find(const struct vmc_meta* vmc_meta, const dir_entry_t* dir, const char* name, size_t name_len, size_t* found) {
+	if (name_len == 0 || name_len > 32)
+		return -ENOSYS;
+	struct dir_index* index = dir_index_lock(vmc_meta, dir);
+	if (index == NULL)
+		return -ENOSYS;
+	struct dir_index_cache* cache = vmc_meta->dir_indexes;
+	int err = -ENOENT;
+	uint32_t i = index->buckets[dir_index_hash(index, name, name_len)];
+	for (; i != DIR_INDEX_NONE; i = index->next[i]) {
+		if (i < dir->length && dir_index_name_equals(index->names[i], name, name_len)) {
+			*found = i;
+			err = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+	return err;
+}
+
+int dir_index_find_free(const struct vmc_meta* vmc_meta, const dir_entry_t* dir, size_t* found) {
+	struct dir_index* index = dir_index_lock(vmc_meta, dir);
+	if (index == NULL)
+		return -ENOSYS;
+	int err = -ENOENT;
+	if (index->free_count > 0) {
+		for (size_t i = 2; i < index->length && i < dir->length; ++i) {
+			if (index->names[i][0] == '\0') {
+				*found = i;
+				err = 0;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&vmc_meta->dir_indexes->mutex);
+	return err;
+}
+
+int dir_index_free_count(const struct vmc_meta* vmc_meta, const dir_entry_t* dir, size_t* count) {
+	struct dir_index* index = dir_index_lock(vmc_meta, dir);
+	if (index == NULL)
+		return -ENOSYS;
+	*count = index->free_count;
+	pthread_mutex_unlock(&vmc_meta->dir_indexes->mutex);
+	return 0;
+}
+
+void dir_index_set(const struct vmc_meta* vmc_meta, cluster_t dir_cluster, size_t i, const dir_entry_t* dirent) {
+	struct dir_index_cache* cache = vmc_meta->dir_indexes;
+	if (cache == NULL)
+		return;
+	pthread_mutex_lock(&cache->mutex);
+	struct dir_index* index = dir_index_get(cache, dir_cluster);
+	if (index && dir_index_store(index, i, dirent) != 0)
+		dir_index_clear(index);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+void dir_index_truncate(const struct vmc_meta* vmc_meta, cluster_t dir_cluster, size_t length) {
+	struct dir_index_cache* cache = vmc_meta->dir_indexes;
+	if (cache == NULL)
+		return;
+	pthread_mutex_lock(&cache->mutex);
+	struct dir_index* index = dir_index_get(cache, dir_cluster);
+	if (index) {
+		for (size_t i = length; i < index->length; ++i) {
+			if (i >= 2 && index->names[i][0] == '\0')
+				index->free_count--;
+			dir_index_unlink(index, i);
+		}
+		if (length < index->length)
+			index->length = length;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+void dir_index_forget(const struct vmc_meta* vmc_meta, cluster_t dir_cluster) {
+	struct dir_index_cache* cache = vmc_meta->dir_indexes;
+	if (cache == NULL || dir_cluster == CLUSTER_INVALID)
+		return;
+	pthread_mutex_lock(&cache->mutex);
+	struct dir_index* index = dir_index_get(cache, dir_cluster);
+	if (index)
+		dir_index_clear(index);
+	pthread_mutex_unlock(&cache->mutex);
+}
@@ -0,0 +1,57 @@
+#ifndef __DIR_INDEX_H__
+#define __DIR_INDEX_H__
+
+#include <stddef.h>
+
+#include "vmc_types.h"
+
+#define DIR_INDEX_SLOTS 16
+
+
+/**
+ * Creates the per-directory name indexes. Up to DIR_INDEX_SLOTS directories are indexed at the same time,
+ * the least recently used index is dropped to make room for a new one.
+ * Returns 0 on success or -1 if out of memory
+*/
+int dir_index_init(struct vmc_meta* vmc_meta);
+
+/**
+ * Frees all the directory indexes. Lookups scan the directories afterwards
+*/
+void dir_index_free(struct vmc_meta* vmc_meta);
+
+/**
+ * Finds the index of the child of `dir` whose name is the first `name_len` characters of `name`.
+ * The index of the directory is built on the first lookup.
+ * Returns 0 on success, -ENOENT if there is no such child or -ENOSYS if the directory can't be indexed
+*/
+int dir_index_find(const struct vmc_meta* vmc_meta, const dir_entry_t* dir, const char* name, size_t name_len, size_t* index);
+
+/**
+ * Finds the first deleted entry of `dir` (after "." and ".."), so that its slot can be reused.
+ * Returns 0 on success, -ENOENT if there are no deleted entries or -ENOSYS if the directory can't be indexed
+*/
+int dir_index_find_free(const struct vmc_meta* vmc_meta, const dir_entry_t* dir, size_t* index);
+
+/**
+ * Counts the deleted entries of `dir` (after "." and ".."), building its index if needed.
+ * Returns 0 on success or -ENOSYS if the directory can't be indexed
+*/
+int dir_index_free_count(const struct vmc_meta* vmc_meta, const dir_entry_t* dir, size_t* count);
+
+/**
+ * Updates the index of the directory that starts at `dir_cluster` (if any) after its entry at `index` is written
+*/
+void dir_index_set(const struct vmc_meta* vmc_meta, cluster_t dir_cluster, size_t index, const dir_entry_t* dirent);
+
+/**
+ * Updates the index of the directory that starts at `dir_cluster` (if any) after it shrinks to `length` entries
+*/
+void dir_index_truncate(const struct vmc_meta* vmc_meta, cluster_t dir_cluster, size_t length);
+
+/**
+ * Drops the index of the directory that starts at `dir_cluster`. Must be called when the directory is removed
+*/
+void dir_index_forget(const struct vmc_meta* vmc_meta, cluster_t dir_cluster);
+
+#endif
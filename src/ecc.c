@@ -5,67 +5,249 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include "ecc.h"
 
-// returns 0 if an even number of bits is set. returns 1 of an odd number of bits is set
-bool ecc_byte_parity(uint8_t x) {
-    x ^= x >> 1;
-    x ^= x >> 2;
-    x ^= x >> 4;
-    return x & 1;
-}
+// parity of a byte as a constant expression: 0 if an even number of bits is set, 1 if an odd number of bits is set
+#define ECC_PARITY(x) ((((x) >> 0) ^ ((x) >> 1) ^ ((x) >> 2) ^ ((x) >> 3) ^ ((x) >> 4) ^ ((x) >> 5) ^ ((x) >> 6) ^ ((x) >> 7)) & 1)
 
-uint8_t ecc_column_parity_mask(uint8_t x) {
-    return ecc_byte_parity(x & 0x55) << 0 // 0b01010101
-        | ecc_byte_parity(x & 0x33) << 1  // 0b00110011
-        | ecc_byte_parity(x & 0x0F) << 2  // 0b00001111
-        | ecc_byte_parity(x & 0x00) << 3  // 0b00000000
-        | ecc_byte_parity(x & 0xAA) << 4  // 0b10101010
-        | ecc_byte_parity(x & 0xCC) << 5  // 0b11001100
-        | ecc_byte_parity(x & 0xF0) << 6; // 0b11110000
-}
+// contribution of a byte to the column parity (bits 0-6) plus the parity of the whole byte (bit 7)
+#define ECC_TABLE_ENTRY(x) ( \
+    ECC_PARITY((x) & 0x55) << 0 /* 0b01010101 */ \
+    | ECC_PARITY((x) & 0x33) << 1 /* 0b00110011 */ \
+    | ECC_PARITY((x) & 0x0F) << 2 /* 0b00001111 */ \
+    | ECC_PARITY((x) & 0xAA) << 4 /* 0b10101010 */ \
+    | ECC_PARITY((x) & 0xCC) << 5 /* 0b11001100 */ \
+    | ECC_PARITY((x) & 0xF0) << 6 /* 0b11110000 */ \
+    | ECC_PARITY(x) << 7 \
+)
+#define ECC_TABLE_ROW4(x) ECC_TABLE_ENTRY(x), ECC_TABLE_ENTRY(x + 1), ECC_TABLE_ENTRY(x + 2), ECC_TABLE_ENTRY(x + 3)
+#define ECC_TABLE_ROW16(x) ECC_TABLE_ROW4(x), ECC_TABLE_ROW4(x + 4), ECC_TABLE_ROW4(x + 8), ECC_TABLE_ROW4(x + 12)
+#define ECC_TABLE_ROW64(x) ECC_TABLE_ROW16(x), ECC_TABLE_ROW16(x + 16), ECC_TABLE_ROW16(x + 32), ECC_TABLE_ROW16(x + 48)
 
+static const uint8_t ECC_TABLE[256] = {
+    ECC_TABLE_ROW64(0), ECC_TABLE_ROW64(64), ECC_TABLE_ROW64(128), ECC_TABLE_ROW64(192)
+};
 
 
 void ecc128_calculate(uint8_t* ecc_dest, uint8_t* data_src) {
-    uint8_t* column_parity = ecc_dest;
-    uint8_t* line_parity_0 = ecc_dest+1;
-    uint8_t* line_parity_1 = ecc_dest+2;
-
-    *column_parity = 0x77; // 0b01110111
-    *line_parity_0 = 0x7F; // 0b01111111
-    *line_parity_1 = 0x7F; // 0b01111111
-
+    // the column parity is linear, so the table entries of all the bytes can be xor'ed together.
+    // bit 7 of the accumulated value ends up being the parity of the whole chunk
+    uint8_t column_parity = 0x77; // 0b01110111
+    uint8_t line_parity = 0;
     for (unsigned i = 0; i < 128; ++i) {
-        *column_parity ^= ecc_column_parity_mask(data_src[i]);
-        if (ecc_byte_parity(data_src[i]) != 0) { // if is odd
-            *line_parity_0 ^= ~i;
-            *line_parity_1 ^= i;
-        }
+        const uint8_t entry = ECC_TABLE[data_src[i]];
+        column_parity ^= entry;
+        line_parity ^= i & -(entry >> 7); // xor the index of every byte with odd parity
     }
-    *line_parity_0 &= 0x7F;
+    // line parity 0 xors the complement of the index of every odd byte instead.
+    // that's the same as line parity 1 flipped once per odd byte
+    const uint8_t line_parity_1 = 0x7F ^ line_parity;
+    const uint8_t line_parity_0 = (line_parity_1 ^ -(column_parity >> 7)) & 0x7F;
+
+    ecc_dest[0] = column_parity & 0x77;
+    ecc_dest[1] = line_parity_0;
+    ecc_dest[2] = line_parity_1;
 }
 
-bool ecc128_check(uint8_t* ecc_src, uint8_t* data_src) {
-    // TODO: perform actual verification and error correction
+enum ecc_check_result ecc128_check(uint8_t* ecc_src, uint8_t* data_src) {
     uint8_t calculated[3];
     ecc128_calculate(calculated, data_src);
-    return calculated[0] == ecc_src[0]
-        && calculated[1] == ecc_src[1]
-        && calculated[2] == ecc_src[2];
+    const uint8_t column_diff = (calculated[0] ^ ecc_src[0]) & 0x77;
+    const uint8_t line_0_diff = (calculated[1] ^ ecc_src[1]) & 0x7F;
+    const uint8_t line_1_diff = (calculated[2] ^ ecc_src[2]) & 0x7F;
+    if (column_diff == 0 && line_0_diff == 0 && line_1_diff == 0)
+        return ECC_CHECK_OK;
+
+    // a flipped data bit flips every column parity bit, either in the low half (bit index clear) or the high half (bit index set)
+    // and every line parity bit, either in line parity 0 (byte index clear) or line parity 1 (byte index set).
+    // the high half of the column syndrome is the index of the bit and line parity 1 syndrome is the index of the byte
+    if ((line_0_diff ^ line_1_diff) == 0x7F && ((column_diff >> 4) ^ (column_diff & 0x07)) == 0x07) {
+        data_src[line_1_diff] ^= 1 << (column_diff >> 4);
+        return ECC_CHECK_CORRECTED;
+    }
+    // a single flipped bit in the ECC bytes themselves
+    if (__builtin_popcount(column_diff) + __builtin_popcount(line_0_diff) + __builtin_popcount(line_1_diff) == 1) {
+        ecc_src[0] = calculated[0];
+        ecc_src[1] = calculated[1];
+        ecc_src[2] = calculated[2];
+        return ECC_CHECK_CORRECTED;
+    }
+    // two or more flipped bits can be detected, but not corrected
+    return ECC_CHECK_FAILED;
 }
 
 
-void ecc512_calculate(uint8_t* ecc_dest, uint8_t* data_src) {
+/*
+ * Whole page kernels
+ *
+ * Besides the byte-at-a-time table kernel, the ECC of a 128-byte chunk can be computed from:
+ *  - the xor of all its bytes, which gives the column parity (and the parity of the chunk) with a single table lookup
+ *  - a 128-bit mask with the bytes that have odd parity. Bit j of line parity 1 is the parity of the odd bytes
+ *    whose index has bit j set, which is the parity of the popcount of the mask and'ed with a fixed pattern
+ */
+
+// bits of the odd-byte mask whose byte index has bit 0, 1, ... 5 set. bit 6 selects the upper half of the mask
+static const uint64_t ECC_LINE_PATTERNS[6] = {
+    0xAAAAAAAAAAAAAAAA, 0xCCCCCCCCCCCCCCCC, 0xF0F0F0F0F0F0F0F0,
+    0xFF00FF00FF00FF00, 0xFFFF0000FFFF0000, 0xFFFFFFFF00000000,
+};
+
+static inline __attribute__((always_inline)) void ecc128_from_masks(uint8_t* ecc_dest, uint64_t xor_all, uint64_t odd_low, uint64_t odd_high) {
+    xor_all ^= xor_all >> 32;
+    xor_all ^= xor_all >> 16;
+    xor_all ^= xor_all >> 8;
+    const uint8_t column_parity = 0x77 ^ ECC_TABLE[xor_all & 0xFF];
+
+    const uint64_t odd = odd_low ^ odd_high;
+    uint8_t line_parity = (__builtin_popcountll(odd_high) & 1) << 6;
+    for (unsigned j = 0; j < 6; ++j)
+        line_parity |= (__builtin_popcountll(odd & ECC_LINE_PATTERNS[j]) & 1) << j;
+
+    const uint8_t line_parity_1 = 0x7F ^ line_parity;
+    ecc_dest[0] = column_parity & 0x77;
+    ecc_dest[1] = (line_parity_1 ^ -(column_parity >> 7)) & 0x7F;
+    ecc_dest[2] = line_parity_1;
+}
+
+static void ecc512_calculate_table(uint8_t* ecc_dest, const uint8_t* data_src) {
+    for (unsigned i = 0; i < 512/128; ++i) {
+        ecc128_calculate(ecc_dest + i * 3, (uint8_t*) data_src + i * 128);
+    }
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// processes 8 bytes at a time. lane k of a 64-bit word holds the byte at index 8 * word + k
+static inline __attribute__((always_inline)) void ecc512_calculate_words_impl(uint8_t* ecc_dest, const uint8_t* data_src) {
     for (unsigned i = 0; i < 512/128; ++i) {
-        ecc128_calculate(ecc_dest + i * 3, data_src + i * 128);
+        uint64_t xor_all = 0;
+        uint64_t odd[2] = {0, 0};
+        for (unsigned w = 0; w < 16; ++w) {
+            uint64_t word;
+            memcpy(&word, data_src + i * 128 + w * 8, sizeof(word));
+            xor_all ^= word;
+            // fold the parity of every lane into its lowest bit, then gather those bits into a byte
+            uint64_t parity = word ^ (word >> 4);
+            parity ^= parity >> 2;
+            parity ^= parity >> 1;
+            parity &= 0x0101010101010101;
+            odd[w / 8] |= ((parity * 0x0102040810204080) >> 56) << (w % 8 * 8);
+        }
+        ecc128_from_masks(ecc_dest + i * 3, xor_all, odd[0], odd[1]);
     }
 }
 
-bool ecc512_check(uint8_t* ecc_src, uint8_t* data_src) {
+static void ecc512_calculate_words(uint8_t* ecc_dest, const uint8_t* data_src) {
+    ecc512_calculate_words_impl(ecc_dest, data_src);
+}
+#endif
+
+#if defined(__x86_64__)
+__attribute__((target("popcnt")))
+static void ecc512_calculate_words_popcnt(uint8_t* ecc_dest, const uint8_t* data_src) {
+    ecc512_calculate_words_impl(ecc_dest, data_src);
+}
+
+// processes 32 bytes at a time. the parity of every byte comes from a 16-entry nibble parity lookup
+__attribute__((target("avx2,popcnt")))
+static void ecc512_calculate_avx2(uint8_t* ecc_dest, const uint8_t* data_src) {
+    const __m256i nibble_parity = _mm256_setr_epi8(
+        0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
+        0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0
+    );
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0F);
     for (unsigned i = 0; i < 512/128; ++i) {
-        if (!ecc128_check(ecc_src + i * 3, data_src + i * 128))
-            return false;
+        __m256i xor_all = _mm256_setzero_si256();
+        uint64_t odd[2] = {0, 0};
+        for (unsigned v = 0; v < 4; ++v) {
+            const __m256i data = _mm256_loadu_si256((const __m256i*) (data_src + i * 128 + v * 32));
+            xor_all = _mm256_xor_si256(xor_all, data);
+            const __m256i parity = _mm256_xor_si256(
+                _mm256_shuffle_epi8(nibble_parity, _mm256_and_si256(data, low_nibbles)),
+                _mm256_shuffle_epi8(nibble_parity, _mm256_and_si256(_mm256_srli_epi16(data, 4), low_nibbles))
+            );
+            const uint32_t mask = _mm256_movemask_epi8(_mm256_slli_epi16(parity, 7));
+            odd[v / 2] |= (uint64_t) mask << (v % 2 * 32);
+        }
+        const __m128i halves = _mm_xor_si128(_mm256_castsi256_si128(xor_all), _mm256_extracti128_si256(xor_all, 1));
+        const uint64_t folded = (uint64_t) _mm_cvtsi128_si64(halves) ^ (uint64_t) _mm_extract_epi64(halves, 1);
+        ecc128_from_masks(ecc_dest + i * 3, folded, odd[0], odd[1]);
     }
+}
+#endif
+
+static const struct {
+    const char* name;
+    void (*calculate)(uint8_t* ecc_dest, const uint8_t* data_src);
+} ECC512_KERNELS[] = {
+#if defined(__x86_64__)
+    { "avx2", ecc512_calculate_avx2 },
+    { "popcnt", ecc512_calculate_words_popcnt },
+#endif
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    { "words", ecc512_calculate_words },
+#endif
+    { "table", ecc512_calculate_table },
+};
+
+static bool ecc512_kernel_supported(const char* name) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (strcmp(name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+    if (strcmp(name, "popcnt") == 0)
+        return __builtin_cpu_supports("popcnt");
+#endif
     return true;
+}
+
+static unsigned ecc512_kernel = sizeof(ECC512_KERNELS) / sizeof(ECC512_KERNELS[0]) - 1;
+
+// picks the fastest kernel supported by the CPU before main() runs
+__attribute__((constructor))
+static void ecc512_select_default_kernel(void) {
+    for (unsigned i = 0; i < sizeof(ECC512_KERNELS) / sizeof(ECC512_KERNELS[0]); ++i) {
+        if (ecc512_kernel_supported(ECC512_KERNELS[i].name)) {
+            ecc512_kernel = i;
+            return;
+        }
+    }
+}
+
+const char* ecc512_kernel_name(void) {
+    return ECC512_KERNELS[ecc512_kernel].name;
+}
+
+bool ecc512_select_kernel(const char* name) {
+    for (unsigned i = 0; i < sizeof(ECC512_KERNELS) / sizeof(ECC512_KERNELS[0]); ++i) {
+        if (strcmp(ECC512_KERNELS[i].name, name) == 0 && ecc512_kernel_supported(name)) {
+            ecc512_kernel = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ecc512_calculate(uint8_t* ecc_dest, uint8_t* data_src) {
+    ECC512_KERNELS[ecc512_kernel].calculate(ecc_dest, data_src);
+}
+
+enum ecc_check_result ecc512_check(uint8_t* ecc_src, uint8_t* data_src) {
+    uint8_t calculated[12];
+    ecc512_calculate(calculated, data_src);
+    if (memcmp(calculated, ecc_src, sizeof(calculated)) == 0)
+        return ECC_CHECK_OK;
+    // only decode the syndromes of the chunks that don't match
+    enum ecc_check_result result = ECC_CHECK_OK;
+    for (unsigned i = 0; i < 512/128; ++i) {
+        if (memcmp(calculated + i * 3, ecc_src + i * 3, 3) != 0) {
+            enum ecc_check_result chunk_result = ecc128_check(ecc_src + i * 3, data_src + i * 128);
+            if (chunk_result > result)
+                result = chunk_result;
+        }
+    }
+    return result;
 }
\ No newline at end of file
@@ -3,19 +3,35 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 // data size is always 128 byte (i.e: page chunk size)
 
 // reads the 128 bytes of data pointed at by `data_src` and writes the 3-byte hamming code in `ecc_dest`
 void ecc128_calculate(uint8_t* ecc_dest, uint8_t* data_src);
 
-// verifies the 3-byte hamming code pointed at by `ecc_src` against the 128 bytes of data pointed at by `data_src`
-bool ecc128_check(uint8_t* ecc_src, uint8_t* data_src);
+enum ecc_check_result {
+    ECC_CHECK_OK = 0,        // the data matches its hamming code
+    ECC_CHECK_CORRECTED = 1, // a single bit error was found and fixed
+    ECC_CHECK_FAILED = 2,    // the data has more errors than can be corrected
+};
+
+// verifies the 3-byte hamming code pointed at by `ecc_src` against the 128 bytes of data pointed at by `data_src`.
+// single bit errors are corrected in place, either in the data or in the hamming code
+enum ecc_check_result ecc128_check(uint8_t* ecc_src, uint8_t* data_src);
 
 // calculates the ecc bytes for a whole page
 void ecc512_calculate(uint8_t* ecc_dest, uint8_t* data_src);
 
-// verifies the ecc bytes for a whole page
-bool ecc512_check(uint8_t* ecc_src, uint8_t* data_src);
+// verifies the ecc bytes for a whole page, correcting single bit errors in each 128-byte chunk.
+// returns the worst result among the chunks
+enum ecc_check_result ecc512_check(uint8_t* ecc_src, uint8_t* data_src);
+
+// returns the name of the kernel used by ecc512_calculate() and ecc512_check().
+// the fastest kernel supported by the CPU is picked at startup
+const char* ecc512_kernel_name(void);
+
+// forces the use of a kernel ("avx2", "popcnt", "words" or "table"). returns false if it's not supported by the CPU
+bool ecc512_select_kernel(const char* name);
 
 #endif
@@ -1,26 +1,25 @@
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "fat.h"
 #include "ecc.h"
+#include "mc_image.h"
 #include "vmc_types.h"
 #include "utils.h"
 
-/* file reading primitives for endianness-independent reading of structs and integers (PS2 Memory cards use little endian) */
-uint32_t fread_uint32_t(FILE* f) {
-	uint8_t result[sizeof(uint32_t)];
-	fread(result, sizeof(uint32_t), 1, f);
-	return result[0] + result[1] * (1<<8) + result[2] * (1<<16) + result[3] * (1 << 24);
+/* buffer primitives for endianness-independent reading and writing of integers (PS2 Memory cards use little endian) */
+static uint32_t read_uint32_t(const uint8_t* buffer) {
+	return buffer[0] + buffer[1] * (1u<<8) + buffer[2] * (1u<<16) + buffer[3] * (1u << 24);
 }
 
-void fwrite_uint32_t(FILE* f, uint32_t value) {
-	uint8_t buffer[sizeof(uint32_t)];
+static void write_uint32_t(uint8_t* buffer, uint32_t value) {
 	buffer[0] = value;
 	buffer[1] = value / (1<<8);
 	buffer[2] = value / (1<<16);
 	buffer[3] = value / (1<<24);
-	fwrite(buffer, sizeof(uint32_t), 1, f);
 }
 
 
@@ -31,50 +30,352 @@ size_t fat_page_capacity(const struct vmc_meta* vmc_meta)    { return vmc_meta->
 size_t fat_cluster_size(const struct vmc_meta* vmc_meta)     { return fat_page_size(vmc_meta) * vmc_meta->superblock.pages_per_cluster; }
 size_t fat_cluster_capacity(const struct vmc_meta* vmc_meta) { return fat_page_capacity(vmc_meta) * vmc_meta->superblock.pages_per_cluster; }
 
-physical_offset_t fat_logical_to_physical_offset(const struct vmc_meta* vmc_meta, cluster_t cluster, logical_offset_t bytes_offset) {
-	const size_t k_capacity = fat_cluster_capacity(vmc_meta);
-	const size_t k_size = fat_cluster_size(vmc_meta);
+/**
+ * Returns the physical byte offset of a byte inside a cluster, relative to the start of the memory card
+*/
+physical_offset_t fat_cluster_to_physical_offset(const struct vmc_meta* vmc_meta, cluster_t cluster, logical_offset_t bytes_offset) {
 	const size_t p_capacity = fat_page_capacity(vmc_meta);
-	const size_t p_size = fat_page_size(vmc_meta);
-	cluster = fat_seek(vmc_meta, cluster, bytes_offset / k_capacity);
-	bytes_offset = bytes_offset % k_capacity;
 	cluster += vmc_meta->superblock.first_allocatable;
-	return cluster * k_size + bytes_offset / p_capacity * p_size;
+	return cluster * fat_cluster_size(vmc_meta) + bytes_offset / p_capacity * fat_page_size(vmc_meta) + bytes_offset % p_capacity;
 }
 
 /* R/W operations on the FAT table */
 
-size_t fat_get_entry_offset(const struct vmc_meta* vmc_meta, cluster_t clus) {
-	size_t cluster_capacity = fat_cluster_capacity(vmc_meta);
-	size_t cluster_size = fat_cluster_size(vmc_meta);
+struct fat_cache {
+	union fat_entry* entries; // decoded FAT table, indexed by cluster
+	size_t entry_count;       // always a whole number of FAT clusters
+	cluster_t* fat_clusters;  // physical cluster index of each FAT cluster, as listed by the indirect FAT
+	size_t fat_cluster_count;
+	bool* dirty_pages;        // one flag per FAT page, set when the page has to be written back to the card
+	uint64_t* free_bitmap;    // one bit per allocatable cluster, set when the cluster is free
+	size_t free_count;        // number of bits set in `free_bitmap`
+	struct fat_chain_index chains[FAT_CHAIN_INDEX_SLOTS]; // most recently used chain indexes
+	uint8_t* chain_owner;     // for each cluster, 1 + the slot of the chain index it belongs to, or 0
+	uint32_t* chain_position; // for each cluster in an indexed chain, its position in the chain
+	unsigned long chain_clock;
+	pthread_mutex_t chain_lock; // the chain indexes are rebuilt by reads, which may run in parallel
+	size_t ecc_corrected;     // number of pages read with a correctable ECC error
+	size_t ecc_failed;        // number of pages read with an uncorrectable ECC error
+	pthread_rwlock_t io_lock; // shared by reads and writes, exclusive while a cluster is scrubbed
+	uint64_t io_generation;   // incremented by every read or write
+	pthread_mutex_t repair_lock;
+	cluster_t repair_queue[FAT_REPAIR_QUEUE_SIZE]; // clusters where reads found ECC errors, see fat_repair_queued()
+	size_t repair_count;
+};
+
+physical_offset_t fat_logical_to_physical_offset(const struct vmc_meta* vmc_meta, cluster_t cluster, logical_offset_t bytes_offset) {
+	const size_t k_capacity = fat_cluster_capacity(vmc_meta);
+	size_t position;
+	pthread_mutex_lock(&vmc_meta->fat->chain_lock);
+	const struct fat_chain_index* chain = fat_chain_index_get(vmc_meta, cluster, &position);
+	if (chain == NULL || position + bytes_offset / k_capacity >= chain->length)
+		cluster = CLUSTER_INVALID;
+	else
+		cluster = chain->clusters[position + bytes_offset / k_capacity];
+	pthread_mutex_unlock(&vmc_meta->fat->chain_lock);
+	return fat_cluster_to_physical_offset(vmc_meta, cluster, bytes_offset % k_capacity);
+}
+
+/**
+ * Forgets a chain index. Called whenever one of the FAT entries of the chain changes
+*/
+void fat_chain_index_invalidate(const struct vmc_meta* vmc_meta, struct fat_chain_index* chain) {
+	if (chain->first == CLUSTER_INVALID)
+		return;
+	for (size_t i = 0; i < chain->length; ++i)
+		vmc_meta->fat->chain_owner[chain->clusters[i]] = 0;
+	chain->first = CLUSTER_INVALID;
+	chain->length = 0;
+}
+
+/**
+ * Keeps the free space bitmap and counter in sync with a FAT entry change
+*/
+void fat_update_free_bitmap(const struct vmc_meta* vmc_meta, cluster_t clus, bool occupied) {
+	struct fat_cache* fat = vmc_meta->fat;
+	if (clus >= vmc_meta->superblock.last_allocatable)
+		return;
+	const uint64_t mask = UINT64_C(1) << (clus % 64);
+	const bool was_free = fat->free_bitmap[clus / 64] & mask;
+	if (was_free && occupied) {
+		fat->free_bitmap[clus / 64] &= ~mask;
+		fat->free_count--;
+	}
+	else if (!was_free && !occupied) {
+		fat->free_bitmap[clus / 64] |= mask;
+		fat->free_count++;
+	}
+}
+
+size_t fat_entries_per_page(const struct vmc_meta* vmc_meta) { return fat_page_capacity(vmc_meta) / sizeof(union fat_entry); }
+
+/**
+ * Returns the physical offset of the n-th page of the FAT table
+*/
+physical_offset_t fat_table_page_offset(const struct vmc_meta* vmc_meta, size_t page) {
+	const uint16_t pages_per_cluster = vmc_meta->superblock.pages_per_cluster;
+	cluster_t fat_cluster = vmc_meta->fat->fat_clusters[page / pages_per_cluster];
+	return fat_cluster * fat_cluster_size(vmc_meta) + page % pages_per_cluster * fat_page_size(vmc_meta);
+}
+
+int fat_load(struct vmc_meta* vmc_meta) {
+	const size_t k = fat_cluster_capacity(vmc_meta) / sizeof(union fat_entry); // fat/indirfat entries per cluster (256 in a typical card)
+	const size_t entries_per_page = fat_entries_per_page(vmc_meta);
+	const size_t p_capacity = fat_page_capacity(vmc_meta);
+	const size_t p_size = fat_page_size(vmc_meta);
+
+	// the sizes come straight from the superblock of the image, which may be damaged
+	if (k == 0 || entries_per_page == 0 || vmc_meta->superblock.last_allocatable == 0)
+		return -1;
+	struct fat_cache* fat = malloc(sizeof(struct fat_cache));
+	if (fat == NULL)
+		return -1;
+	fat->fat_cluster_count = div_ceil(vmc_meta->superblock.last_allocatable, k);
+	fat->entry_count = fat->fat_cluster_count * k;
+	fat->fat_clusters = malloc(fat->fat_cluster_count * sizeof(cluster_t));
+	fat->entries = malloc(fat->entry_count * sizeof(union fat_entry));
+	fat->dirty_pages = calloc(fat->entry_count / entries_per_page, sizeof(bool));
+	fat->free_bitmap = calloc(div_ceil(vmc_meta->superblock.last_allocatable, 64), sizeof(uint64_t));
+	fat->free_count = 0;
+	fat->ecc_corrected = 0;
+	fat->ecc_failed = 0;
+	pthread_rwlock_init(&fat->io_lock, NULL);
+	fat->io_generation = 0;
+	fat->chain_owner = calloc(fat->entry_count, sizeof(uint8_t));
+	fat->chain_position = calloc(fat->entry_count, sizeof(uint32_t));
+	fat->chain_clock = 0;
+	pthread_mutex_init(&fat->chain_lock, NULL);
+	pthread_mutex_init(&fat->repair_lock, NULL);
+	fat->repair_count = 0;
+	for (unsigned i = 0; i < FAT_CHAIN_INDEX_SLOTS; ++i)
+		fat->chains[i] = (struct fat_chain_index) { .first = CLUSTER_INVALID, .clusters = NULL, .length = 0, .capacity = 0, .last_used = 0 };
+	vmc_meta->fat = fat;
+	if (!fat->fat_clusters || !fat->entries || !fat->dirty_pages || !fat->free_bitmap || !fat->chain_owner || !fat->chain_position) {
+		fprintf(stderr, "Could not allocate the FAT cache for %lu clusters\n", fat->entry_count);
+		fat_unload(vmc_meta);
+		return -1;
+	}
+
+	// the indirect FAT lists the FAT clusters
+	for (size_t i = 0; i < fat->fat_cluster_count; ++i) {
+		if (i / k >= sizeof(vmc_meta->superblock.indirect_fat_clusters) / sizeof(uint32_t)) {
+			fprintf(stderr, "FAT table is too big: %lu clusters\n", fat->fat_cluster_count);
+			fat_unload(vmc_meta);
+			return -1;
+		}
+		const uint32_t indirect_cluster = vmc_meta->superblock.indirect_fat_clusters[i / k];
+		const size_t offset = i % k * sizeof(union fat_entry);
+		const size_t entry_offset = indirect_cluster * fat_cluster_size(vmc_meta) + offset / p_capacity * p_size + offset % p_capacity;
+		if (entry_offset + sizeof(uint32_t) > vmc_meta->raw_size) {
+			fat_unload(vmc_meta);
+			return -1;
+		}
+		fat->fat_clusters[i] = read_uint32_t(vmc_meta->raw_data + entry_offset);
+	}
+	// then decode the FAT itself one page at a time
+	for (size_t page = 0; page < fat->entry_count / entries_per_page; ++page) {
+		const physical_offset_t page_offset = fat_table_page_offset(vmc_meta, page);
+		if (page_offset + p_capacity > vmc_meta->raw_size) {
+			fat_unload(vmc_meta);
+			return -1;
+		}
+		for (size_t i = 0; i < entries_per_page; ++i)
+			fat->entries[page * entries_per_page + i].raw = read_uint32_t(vmc_meta->raw_data + page_offset + i * sizeof(union fat_entry));
+	}
+
+	for (cluster_t clus = 0; clus < vmc_meta->superblock.last_allocatable; ++clus)
+		fat_update_free_bitmap(vmc_meta, clus, fat->entries[clus].entry.occupied);
+	return 0;
+}
 
-	uint32_t k = cluster_capacity / sizeof(union fat_entry); // fat/indirfat entries per cluster (256 in a typical card)
-	uint32_t fat_offset = clus % k;
-	uint32_t indirect_index = clus / k;
-	uint32_t indirect_offset = indirect_index % k;
-	uint32_t dbl_indirect_index = indirect_index / k;
-	uint32_t indirect_cluster_num = vmc_meta->superblock.indirect_fat_clusters[dbl_indirect_index];
+int fat_flush(const struct vmc_meta* vmc_meta) {
+	struct fat_cache* fat = vmc_meta->fat;
+	const size_t entries_per_page = fat_entries_per_page(vmc_meta);
+	const size_t p_capacity = fat_page_capacity(vmc_meta);
 
+	fat_repair_queued(vmc_meta);
+	for (size_t page = 0; page < fat->entry_count / entries_per_page; ++page) {
+		if (!fat->dirty_pages[page])
+			continue;
+		uint8_t* page_data = vmc_meta->raw_data + fat_table_page_offset(vmc_meta, page);
+		for (size_t i = 0; i < entries_per_page; ++i)
+			write_uint32_t(page_data + i * sizeof(union fat_entry), fat->entries[page * entries_per_page + i].raw);
+		// the rest of the spare area is left untouched
+		if (vmc_meta->ecc_bytes == 12)
+			ecc512_calculate(page_data + p_capacity, page_data);
+		mc_image_mark_metadata(vmc_meta, fat_table_page_offset(vmc_meta, page), fat_page_size(vmc_meta));
+		fat->dirty_pages[page] = false;
+	}
+	return 0;
+}
 
-	uint32_t fat_cluster_offset = indirect_cluster_num * cluster_size + indirect_offset * sizeof(union fat_entry);
-	fseek(vmc_meta->file, fat_cluster_offset, SEEK_SET);
-	uint32_t fat_cluster_num = fread_uint32_t(vmc_meta->file);
-	return fat_cluster_num * cluster_size + fat_offset * sizeof(union fat_entry);
+void fat_unload(struct vmc_meta* vmc_meta) {
+	if (vmc_meta->fat == NULL)
+		return;
+	free(vmc_meta->fat->entries);
+	free(vmc_meta->fat->fat_clusters);
+	free(vmc_meta->fat->dirty_pages);
+	free(vmc_meta->fat->free_bitmap);
+	free(vmc_meta->fat->chain_owner);
+	free(vmc_meta->fat->chain_position);
+	for (unsigned i = 0; i < FAT_CHAIN_INDEX_SLOTS; ++i)
+		free(vmc_meta->fat->chains[i].clusters);
+	pthread_rwlock_destroy(&vmc_meta->fat->io_lock);
+	pthread_mutex_destroy(&vmc_meta->fat->chain_lock);
+	pthread_mutex_destroy(&vmc_meta->fat->repair_lock);
+	free(vmc_meta->fat);
+	vmc_meta->fat = NULL;
 }
 
 union fat_entry fat_get_table_entry(const struct vmc_meta* vmc_meta, cluster_t clus) {
-	fseek(vmc_meta->file, fat_get_entry_offset(vmc_meta, clus), SEEK_SET);
-	union fat_entry result = {.raw = fread_uint32_t(vmc_meta->file)};
-	return result;
+	if (clus >= vmc_meta->fat->entry_count)
+		return FAT_ENTRY_TERMINATOR;
+	return vmc_meta->fat->entries[clus];
 }
 
 void fat_set_table_entry(const struct vmc_meta* vmc_meta, cluster_t clus, union fat_entry newval) {
-	fseek(vmc_meta->file, fat_get_entry_offset(vmc_meta, clus), SEEK_SET);
-	fwrite_uint32_t(vmc_meta->file, newval.raw);
+	if (clus >= vmc_meta->fat->entry_count)
+		return;
+	const uint8_t owner = vmc_meta->fat->chain_owner[clus];
+	if (owner != 0)
+		fat_chain_index_invalidate(vmc_meta, &vmc_meta->fat->chains[owner - 1]);
+	vmc_meta->fat->entries[clus] = newval;
+	vmc_meta->fat->dirty_pages[clus / fat_entries_per_page(vmc_meta)] = true;
+	fat_update_free_bitmap(vmc_meta, clus, newval.entry.occupied);
 }
 
-cluster_t fat_allocate(const struct vmc_meta* vmc_meta, size_t len) {
-	cluster_t start = fat_find_free_cluster(vmc_meta, 0);
+const struct fat_chain_index* fat_chain_index_get(const struct vmc_meta* vmc_meta, cluster_t clus0, size_t* position) {
+	struct fat_cache* fat = vmc_meta->fat;
+	if (clus0 >= fat->entry_count)
+		return NULL;
+	const uint8_t owner = fat->chain_owner[clus0];
+	if (owner != 0) {
+		// `clus0` may also be in the middle of an indexed chain
+		fat->chains[owner - 1].last_used = ++fat->chain_clock;
+		*position = fat->chain_position[clus0];
+		return &fat->chains[owner - 1];
+	}
+
+	// (re)build the index in the least recently used slot
+	unsigned slot = 0;
+	for (unsigned i = 1; i < FAT_CHAIN_INDEX_SLOTS; ++i) {
+		if (fat->chains[i].last_used < fat->chains[slot].last_used)
+			slot = i;
+	}
+	struct fat_chain_index* chain = &fat->chains[slot];
+	fat_chain_index_invalidate(vmc_meta, chain);
+
+	// if the chain joins an already indexed one, that index is dropped since only one index may own a cluster
+	cluster_t clus = clus0;
+	while (clus < fat->entry_count && fat->chain_owner[clus] != slot + 1) {
+		if (fat->chain_owner[clus] != 0)
+			fat_chain_index_invalidate(vmc_meta, &fat->chains[fat->chain_owner[clus] - 1]);
+		if (chain->length == chain->capacity) {
+			chain->capacity = MAX(chain->capacity * 2, 16);
+			chain->clusters = realloc(chain->clusters, chain->capacity * sizeof(cluster_t));
+		}
+		fat->chain_position[clus] = chain->length;
+		chain->clusters[chain->length++] = clus;
+		fat->chain_owner[clus] = slot + 1; // this also stops the walk if the chain loops
+		union fat_entry fat_value = fat->entries[clus];
+		if (fat_value.raw == FAT_ENTRY_TERMINATOR.raw || !fat_value.entry.occupied)
+			break;
+		clus = fat_value.entry.next_cluster;
+	}
+	chain->first = clus0;
+	chain->last_used = ++fat->chain_clock;
+	*position = 0;
+	return chain;
+}
+
+void fat_ecc_error_counts(const struct vmc_meta* vmc_meta, size_t* corrected, size_t* uncorrectable) {
+	*corrected = __atomic_load_n(&vmc_meta->fat->ecc_corrected, __ATOMIC_RELAXED);
+	*uncorrectable = __atomic_load_n(&vmc_meta->fat->ecc_failed, __ATOMIC_RELAXED);
+}
+
+uint64_t fat_io_generation(const struct vmc_meta* vmc_meta) {
+	return __atomic_load_n(&vmc_meta->fat->io_generation, __ATOMIC_RELAXED);
+}
+
+size_t fat_free_cluster_count(const struct vmc_meta* vmc_meta) {
+	return vmc_meta->fat->free_count;
+}
+
+/**
+ * Returns the first cluster from `clus` whose bit in `bitmap` is `set`, or `count` if there is none
+*/
+static size_t fat_bitmap_scan(const uint64_t* bitmap, size_t clus, size_t count, bool set) {
+	while (clus < count) {
+		uint64_t bits = set ? bitmap[clus / 64] : ~bitmap[clus / 64];
+		bits &= UINT64_MAX << (clus % 64);
+		if (bits != 0)
+			return MIN(clus - clus % 64 + __builtin_ctzll(bits), count);
+		clus = clus - clus % 64 + 64;
+	}
+	return count;
+}
+
+static inline bool fat_is_free(const struct vmc_meta* vmc_meta, cluster_t clus) {
+	return clus < vmc_meta->superblock.last_allocatable && (vmc_meta->fat->free_bitmap[clus / 64] & (UINT64_C(1) << (clus % 64)));
+}
+
+cluster_t fat_find_free_run(const struct vmc_meta* vmc_meta, size_t len) {
+	const uint64_t* bitmap = vmc_meta->fat->free_bitmap;
+	const size_t count = vmc_meta->superblock.last_allocatable;
+	cluster_t best = CLUSTER_INVALID, largest = CLUSTER_INVALID;
+	size_t best_length = SIZE_MAX, largest_length = 0;
+	size_t clus = 0;
+	while (clus < count) {
+		const size_t start = fat_bitmap_scan(bitmap, clus, count, true);
+		if (start == count)
+			break;
+		const size_t end = fat_bitmap_scan(bitmap, start, count, false);
+		const size_t length = end - start;
+		if (length >= len && length < best_length) {
+			best = start;
+			best_length = length;
+			if (length == len)
+				break;
+		}
+		if (length > largest_length) {
+			largest = start;
+			largest_length = length;
+		}
+		clus = end;
+	}
+	return best != CLUSTER_INVALID ? best : largest;
+}
+
+void fat_fragmentation(const struct vmc_meta* vmc_meta, struct fat_fragmentation* stats) {
+	const struct fat_cache* fat = vmc_meta->fat;
+	const size_t count = vmc_meta->superblock.last_allocatable;
+	*stats = (struct fat_fragmentation) {0};
+	for (size_t clus = 0; clus < count; ++clus) {
+		const union fat_entry value = fat->entries[clus];
+		if (!value.entry.occupied)
+			continue;
+		// every chain ends in one extent, and every jump to a cluster that isn't the next one starts another
+		if (value.raw == FAT_ENTRY_TERMINATOR.raw) {
+			stats->chains++;
+			stats->extents++;
+		}
+		else if (value.entry.next_cluster != clus + 1)
+			stats->extents++;
+	}
+	for (size_t clus = 0; clus < count;) {
+		const size_t start = fat_bitmap_scan(fat->free_bitmap, clus, count, true);
+		if (start == count)
+			break;
+		clus = fat_bitmap_scan(fat->free_bitmap, start, count, false);
+		stats->free_runs++;
+		stats->largest_free_run = MAX(stats->largest_free_run, clus - start);
+	}
+}
+
+/**
+ * Makes a new list of `len` clusters that starts at the free cluster `start`
+*/
+static cluster_t fat_allocate_at(const struct vmc_meta* vmc_meta, cluster_t start, size_t len) {
 	if (start == CLUSTER_INVALID)
 		return CLUSTER_INVALID;
 	fat_set_table_entry(vmc_meta, start, FAT_ENTRY_TERMINATOR);
@@ -86,6 +387,14 @@ cluster_t fat_allocate(const struct vmc_meta* vmc_meta, size_t len) {
 	return start;
 }
 
+cluster_t fat_allocate(const struct vmc_meta* vmc_meta, size_t len) {
+	return fat_allocate_at(vmc_meta, fat_find_free_run(vmc_meta, len), len);
+}
+
+cluster_t fat_allocate_near(const struct vmc_meta* vmc_meta, size_t len, cluster_t near) {
+	return fat_allocate_at(vmc_meta, fat_find_free_cluster(vmc_meta, near), len);
+}
+
 cluster_t fat_seek(const struct vmc_meta* vmc_meta, cluster_t cluster, size_t count) {
 	while(count > 0) {
 		union fat_entry fat_value = fat_get_table_entry(vmc_meta, cluster);
@@ -110,11 +419,21 @@ cluster_t fat_seek_last_cluster(const struct vmc_meta* vmc_meta, cluster_t clust
 }
 
 cluster_t fat_find_free_cluster(const struct vmc_meta* vmc_meta, cluster_t clus) {
-	for (uint32_t i = 0; i < vmc_meta->superblock.last_allocatable; ++i) {
-		cluster_t current_cluster = (clus+i) % vmc_meta->superblock.last_allocatable;
-		union fat_entry fat_value = fat_get_table_entry(vmc_meta, current_cluster);
-		if (fat_value.entry.occupied == 0)
-			return current_cluster;
+	const struct fat_cache* fat = vmc_meta->fat;
+	if (fat->free_count == 0)
+		return CLUSTER_INVALID;
+	if (clus >= vmc_meta->superblock.last_allocatable)
+		clus = 0;
+	// scan the bitmap one word at a time, starting at `clus` and wrapping around to the start of the card.
+	// bits past `last_allocatable` are never set so there's no need to mask the last word
+	const size_t word_count = div_ceil(vmc_meta->superblock.last_allocatable, 64);
+	size_t word = clus / 64;
+	uint64_t bits = fat->free_bitmap[word] & (UINT64_MAX << (clus % 64));
+	for (size_t i = 0; i <= word_count; ++i) {
+		if (bits != 0)
+			return word * 64 + __builtin_ctzll(bits);
+		word = (word + 1) % word_count;
+		bits = fat->free_bitmap[word];
 	}
 	return CLUSTER_INVALID;
 }
@@ -155,7 +474,11 @@ cluster_t fat_truncate(const struct vmc_meta* vmc_meta, cluster_t clus, size_t t
 	// case 2: truncated size is greater than the size of the list
 	// add new clusters until we reach the desired truncated length
 	while (truncated_length > 1 && fat_value.raw == FAT_ENTRY_TERMINATOR.raw) {
-		cluster_t new_clus = fat_find_free_cluster(vmc_meta, 0);
+		// the chain stays contiguous while the next cluster is free, otherwise it continues in the free run
+		// that best fits the rest of the clusters
+		cluster_t new_clus = clus + 1;
+		if (!fat_is_free(vmc_meta, new_clus))
+			new_clus = fat_find_free_run(vmc_meta, truncated_length - 1);
 		if (new_clus == CLUSTER_INVALID) {
 			// we might run out of space while allocating new clusters
 			// in that case, delete the chain we just built and return
@@ -173,64 +496,270 @@ cluster_t fat_truncate(const struct vmc_meta* vmc_meta, cluster_t clus, size_t t
 	return clus;
 }
 
+cluster_t fat_extend(const struct vmc_meta* vmc_meta, cluster_t clus, size_t count) {
+	// a chain that is long enough is answered by its index, without walking it
+	size_t position;
+	const struct fat_chain_index* chain = fat_chain_index_get(vmc_meta, clus, &position);
+	if (chain != NULL && count > 0 && chain->length - position >= count)
+		return chain->clusters[position + count - 1];
+	return fat_truncate(vmc_meta, clus, count);
+}
+
+// maximum number of clusters transferred by a single batch
+#define FAT_MAX_BATCH_CLUSTERS 128
+
+/**
+ * Queues a cluster in which a read found an ECC error, so that it is repaired with the I/O lock held exclusively.
+ * When the queue is full the cluster is left to the scrubber
+*/
+static void fat_queue_repair(const struct vmc_meta* vmc_meta, cluster_t clus) {
+	struct fat_cache* fat = vmc_meta->fat;
+	pthread_mutex_lock(&fat->repair_lock);
+	bool queued = false;
+	for (size_t i = 0; i < fat->repair_count && !queued; ++i)
+		queued = fat->repair_queue[i] == clus;
+	if (!queued && fat->repair_count < FAT_REPAIR_QUEUE_SIZE)
+		fat->repair_queue[fat->repair_count++] = clus;
+	pthread_mutex_unlock(&fat->repair_lock);
+}
+
+/**
+ * Verifies the ECC bytes of the page at `offset`, correcting single bit errors.
+ * The page is only corrected in place if `in_place` is set, otherwise the corrected copy is stored in `scratch`.
+ * The errors are counted in fat_ecc_error_counts() if `count` is set.
+ * Returns the page that holds the checked data
+ */
+const uint8_t* fat_check_page(const struct vmc_meta* vmc_meta, physical_offset_t offset, bool in_place, bool count, uint8_t* scratch) {
+	const size_t p_capacity = fat_page_capacity(vmc_meta);
+	uint8_t* page = vmc_meta->raw_data + offset;
+	uint8_t calculated[12];
+	ecc512_calculate(calculated, page);
+	if (memcmp(calculated, page + p_capacity, sizeof(calculated)) == 0)
+		return page;
+
+	if (!in_place) {
+		memcpy(scratch, page, p_capacity + vmc_meta->ecc_bytes);
+		page = scratch;
+	}
+	enum ecc_check_result result = ecc512_check(page + p_capacity, page);
+	if (result == ECC_CHECK_CORRECTED) {
+		if (in_place)
+			mc_image_mark_dirty(vmc_meta, offset, p_capacity + vmc_meta->ecc_bytes);
+		if (count)
+			__atomic_fetch_add(&vmc_meta->fat->ecc_corrected, 1, __ATOMIC_RELAXED);
+		DEBUG_printf("Corrected ECC error at offset 0x%x%s\n", offset, in_place ? "" : " (not written back)");
+	}
+	else if (result == ECC_CHECK_FAILED && count) {
+		__atomic_fetch_add(&vmc_meta->fat->ecc_failed, 1, __ATOMIC_RELAXED);
+		fprintf(stderr, "Uncorrectable ECC error at offset 0x%x (ECC data at: 0x%lx)\n", offset, offset + p_capacity);
+	}
+	return page;
+}
+
 /**
  * Copies data from the file that starts at `clus` into read_buf, then copies data from write_buf to the file.
- * If either read_buf or write_buf are NULL, skip their respective data copy operations
+ * If either read_buf or write_buf are NULL, skip their respective data copy operations.
+ * The written pages are marked as metadata if `metadata` is set, see mc_image_mark_metadata().
+ * Runs of physically contiguous clusters are transferred in batches: without a spare area
+ * a batch is a single memcpy, otherwise it is copied page by page while checking or updating the ECC
  */
-size_t fat_rw_bytes(const struct vmc_meta* vmc_meta, cluster_t clus, logical_offset_t offset, size_t buf_size, void* restrict read_buf, const void* restrict write_buf) {
+size_t fat_rw_bytes(const struct vmc_meta* vmc_meta, cluster_t clus, logical_offset_t offset, size_t buf_size, void* restrict read_buf, const void* restrict write_buf, bool metadata) {
 	if (clus == CLUSTER_INVALID)
 		return 0;
+	void (* const mark_written)(const struct vmc_meta*, physical_offset_t, size_t) = metadata ? mc_image_mark_metadata : mc_image_mark_dirty;
 	const size_t k_capacity = fat_cluster_capacity(vmc_meta);
 	const size_t p_capacity = fat_page_capacity(vmc_meta);
 	const size_t p_size = fat_page_size(vmc_meta);
 
+	uint8_t scratch[p_size];
 	size_t buf_offset = 0;
-	void* page_buffer = malloc(p_size);
 	while(buf_offset < buf_size) {
-		if (clus == CLUSTER_INVALID)
+		// the chain index is shared with the other readers, which may replace it once the lock is released.
+		// only the location of the next run is taken from it, the data is transferred without holding the lock
+		pthread_mutex_lock(&vmc_meta->fat->chain_lock);
+		size_t position;
+		const struct fat_chain_index* chain = fat_chain_index_get(vmc_meta, clus, &position);
+		const size_t run_start = position + offset / k_capacity;
+		if (chain == NULL || run_start >= chain->length) {
+			pthread_mutex_unlock(&vmc_meta->fat->chain_lock);
+			break;
+		}
+
+		// extend the run while the next cluster in the chain is physically adjacent to the previous one
+		const size_t last_needed = position + (offset + (buf_size - buf_offset) - 1) / k_capacity;
+		size_t run_end = run_start + 1;
+		while (
+			run_end <= last_needed && run_end < chain->length && run_end - run_start < FAT_MAX_BATCH_CLUSTERS
+			&& chain->clusters[run_end] == chain->clusters[run_end - 1] + 1
+		)
+			++run_end;
+		const cluster_t run_cluster = chain->clusters[run_start];
+		pthread_mutex_unlock(&vmc_meta->fat->chain_lock);
+
+		// transfer until the end of the run or the end of the buffer, whichever comes first
+		const logical_offset_t run_logical_end = (offset / k_capacity + run_end - run_start) * k_capacity;
+		const size_t batch_size = MIN(buf_size - buf_offset, run_logical_end - offset);
+		const size_t page_count = (offset + batch_size - 1) / p_capacity - offset / p_capacity + 1;
+		const physical_offset_t batch_start = fat_cluster_to_physical_offset(vmc_meta, run_cluster, offset % k_capacity - offset % p_capacity);
+		if ((size_t) batch_start + page_count * p_size > vmc_meta->raw_size) {
+			DEBUG_printf("Cluster %u is out of the bounds of the memory card\n", run_cluster);
 			break;
+		}
+		uint8_t* batch = vmc_meta->raw_data + batch_start;
 
-		clus = fat_seek(vmc_meta, clus, offset / k_capacity);
-		offset %= k_capacity;
-		const physical_offset_t mc_offset = fat_logical_to_physical_offset(vmc_meta, clus, offset);
-
-		// copy until the end of the data part of the current page
-		size_t buffer_left = buf_size - buf_offset;
-		size_t page_left = p_capacity - offset % p_capacity;
-		size_t s = MIN(buffer_left, page_left);
-
-		physical_offset_t page_start = mc_offset / p_size * p_size;
-		physical_offset_t spare_start = page_start + p_capacity;
-
-		fseek(vmc_meta->file, page_start, SEEK_SET);
-		fread(page_buffer, p_size, 1, vmc_meta->file);
-		if (read_buf) {
-			memcpy(read_buf + buf_offset, page_buffer + (mc_offset - page_start), s);
-			if (vmc_meta->ecc_bytes == 12) {
-				bool ecc_ok = ecc512_check(page_buffer + p_capacity, page_buffer);
-				if (!ecc_ok) {
-					DEBUG_printf("ECC mismatch at offset 0x%x (ECC data at: 0x%x)\n", page_start, spare_start);
-				}
+		if (p_size == p_capacity) {
+			// without a spare area the data of the run is contiguous
+			if (read_buf)
+				memcpy(read_buf + buf_offset, batch + offset % p_capacity, batch_size);
+			if (write_buf) {
+				memcpy(batch + offset % p_capacity, write_buf + buf_offset, batch_size);
+				mark_written(vmc_meta, batch_start + offset % p_capacity, batch_size);
 			}
+			buf_offset += batch_size;
+			offset += batch_size;
+			continue;
 		}
-		if (write_buf) {
-			memcpy(page_buffer + (mc_offset - page_start), write_buf + buf_offset, s);
-			if (vmc_meta->ecc_bytes == 12) {
-				ecc512_calculate(page_buffer + p_capacity, page_buffer);
+
+		size_t copied = 0;
+		for (size_t i = 0; i < page_count; ++i) {
+			uint8_t* page = batch + i * p_size;
+			const size_t page_offset = (offset + copied) % p_capacity;
+			const size_t s = MIN(batch_size - copied, p_capacity - page_offset);
+			if (read_buf) {
+				// reads run in parallel and may check the same page at once, so they never change it. The page
+				// is repaired later with the I/O lock held exclusively
+				const uint8_t* checked = page;
+				if (vmc_meta->ecc_bytes == 12)
+					checked = fat_check_page(vmc_meta, batch_start + i * p_size, false, true, scratch);
+				if (checked != page && vmc_meta->repair_ecc)
+					fat_queue_repair(vmc_meta, run_cluster + (offset % k_capacity / p_capacity + i) / vmc_meta->superblock.pages_per_cluster);
+				memcpy(read_buf + buf_offset + copied, checked + page_offset, s);
+			}
+			if (write_buf) {
+				// the page is updated in place, the rest of it doesn't need to be read.
+				// the part that is kept is corrected first, so that the new ECC bytes don't cover up an error
+				if (vmc_meta->ecc_bytes == 12 && !read_buf && s < p_capacity)
+					fat_check_page(vmc_meta, batch_start + i * p_size, true, true, NULL);
+				memcpy(page + page_offset, write_buf + buf_offset + copied, s);
+				if (vmc_meta->ecc_bytes == 12) {
+					ecc512_calculate(page + p_capacity, page);
+				}
 			}
-			fseek(vmc_meta->file, page_start, SEEK_SET);
-			fwrite(page_buffer, p_size, 1, vmc_meta->file);
+			copied += s;
 		}
-		buf_offset += s;
-		offset += s;
+		if (write_buf)
+			mark_written(vmc_meta, batch_start, page_count * p_size);
+		buf_offset += batch_size;
+		offset += batch_size;
 	}
-	free(page_buffer);
 	return buf_offset;
 }
 
 size_t fat_read_bytes(const struct vmc_meta* vmc_meta, cluster_t clus0, logical_offset_t offset, size_t size, void* buf) {
-	return fat_rw_bytes(vmc_meta, clus0, offset, size, buf, NULL);
+	pthread_rwlock_rdlock(&vmc_meta->fat->io_lock);
+	__atomic_fetch_add(&vmc_meta->fat->io_generation, 1, __ATOMIC_RELAXED);
+	size_t read = fat_rw_bytes(vmc_meta, clus0, offset, size, buf, NULL, false);
+	pthread_rwlock_unlock(&vmc_meta->fat->io_lock);
+	return read;
 }
 size_t fat_write_bytes(const struct vmc_meta* vmc_meta, cluster_t clus0, logical_offset_t offset, size_t size, const void* buf) {
-	return fat_rw_bytes(vmc_meta, clus0, offset, size, NULL, buf);
+	pthread_rwlock_rdlock(&vmc_meta->fat->io_lock);
+	__atomic_fetch_add(&vmc_meta->fat->io_generation, 1, __ATOMIC_RELAXED);
+	size_t written = fat_rw_bytes(vmc_meta, clus0, offset, size, NULL, buf, false);
+	pthread_rwlock_unlock(&vmc_meta->fat->io_lock);
+	return written;
+}
+size_t fat_write_dir_bytes(const struct vmc_meta* vmc_meta, cluster_t clus0, logical_offset_t offset, size_t size, const void* buf) {
+	pthread_rwlock_rdlock(&vmc_meta->fat->io_lock);
+	__atomic_fetch_add(&vmc_meta->fat->io_generation, 1, __ATOMIC_RELAXED);
+	size_t written = fat_rw_bytes(vmc_meta, clus0, offset, size, NULL, buf, true);
+	pthread_rwlock_unlock(&vmc_meta->fat->io_lock);
+	return written;
+}
+
+int fat_copy_cluster(const struct vmc_meta* vmc_meta, cluster_t from, cluster_t to) {
+	const size_t k_size = fat_cluster_size(vmc_meta);
+	const physical_offset_t src = fat_cluster_to_physical_offset(vmc_meta, from, 0);
+	const physical_offset_t dest = fat_cluster_to_physical_offset(vmc_meta, to, 0);
+	const cluster_t count = vmc_meta->superblock.last_allocatable;
+	if (from >= count || to >= count || (size_t) MAX(src, dest) + k_size > vmc_meta->raw_size)
+		return -1;
+	pthread_rwlock_rdlock(&vmc_meta->fat->io_lock);
+	__atomic_fetch_add(&vmc_meta->fat->io_generation, 1, __ATOMIC_RELAXED);
+	// the ECC bytes only depend on the data of their page, so they are copied along with it
+	memcpy(vmc_meta->raw_data + dest, vmc_meta->raw_data + src, k_size);
+	mc_image_mark_dirty(vmc_meta, dest, k_size);
+	pthread_rwlock_unlock(&vmc_meta->fat->io_lock);
+	return 0;
+}
+
+enum fat_lock_mode {
+	FAT_LOCK_SHARED,        // the reads and writes go on, corrected pages are only counted
+	FAT_LOCK_EXCLUSIVE,     // wait for the reads and writes in progress, then repair the pages in place
+	FAT_LOCK_TRY_EXCLUSIVE, // same, but give up instead of waiting. Doesn't count as a read
+};
+
+/**
+ * Checks the ECC of the pages of a cluster, holding the I/O lock as `mode` says.
+ * Returns the number of pages with errors, or -EBUSY if the lock could not be taken
+*/
+static int fat_check_cluster_pages(const struct vmc_meta* vmc_meta, cluster_t clus, enum fat_lock_mode mode, bool count) {
+	if (vmc_meta->ecc_bytes != 12 || clus >= vmc_meta->superblock.last_allocatable)
+		return 0;
+	const size_t p_size = fat_page_size(vmc_meta);
+	const size_t p_capacity = fat_page_capacity(vmc_meta);
+	const physical_offset_t start = fat_cluster_to_physical_offset(vmc_meta, clus, 0);
+	if ((size_t) start + fat_cluster_size(vmc_meta) > vmc_meta->raw_size)
+		return 0;
+	if (mode == FAT_LOCK_TRY_EXCLUSIVE) {
+		if (pthread_rwlock_trywrlock(&vmc_meta->fat->io_lock) != 0)
+			return -EBUSY;
+	}
+	else {
+		if (mode == FAT_LOCK_SHARED)
+			pthread_rwlock_rdlock(&vmc_meta->fat->io_lock);
+		else
+			pthread_rwlock_wrlock(&vmc_meta->fat->io_lock);
+		__atomic_fetch_add(&vmc_meta->fat->io_generation, 1, __ATOMIC_RELAXED);
+	}
+	uint8_t scratch[p_size];
+	int errors = 0;
+	for (size_t i = 0; i < vmc_meta->superblock.pages_per_cluster; ++i) {
+		const physical_offset_t offset = start + i * p_size;
+		uint8_t calculated[12];
+		ecc512_calculate(calculated, vmc_meta->raw_data + offset);
+		if (memcmp(calculated, vmc_meta->raw_data + offset + p_capacity, sizeof(calculated)) == 0)
+			continue;
+		fat_check_page(vmc_meta, offset, mode != FAT_LOCK_SHARED, count, scratch);
+		errors++;
+	}
+	pthread_rwlock_unlock(&vmc_meta->fat->io_lock);
+	return errors;
+}
+
+int fat_check_cluster(const struct vmc_meta* vmc_meta, cluster_t clus) {
+	return fat_check_cluster_pages(vmc_meta, clus, vmc_meta->repair_ecc ? FAT_LOCK_EXCLUSIVE : FAT_LOCK_SHARED, true);
+}
+
+void fat_repair_queued(const struct vmc_meta* vmc_meta) {
+	struct fat_cache* fat = vmc_meta->fat;
+	for (;;) {
+		pthread_mutex_lock(&fat->repair_lock);
+		const cluster_t clus = fat->repair_count > 0 ? fat->repair_queue[--fat->repair_count] : CLUSTER_INVALID;
+		pthread_mutex_unlock(&fat->repair_lock);
+		if (clus == CLUSTER_INVALID)
+			break;
+		// the read that queued the cluster already counted its errors
+		fat_check_cluster_pages(vmc_meta, clus, FAT_LOCK_EXCLUSIVE, false);
+	}
+}
+
+int fat_scrub_cluster(const struct vmc_meta* vmc_meta, cluster_t clus) {
+	if (vmc_meta->ecc_bytes != 12 || clus >= vmc_meta->superblock.last_allocatable)
+		return 0;
+	if (!fat_get_table_entry(vmc_meta, clus).entry.occupied)
+		return 0;
+	// never wait for reads or writes, the caller will come back later
+	const int errors = fat_check_cluster_pages(vmc_meta, clus, FAT_LOCK_TRY_EXCLUSIVE, true);
+	return errors < 0 ? errors : 1;
 }
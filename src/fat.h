@@ -25,13 +25,49 @@ size_t fat_cluster_capacity(const struct vmc_meta* vmc_meta);
 */
 physical_offset_t fat_logical_to_physical_offset(const struct vmc_meta* vmc_meta, cluster_t cluster, logical_offset_t bytes_offset);
 
+#define FAT_CHAIN_INDEX_SLOTS 16
+// number of clusters with ECC errors found by reads that wait to be repaired, see fat_repair_queued()
+#define FAT_REPAIR_QUEUE_SIZE 64
+
+/**
+ * Flat copy of a cluster chain, used to jump directly to the cluster holding any logical offset of a file
+*/
+struct fat_chain_index {
+	cluster_t first;          // first cluster of the indexed chain, or CLUSTER_INVALID for an unused slot
+	cluster_t* clusters;      // the clusters of the chain, in order
+	size_t length;
+	size_t capacity;
+	unsigned long last_used;
+};
+
+/**
+ * Reads the whole FAT table into memory. Must be called once the superblock has been read
+ * and before using any other function in this module.
+ * Functions that only read the FAT or the data of the clusters may be called by several threads at once,
+ * but functions that change the FAT must not run concurrently with any other function of this module.
+ * Returns 0 on success or -1 on error
+*/
+int fat_load(struct vmc_meta* vmc_meta);
+
+/**
+ * Writes back the FAT pages that were modified since the last flush into the memory card image (recomputing their ECC bytes),
+ * after repairing the clusters queued by reads (see fat_repair_queued()).
+ * Returns 0 on success or -1 on error
+*/
+int fat_flush(const struct vmc_meta* vmc_meta);
+
+/**
+ * Releases the in-memory FAT table. Changes that were not flushed are lost
+*/
+void fat_unload(struct vmc_meta* vmc_meta);
+
 /**
  * Returns the FAT table entry value for a cluster
 */
 union fat_entry fat_get_table_entry(const struct vmc_meta* vmc_meta, cluster_t clus);
 
 /**
- * Sets the FAT table entry for a cluster
+ * Sets the FAT table entry for a cluster. The change is kept in memory until the next call to fat_flush()
 */
 void fat_set_table_entry(const struct vmc_meta* vmc_meta, cluster_t clus, union fat_entry newval);
 
@@ -41,12 +77,57 @@ void fat_set_table_entry(const struct vmc_meta* vmc_meta, cluster_t clus, union
  **/
 cluster_t fat_seek(const struct vmc_meta* vmc_meta, cluster_t clus0, size_t count);
 
+/**
+ * Returns an index of a chain that contains `clus0`, building it if it isn't cached.
+ * `position` is set to the position of `clus0` in the indexed chain.
+ * The returned index is only valid until the next change to the FAT table, or the next lookup of another chain.
+ * Not safe to call while other threads read the FAT
+ **/
+const struct fat_chain_index* fat_chain_index_get(const struct vmc_meta* vmc_meta, cluster_t clus0, size_t* position);
+
+/**
+ * Returns the number of pages with ECC errors found by reads since fat_load(),
+ * split between corrected errors and errors that couldn't be corrected
+ **/
+void fat_ecc_error_counts(const struct vmc_meta* vmc_meta, size_t* corrected, size_t* uncorrectable);
+
+/**
+ * Returns a counter that is incremented by every read and write, so that idle periods can be detected
+ **/
+uint64_t fat_io_generation(const struct vmc_meta* vmc_meta);
+
+/**
+ * Returns the number of free allocatable clusters
+ **/
+size_t fat_free_cluster_count(const struct vmc_meta* vmc_meta);
+
 /**
  * Returns a free cluster or 0xFFFFFFFF if none is found.
  * 'clus' should be the start cluster for the search.
  **/
 cluster_t fat_find_free_cluster(const struct vmc_meta* vmc_meta, cluster_t clus);
 
+/**
+ * Returns the first cluster of the smallest run of contiguous free clusters that is at least `len` clusters long,
+ * or of the largest run if none is long enough. Returns CLUSTER_INVALID if there are no free clusters
+ **/
+cluster_t fat_find_free_run(const struct vmc_meta* vmc_meta, size_t len);
+
+/**
+ * How scattered the chains and the free space of the card are
+ **/
+struct fat_fragmentation {
+	size_t chains;           // cluster chains (files and directories)
+	size_t extents;          // runs of contiguous clusters in all the chains, equal to `chains` when nothing is fragmented
+	size_t free_runs;        // runs of contiguous free clusters
+	size_t largest_free_run; // clusters in the largest free run
+};
+
+/**
+ * Measures the fragmentation of the card with a pass over the FAT
+ **/
+void fat_fragmentation(const struct vmc_meta* vmc_meta, struct fat_fragmentation* stats);
+
 /**
  * Makes the linked list that starts at `clus` span `count` clusters. Frees old clusters or allocates new ones if needed.
  * Returns the last cluster or CLUSTER_INVALID if ran out of space while extending the list.
@@ -55,12 +136,58 @@ cluster_t fat_find_free_cluster(const struct vmc_meta* vmc_meta, cluster_t clus)
 cluster_t fat_truncate(const struct vmc_meta* vmc_meta, cluster_t clus, size_t count);
 
 /**
- * Creates a new list spanning 'len' clusters
+ * Makes the linked list that starts at `clus` span at least `count` clusters, allocating new ones if needed.
+ * Unlike fat_truncate() the clusters past `count` are kept, so that space reserved ahead of a write stays reserved.
+ * Returns the cluster at position `count` - 1 or CLUSTER_INVALID if ran out of space
+ **/
+cluster_t fat_extend(const struct vmc_meta* vmc_meta, cluster_t clus, size_t count);
+
+/**
+ * Creates a new list spanning 'len' clusters, starting in the free run that best fits it (see fat_find_free_run())
  * returns the first cluster or 0xFFFFFFFF if not enough space
  **/
 cluster_t fat_allocate(const struct vmc_meta* vmc_meta, size_t len);
 
+/**
+ * Same as fat_allocate(), but the list starts at the first free cluster from `near`, for data that is used together
+ **/
+cluster_t fat_allocate_near(const struct vmc_meta* vmc_meta, size_t len, cluster_t near);
+
 size_t fat_read_bytes(const struct vmc_meta* vmc_meta, cluster_t clus0, logical_offset_t offset, size_t size, void* buf);
 size_t fat_write_bytes(const struct vmc_meta* vmc_meta, cluster_t clus0, logical_offset_t offset, size_t size, const void* buf);
 
+/**
+ * Same as fat_write_bytes(), for the clusters of a directory. A write-back image writes them to the image file
+ * after the data of the files, see mc_image_mark_metadata()
+ **/
+size_t fat_write_dir_bytes(const struct vmc_meta* vmc_meta, cluster_t clus0, logical_offset_t offset, size_t size, const void* buf);
+
+/**
+ * Copies the whole cluster `from`, ECC bytes included, over the cluster `to`. The FAT is not changed.
+ * Returns 0 on success or -1 if a cluster is out of the card
+ **/
+int fat_copy_cluster(const struct vmc_meta* vmc_meta, cluster_t from, cluster_t to);
+
+/**
+ * Checks the ECC of the pages of a cluster, allocated or not, and counts the errors found in fat_ecc_error_counts().
+ * Correctable errors are repaired in place when `repair_ecc` is set, which waits for the reads and writes in progress
+ * and holds off the new ones meanwhile. May be called by several threads at once.
+ * Returns the number of pages with errors, or 0 for cards without ECC
+*/
+int fat_check_cluster(const struct vmc_meta* vmc_meta, cluster_t clus);
+
+/**
+ * Repairs in place the clusters in which reads found correctable ECC errors while `repair_ecc` is set. Reads only
+ * correct a copy of the pages, as they share the I/O lock, so the clusters are queued and repaired here with the lock
+ * held exclusively. Called by fat_flush(), must not be called while reading or writing
+*/
+void fat_repair_queued(const struct vmc_meta* vmc_meta);
+
+/**
+ * Checks the ECC of the pages of an allocated cluster and repairs the correctable errors in place.
+ * Never blocks: returns -EBUSY if a read or write is in progress, 1 if the cluster was checked
+ * and 0 if it was skipped (free clusters and cards without ECC)
+*/
+int fat_scrub_cluster(const struct vmc_meta* vmc_meta, cluster_t clus);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,430 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "vmc_types.h"
+#include "fat.h"
+#include "ps2mcfs.h"
+#include "fsck.h"
+#include "utils.h"
+
+
+/**
+ * A directory waiting to be checked by a worker
+*/
+struct fsck_job {
+	cluster_t cluster;        // first cluster of the directory
+	uint32_t length;          // number of entries, at most what fits in its chain
+	cluster_t parent_cluster; // first cluster of its parent, CLUSTER_INVALID for the root directory
+	uint32_t index;           // index of its entry in its parent
+	char* path;
+};
+
+enum fsck_repair_kind {
+	FSCK_END_CHAIN,        // end the chain at `cluster`
+	FSCK_SET_ENTRY,        // set the first cluster and length of the entry `index` of the directory at `parent_cluster`
+	FSCK_SET_DIR_LOCATION, // point the "." and ".." entries of the directory at `cluster` to the entry `index` of `parent_cluster`
+};
+
+struct fsck_repair {
+	enum fsck_repair_kind kind;
+	cluster_t cluster;
+	cluster_t parent_cluster;
+	uint32_t index;
+	uint32_t length;
+};
+
+struct fsck_state {
+	const struct vmc_meta* vmc_meta;
+	cluster_t count;       // number of allocatable clusters
+	uint64_t* reachable;   // one bit per cluster, set once a chain reached it
+	struct fsck_report* report;
+	FILE* log;
+	bool repair;
+	bool incomplete;       // the chain of a directory could not be walked, so its entries were not checked
+	pthread_mutex_t mutex; // protects everything below
+	pthread_cond_t wakeup; // signaled when a job is added or the last busy worker is done
+	struct fsck_job* jobs;
+	size_t job_count;
+	size_t job_capacity;
+	size_t busy;           // workers that are checking a directory, and may add more jobs
+	struct fsck_repair* repairs;
+	size_t repair_count;
+	size_t repair_capacity;
+	bool out_of_memory;
+};
+
+bool fsck_is_clean(const struct fsck_report* report) {
+	return !report->cross_links && !report->broken_chains && !report->lost_clusters && !report->length_mismatches
+		&& !report->bad_dir_locations && !report->ecc_errors;
+}
+
+#define fsck_count(state, field) __atomic_fetch_add(&(state)->report->field, 1, __ATOMIC_RELAXED)
+
+static void fsck_problem(struct fsck_state* state, const char* path, const char* format, ...) {
+	if (!state->log)
+		return;
+	char message[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+	fprintf(state->log, "%s: %s\n", path[0] ? path : "/", message);
+}
+
+/**
+ * Grows an array of `*capacity` elements of `size` bytes so that it can hold one more element
+*/
+static bool fsck_reserve(void** array, size_t count, size_t* capacity, size_t size) {
+	if (count < *capacity)
+		return true;
+	const size_t new_capacity = MAX(16, *capacity * 2);
+	void* new_array = realloc(*array, new_capacity * size);
+	if (!new_array)
+		return false;
+	*array = new_array;
+	*capacity = new_capacity;
+	return true;
+}
+
+static void fsck_add_repair(struct fsck_state* state, struct fsck_repair repair) {
+	if (!state->repair)
+		return;
+	pthread_mutex_lock(&state->mutex);
+	if (fsck_reserve((void**) &state->repairs, state->repair_count, &state->repair_capacity, sizeof(repair)))
+		state->repairs[state->repair_count++] = repair;
+	else
+		__atomic_store_n(&state->out_of_memory, true, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&state->mutex);
+}
+
+/**
+ * Marks a cluster as reached. Returns false if it already was
+*/
+static bool fsck_reach(struct fsck_state* state, cluster_t clus) {
+	const uint64_t bit = 1ull << (clus % 64);
+	return !(__atomic_fetch_or(&state->reachable[clus / 64], bit, __ATOMIC_RELAXED) & bit);
+}
+
+/**
+ * Returns true if `clus` is one of the first `count` clusters of the chain that starts at `head`
+*/
+static bool fsck_chain_contains(const struct vmc_meta* vmc_meta, cluster_t head, size_t count, cluster_t clus) {
+	for (size_t i = 0; i < count; ++i) {
+		if (head == clus)
+			return true;
+		head = fat_get_table_entry(vmc_meta, head).entry.next_cluster;
+	}
+	return false;
+}
+
+/**
+ * Follows the chain that starts at `head`, marking its clusters as reached and checking their ECC.
+ * Returns the number of clusters of the chain, counted up to the first bad cluster, and sets `broken` if there is one.
+ * Sets `shared_head` if `head` itself was already reached by another chain
+*/
+static size_t fsck_walk_chain(struct fsck_state* state, const char* path, cluster_t head, bool* broken, bool* shared_head) {
+	const struct vmc_meta* vmc_meta = state->vmc_meta;
+	*broken = false;
+	*shared_head = false;
+	size_t length = 0;
+	cluster_t clus = head, prev = CLUSTER_INVALID;
+	for (;;) {
+		if (clus >= state->count || !fat_get_table_entry(vmc_meta, clus).entry.occupied) {
+			fsck_problem(state, path, "chain runs into %s cluster %u after %lu clusters", clus >= state->count ? "invalid" : "free", clus, length);
+			fsck_count(state, broken_chains);
+			*broken = true;
+			if (prev != CLUSTER_INVALID)
+				fsck_add_repair(state, (struct fsck_repair) {.kind = FSCK_END_CHAIN, .cluster = prev});
+			return length;
+		}
+		if (!fsck_reach(state, clus)) {
+			if (fsck_chain_contains(vmc_meta, head, length, clus)) {
+				fsck_problem(state, path, "chain loops back to cluster %u after %lu clusters", clus, length);
+				fsck_count(state, broken_chains);
+				*broken = true;
+				fsck_add_repair(state, (struct fsck_repair) {.kind = FSCK_END_CHAIN, .cluster = prev});
+				return length;
+			}
+			fsck_problem(state, path, "chain is cross-linked with another one at cluster %u", clus);
+			fsck_count(state, cross_links);
+			*shared_head = length == 0;
+			// the other chain checks the rest, which still counts in the length of this one
+			for (size_t i = length; i < state->count; ++i) {
+				++length;
+				const union fat_entry value = fat_get_table_entry(vmc_meta, clus);
+				if (value.raw == FAT_ENTRY_TERMINATOR.raw || !value.entry.occupied || value.entry.next_cluster >= state->count)
+					break;
+				clus = value.entry.next_cluster;
+			}
+			return length;
+		}
+
+		const int ecc_errors = fat_check_cluster(vmc_meta, clus);
+		if (ecc_errors) {
+			fsck_problem(state, path, "%d pages with ECC errors in cluster %u", ecc_errors, clus);
+			__atomic_fetch_add(&state->report->ecc_errors, ecc_errors, __ATOMIC_RELAXED);
+		}
+		++length;
+		const union fat_entry value = fat_get_table_entry(vmc_meta, clus);
+		if (value.raw == FAT_ENTRY_TERMINATOR.raw)
+			return length;
+		prev = clus;
+		clus = value.entry.next_cluster;
+	}
+}
+
+static void fsck_add_job(struct fsck_state* state, struct fsck_job job) {
+	pthread_mutex_lock(&state->mutex);
+	if (fsck_reserve((void**) &state->jobs, state->job_count, &state->job_capacity, sizeof(job))) {
+		state->jobs[state->job_count++] = job;
+		pthread_cond_signal(&state->wakeup);
+	}
+	else {
+		__atomic_store_n(&state->out_of_memory, true, __ATOMIC_RELAXED);
+		free(job.path);
+	}
+	pthread_mutex_unlock(&state->mutex);
+}
+
+/**
+ * Checks the "." and ".." entries of a directory
+*/
+static void fsck_check_dir_location(struct fsck_state* state, const struct fsck_job* job) {
+	const char* names[] = {".", ".."};
+	for (unsigned i = 0; i < 2; ++i) {
+		dir_entry_t dot;
+		bool found = ps2mcfs_get_child(state->vmc_meta, job->cluster, i, &dot) == 0 && (dot.mode & DF_EXISTS) && strcmp(dot.name, names[i]) == 0;
+		// both entries hold the slot of the directory in its parent, the location of the root directory isn't used at all
+		if (found && (job->parent_cluster == CLUSTER_INVALID || (dot.cluster == job->parent_cluster && dot.dir_entry == job->index)))
+			continue;
+		if (!found)
+			fsck_problem(state, job->path, "\"%s\" entry is missing", names[i]);
+		else
+			fsck_problem(state, job->path, "\"%s\" entry points to entry %u of cluster %u", names[i], dot.dir_entry, dot.cluster);
+		fsck_count(state, bad_dir_locations);
+		fsck_add_repair(state, (struct fsck_repair) {.kind = FSCK_SET_DIR_LOCATION, .cluster = job->cluster, .parent_cluster = job->parent_cluster, .index = job->index});
+		return;
+	}
+}
+
+/**
+ * Checks the entries of a directory, whose own chain was already checked, and queues its subdirectories
+*/
+static void fsck_check_dir(struct fsck_state* state, const struct fsck_job* job) {
+	const struct vmc_meta* vmc_meta = state->vmc_meta;
+	const size_t k_capacity = fat_cluster_capacity(vmc_meta);
+	fsck_check_dir_location(state, job);
+
+	dir_entry_t dir = {.cluster = job->cluster, .length = job->length};
+	dir_iterator_t it;
+	if (ps2mcfs_dir_iterator_init(vmc_meta, &dir, 2, &it) != 0) {
+		__atomic_store_n(&state->out_of_memory, true, __ATOMIC_RELAXED);
+		return;
+	}
+	dir_entry_t* child;
+	size_t index;
+	while ((child = ps2mcfs_dir_iterator_next(&it, &index)) != NULL) {
+		char path[strlen(job->path) + sizeof(child->name) + 2];
+		snprintf(path, sizeof(path), "%s/%.*s", job->path, (int) sizeof(child->name), child->name);
+		const bool is_dir = ps2mcfs_is_directory(child);
+		if (is_dir)
+			fsck_count(state, directories);
+		else
+			fsck_count(state, files);
+
+		struct fsck_repair fix = {.kind = FSCK_SET_ENTRY, .parent_cluster = job->cluster, .index = index, .cluster = child->cluster, .length = child->length};
+		if (child->cluster == CLUSTER_INVALID && !is_dir) {
+			if (child->length != 0) {
+				fsck_problem(state, path, "has %u bytes but no clusters", child->length);
+				fsck_count(state, length_mismatches);
+				fix.length = 0;
+				fsck_add_repair(state, fix);
+			}
+			continue;
+		}
+
+		bool broken, shared_head;
+		const size_t chain_length = fsck_walk_chain(state, path, child->cluster, &broken, &shared_head);
+		if (chain_length == 0) {
+			// the entry doesn't even have a valid first cluster. a file is emptied, a directory can only be reported
+			if (!is_dir) {
+				fix.cluster = CLUSTER_INVALID;
+				fix.length = 0;
+				fsck_add_repair(state, fix);
+			}
+			else
+				__atomic_store_n(&state->incomplete, true, __ATOMIC_RELAXED);
+			continue;
+		}
+		const size_t unit = is_dir ? sizeof(dir_entry_t) : 1;
+		const size_t fits = chain_length * k_capacity / unit;
+		if (child->length > fits) {
+			fsck_problem(state, path, "has %u %s but its chain only holds %lu", child->length, is_dir ? "entries" : "bytes", fits);
+			fsck_count(state, length_mismatches);
+			fix.length = fits;
+			fsck_add_repair(state, fix);
+		}
+		if (is_dir && shared_head) {
+			// the entries were or will be checked through the other entry. Checking them again could loop forever
+			// if the directory contains itself
+			fsck_problem(state, path, "directory starts on a cluster of another chain, its entries are not checked");
+			continue;
+		}
+		if (is_dir) {
+			char* job_path = strdup(path);
+			struct fsck_job subdir = {.cluster = child->cluster, .length = MIN(child->length, fits), .parent_cluster = job->cluster, .index = index, .path = job_path};
+			if (job_path)
+				fsck_add_job(state, subdir);
+			else
+				__atomic_store_n(&state->out_of_memory, true, __ATOMIC_RELAXED);
+		}
+	}
+	ps2mcfs_dir_iterator_free(&it);
+}
+
+static void* fsck_worker_main(void* arg) {
+	struct fsck_state* state = arg;
+	pthread_mutex_lock(&state->mutex);
+	for (;;) {
+		while (state->job_count == 0 && state->busy > 0)
+			pthread_cond_wait(&state->wakeup, &state->mutex);
+		if (state->job_count == 0)
+			break;
+		struct fsck_job job = state->jobs[--state->job_count];
+		state->busy++;
+		pthread_mutex_unlock(&state->mutex);
+
+		fsck_check_dir(state, &job);
+		free(job.path);
+
+		pthread_mutex_lock(&state->mutex);
+		state->busy--;
+	}
+	// nothing is left to check, wake up the other workers so that they see it too
+	pthread_cond_broadcast(&state->wakeup);
+	pthread_mutex_unlock(&state->mutex);
+	return NULL;
+}
+
+static void fsck_apply_repair(struct fsck_state* state, const struct fsck_repair* repair) {
+	const struct vmc_meta* vmc_meta = state->vmc_meta;
+	dir_entry_t dirent;
+	switch (repair->kind) {
+	case FSCK_END_CHAIN:
+		fat_set_table_entry(vmc_meta, repair->cluster, FAT_ENTRY_TERMINATOR);
+		break;
+	case FSCK_SET_ENTRY:
+		if (ps2mcfs_get_child(vmc_meta, repair->parent_cluster, repair->index, &dirent) != 0)
+			return;
+		dirent.cluster = repair->cluster;
+		dirent.length = repair->length;
+		ps2mcfs_set_child(vmc_meta, repair->parent_cluster, repair->index, &dirent);
+		break;
+	case FSCK_SET_DIR_LOCATION:
+		for (unsigned i = 0; i < 2; ++i) {
+			if (ps2mcfs_get_child(vmc_meta, repair->cluster, i, &dirent) != 0)
+				return;
+			dirent.mode |= DF_EXISTS | DF_DIRECTORY;
+			strncpy(dirent.name, i == 0 ? "." : "..", sizeof(dirent.name));
+			// the root directory points to itself
+			dirent.cluster = repair->parent_cluster == CLUSTER_INVALID ? vmc_meta->superblock.root_cluster : repair->parent_cluster;
+			dirent.dir_entry = repair->parent_cluster == CLUSTER_INVALID ? 0 : repair->index;
+			ps2mcfs_set_child(vmc_meta, repair->cluster, i, &dirent);
+		}
+		break;
+	}
+	state->report->repairs++;
+}
+
+int fsck_check(const struct vmc_meta* vmc_meta, unsigned threads, bool repair, FILE* log, struct fsck_report* report) {
+	*report = (struct fsck_report) {0};
+	threads = MAX(1, MIN(threads, FSCK_MAX_THREADS));
+	struct fsck_state state = {
+		.vmc_meta = vmc_meta,
+		.count = vmc_meta->superblock.last_allocatable,
+		.report = report,
+		.log = log,
+		.repair = repair,
+	};
+	state.reachable = calloc(div_ceil(state.count, 64), sizeof(uint64_t));
+	if (!state.reachable)
+		return -ENOMEM;
+	pthread_mutex_init(&state.mutex, NULL);
+	pthread_cond_init(&state.wakeup, NULL);
+
+	// the root directory is checked like any other, but its chain is walked first
+	const cluster_t root_cluster = vmc_meta->superblock.root_cluster;
+	dir_entry_t root;
+	bool broken, shared_head;
+	size_t chain_length = 0;
+	const bool readable = ps2mcfs_get_child(vmc_meta, root_cluster, 0, &root) == 0;
+	if (readable)
+		chain_length = fsck_walk_chain(&state, "", root_cluster, &broken, &shared_head);
+	if (chain_length == 0) {
+		fsck_problem(&state, "", "the root directory can't be read");
+		// a chain that was walked is already counted as broken
+		if (!readable)
+			fsck_count(&state, broken_chains);
+	}
+	else {
+		const size_t fits = chain_length * fat_cluster_capacity(vmc_meta) / sizeof(dir_entry_t);
+		if (root.length > fits) {
+			fsck_problem(&state, "", "has %u entries but its chain only holds %lu", root.length, fits);
+			fsck_count(&state, length_mismatches);
+			fsck_add_repair(&state, (struct fsck_repair) {.kind = FSCK_SET_ENTRY, .cluster = root.cluster, .parent_cluster = root_cluster, .index = 0, .length = fits});
+		}
+		struct fsck_job job = {.cluster = root_cluster, .length = MIN(root.length, fits), .parent_cluster = CLUSTER_INVALID, .index = 0, .path = strdup("")};
+		if (job.path)
+			fsck_add_job(&state, job);
+		else
+			state.out_of_memory = true;
+	}
+
+	pthread_t workers[FSCK_MAX_THREADS];
+	unsigned started = 0;
+	for (; started < threads - 1; ++started) {
+		if (pthread_create(&workers[started], NULL, fsck_worker_main, &state) != 0)
+			break;
+	}
+	fsck_worker_main(&state);
+	for (unsigned i = 0; i < started; ++i)
+		pthread_join(workers[i], NULL);
+
+	// without the whole tree, every cluster past the missing part would look lost
+	if (state.out_of_memory)
+		goto end;
+
+	// ending chains and fixing entries never frees or reaches other clusters, so the lost ones can be found afterwards
+	for (size_t i = 0; i < state.repair_count; ++i)
+		fsck_apply_repair(&state, &state.repairs[i]);
+	// same without the root directory, nothing was reached at all
+	if (chain_length == 0)
+		goto end;
+	for (cluster_t clus = 0; clus < state.count; ++clus) {
+		if (!fat_get_table_entry(vmc_meta, clus).entry.occupied || (state.reachable[clus / 64] & (1ull << (clus % 64))))
+			continue;
+		report->lost_clusters++;
+		// the clusters of the entries of a directory that could not be read are not lost, only out of reach
+		if (repair && !state.incomplete) {
+			fat_set_table_entry(vmc_meta, clus, FAT_ENTRY_FREE);
+			report->repairs++;
+		}
+	}
+	if (report->lost_clusters)
+		fsck_problem(&state, "", "%lu allocated clusters are not part of any file or directory%s", report->lost_clusters,
+			repair && state.incomplete ? ", they are kept as some directories could not be read" : "");
+
+end:
+	free(state.jobs);
+	free(state.repairs);
+	free(state.reachable);
+	pthread_mutex_destroy(&state.mutex);
+	pthread_cond_destroy(&state.wakeup);
+	return state.out_of_memory ? -ENOMEM : 0;
+}
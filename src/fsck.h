@@ -0,0 +1,42 @@
+#ifndef __FSCK_H__
+#define __FSCK_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "vmc_types.h"
+
+#define FSCK_MAX_THREADS 64
+
+
+struct fsck_report {
+	size_t files;
+	size_t directories;
+	size_t cross_links;       // chains that run into a cluster of another chain, including directories that contain themselves
+	size_t broken_chains;     // chains that loop, or run into a free cluster or out of the card
+	size_t lost_clusters;     // allocated clusters that no entry reaches
+	size_t length_mismatches; // entries that are longer than their chain
+	size_t bad_dir_locations; // directories whose "." or ".." entry is missing or doesn't point to their slot in their parent
+	size_t ecc_errors;        // pages with ECC errors, in the clusters reached from the root directory
+	size_t repairs;           // problems that were repaired
+};
+
+/**
+ * Returns true if the check found no problems
+*/
+bool fsck_is_clean(const struct fsck_report* report);
+
+/**
+ * Checks the FAT, the directory tree and the ECC of the clusters reached from the root directory, with `threads`
+ * worker threads that take one directory at a time. Each problem is described on `log`, unless it is NULL.
+ * With `repair`, the problems are fixed once the whole tree was checked: broken chains are ended before the bad
+ * cluster, lengths are shrunk to fit the chains, "." and ".." entries are pointed to their parent and lost clusters
+ * are freed, unless the chain of a directory could not be walked. Without the root directory, lost clusters aren't
+ * even looked for. Cross-linked chains are only reported. Correctable ECC errors are fixed while checking if the card
+ * has `repair_ecc` set. The FAT is not flushed.
+ * Returns 0 once the card was checked, or -ENOMEM
+*/
+int fsck_check(const struct vmc_meta* vmc_meta, unsigned threads, bool repair, FILE* log, struct fsck_report* report);
+
+#endif
@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "vmc_types.h"
+#include "fat.h"
+#include "ps2mcfs.h"
+#include "mc_image.h"
+#include "fsck.h"
+
+// exit status bits, combined over all the checked images
+#define FSCK_EXIT_REPAIRED   1 // problems were found and all of them were repaired
+#define FSCK_EXIT_UNREPAIRED 4 // problems were found and left as they are
+#define FSCK_EXIT_FAILED     8 // an image couldn't be checked
+
+
+static const struct option CLI_OPTIONS[] = {
+    {.name = "repair", .has_arg = no_argument,       .flag = NULL, .val = 0},
+    {.name = "jobs",   .has_arg = required_argument, .flag = NULL, .val = 0},
+    {.name = "quiet",  .has_arg = no_argument,       .flag = NULL, .val = 0},
+    {.name = "help",   .has_arg = no_argument,       .flag = NULL, .val = 0},
+    {.name = NULL,     .has_arg = 0,                 .flag = NULL, .val = 0}
+};
+
+void usage(FILE* stream, const char* program_name, int exit_code) {
+    fprintf(
+        stream,
+        "Usage: %s [-r] [-j JOBS] [-q] [-h] IMAGE_FILE...\n"
+        "Check the file system of virtual memory card image files.\n"
+        "\n"
+        "  -r, --repair     \tRepair the problems that are found, in place\n"
+        "  -j, --jobs=NUM   \tCheck directories with NUM threads (default: one per CPU)\n"
+        "  -q, --quiet      \tOnly print a summary line for each image\n"
+        "  -h, --help       \tShow this help\n"
+        "\n"
+        "Exit status: 0 if no problems were found, 1 if they were all repaired,\n"
+        "4 if some were left, 8 if an image couldn't be checked (combined over all images).\n",
+        program_name
+    );
+    exit(exit_code);
+}
+
+int check_image(const char* filename, bool repair, unsigned threads, bool quiet) {
+    struct vmc_meta vmc_meta = {0};
+    vmc_meta.fd = -1;
+    if (mc_image_open(&vmc_meta, filename, repair ? MC_IMAGE_SHARED : MC_IMAGE_PRIVATE) != 0) {
+        fprintf(stderr, "%s: could not open the image: %s\n", filename, strerror(errno));
+        return FSCK_EXIT_FAILED;
+    }
+    if (ps2mcfs_get_superblock(&vmc_meta) != 0 || fat_load(&vmc_meta) != 0) {
+        fprintf(stderr, "%s: could not read the superblock and the FAT\n", filename);
+        mc_image_close(&vmc_meta);
+        return FSCK_EXIT_FAILED;
+    }
+    vmc_meta.repair_ecc = repair;
+
+    if (!quiet)
+        printf("%s:\n", filename);
+    struct fsck_report report;
+    int status = 0;
+    if (fsck_check(&vmc_meta, threads, repair, quiet ? NULL : stdout, &report) != 0) {
+        fprintf(stderr, "%s: out of memory\n", filename);
+        status = FSCK_EXIT_FAILED;
+    }
+    else if (!fsck_is_clean(&report)) {
+        // corrected ECC errors are fixed in place by the reads of the check
+        size_t ecc_corrected, ecc_uncorrectable;
+        fat_ecc_error_counts(&vmc_meta, &ecc_corrected, &ecc_uncorrectable);
+        const size_t repairs = report.repairs + (repair ? ecc_corrected : 0);
+        const size_t problems = report.cross_links + report.broken_chains + report.lost_clusters
+            + report.length_mismatches + report.bad_dir_locations + report.ecc_errors;
+        status = repairs >= problems ? FSCK_EXIT_REPAIRED : FSCK_EXIT_UNREPAIRED;
+    }
+    if (repair && (fat_flush(&vmc_meta) != 0 || mc_image_sync(&vmc_meta) != 0)) {
+        fprintf(stderr, "%s: could not write the repairs: %s\n", filename, strerror(errno));
+        status |= FSCK_EXIT_FAILED;
+    }
+
+    printf(
+        "%s: %lu files, %lu directories, %lu free clusters. "
+        "%lu cross-linked chains, %lu broken chains, %lu lost clusters, %lu wrong lengths, %lu bad \".\" or \"..\" entries, %lu pages with ECC errors",
+        filename, report.files, report.directories, fat_free_cluster_count(&vmc_meta),
+        report.cross_links, report.broken_chains, report.lost_clusters, report.length_mismatches, report.bad_dir_locations, report.ecc_errors
+    );
+    if (repair)
+        printf(", %lu repairs", report.repairs);
+    printf("\n");
+
+    fat_unload(&vmc_meta);
+    mc_image_close(&vmc_meta);
+    return status;
+}
+
+int main(int argc, char** argv) {
+    // parse options
+    bool option_repair = false;
+    bool option_quiet = false;
+    long option_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    int long_option_index = 0;
+    while ((opt = getopt_long(argc, argv, "rj:qh", CLI_OPTIONS, &long_option_index)) != -1) {
+        // parse -r / --repair option
+        if ((opt == 0 && long_option_index == 0) || opt == 'r') {
+            option_repair = true;
+        }
+        // parse -j / --jobs option
+        else if ((opt == 0 && long_option_index == 1) || opt == 'j') {
+            char* end;
+            option_threads = strtol(optarg, &end, 10);
+            if (*end != '\0' || option_threads < 1 || option_threads > FSCK_MAX_THREADS) {
+                fprintf(stderr, "Invalid JOBS value: %s. Allowed values: 1 to %d.\n", optarg, FSCK_MAX_THREADS);
+                usage(stderr, argv[0], FSCK_EXIT_FAILED);
+            }
+        }
+        // parse -q / --quiet option
+        else if ((opt == 0 && long_option_index == 2) || opt == 'q') {
+            option_quiet = true;
+        }
+        // parse -h / --help option
+        else if ((opt == 0 && long_option_index == 3) || opt == 'h') {
+            usage(stdout, argv[0], 0);
+        }
+        // handle invalid option
+        else {
+            fprintf(stderr, "Unrecognized option: %s.\n", argv[optind - 1]);
+            usage(stderr, argv[0], FSCK_EXIT_FAILED);
+        }
+    }
+
+    if (optind == argc) {
+        fprintf(stderr, "Missing IMAGE_FILE\n");
+        usage(stderr, argv[0], FSCK_EXIT_FAILED);
+    }
+    if (option_threads < 1)
+        option_threads = 1;
+
+    int status = 0;
+    for (int i = optind; i < argc; ++i)
+        status |= check_image(argv[i], option_repair, option_threads, option_quiet);
+    return status;
+}
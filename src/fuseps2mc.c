@@ -5,9 +5,12 @@
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h> // EEXIST, ENOENT
+#include <pthread.h>
+#include <time.h>
 #include <limits.h> // NAME_MAX
 #include <libgen.h> // dirname
 #include <linux/fs.h> // RENAME_EXCHANGE, RENAME_NOREPLACE
+#include <linux/falloc.h> // FALLOC_FL_KEEP_SIZE
 
 #define FUSE_USE_VERSION 30
 
@@ -15,31 +18,421 @@
 #include <fuse3/fuse_common.h>
 
 #include "vmc_types.h"
+#include "mc_image.h"
+#include "dentry_cache.h"
+#include "dir_index.h"
+#include "fuseps2mc.h"
 #include "ps2mcfs.h"
 #include "utils.h"
 
 
-// global static instance for VMC metadata
-static struct vmc_meta vmc_metadata = {.superblock = {{0}}, .file = NULL, .ecc_bytes = 0, .page_spare_area_size = 0};
+// global instance for VMC metadata
+struct vmc_meta vmc_metadata = {.superblock = {{0}}, .raw_data = NULL, .raw_size = 0, .fd = -1, .dirty_blocks = NULL, .metadata_blocks = NULL, .ecc_bytes = 0, .page_spare_area_size = 0, .repair_ecc = false, .fat = NULL, .dentries = NULL, .dir_indexes = NULL};
 
-static void* do_init(struct fuse_conn_info* conn, struct fuse_config* cfg) {
+pthread_rwlock_t metadata_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// the ECC scrubber checks one allocated cluster per tick while the filesystem is idle
+static struct {
+	unsigned int rate; // clusters per second, 0 when disabled
+	bool running;
+	bool stop;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t wakeup;
+} scrubber = {.rate = 0, .running = false, .stop = false, .mutex = PTHREAD_MUTEX_INITIALIZER, .wakeup = PTHREAD_COND_INITIALIZER};
+
+// how long the scrubber stays away after a read or write
+#define SCRUBBER_BACKOFF_SECONDS 2
+
+static void* scrubber_main(void* arg) {
+	const cluster_t cluster_count = vmc_metadata.superblock.last_allocatable;
+	cluster_t clus = 0;
+	uint64_t generation = fat_io_generation(&vmc_metadata);
+	bool busy = false;
+
+	pthread_mutex_lock(&scrubber.mutex);
+	while (!scrubber.stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		if (busy)
+			deadline.tv_sec += SCRUBBER_BACKOFF_SECONDS;
+		else {
+			deadline.tv_nsec += 1000000000L / scrubber.rate;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+			deadline.tv_nsec %= 1000000000L;
+		}
+		pthread_cond_timedwait(&scrubber.wakeup, &scrubber.mutex, &deadline);
+		if (scrubber.stop)
+			break;
+
+		// back off while the filesystem is being used
+		const uint64_t current = fat_io_generation(&vmc_metadata);
+		busy = current != generation;
+		generation = current;
+		if (busy)
+			continue;
+
+		// the FAT can't change while it is being read
+		if (pthread_rwlock_tryrdlock(&metadata_lock) != 0)
+			continue;
+		// skip the free clusters without waiting for the next tick
+		for (cluster_t skipped = 0; skipped < cluster_count; ++skipped) {
+			const int res = fat_scrub_cluster(&vmc_metadata, clus);
+			if (res == -EBUSY)
+				break;
+			if (++clus == cluster_count) {
+				clus = 0;
+				DEBUG_printf("ECC scrubber: finished a pass over the memory card\n");
+			}
+			if (res == 1)
+				break;
+		}
+		pthread_rwlock_unlock(&metadata_lock);
+	}
+	pthread_mutex_unlock(&scrubber.mutex);
+	return NULL;
+}
+
+static void scrubber_start() {
+	if (scrubber.rate == 0 || vmc_metadata.ecc_bytes == 0)
+		return;
+	scrubber.stop = false;
+	scrubber.running = pthread_create(&scrubber.thread, NULL, scrubber_main, NULL) == 0;
+	if (!scrubber.running)
+		fprintf(stderr, "Could not start the ECC scrubber\n");
+}
+
+static void scrubber_stop() {
+	if (!scrubber.running)
+		return;
+	pthread_mutex_lock(&scrubber.mutex);
+	scrubber.stop = true;
+	pthread_cond_signal(&scrubber.wakeup);
+	pthread_mutex_unlock(&scrubber.mutex);
+	pthread_join(scrubber.thread, NULL);
+	scrubber.running = false;
+}
+
+// the write-back thread periodically writes the changes of a write-back image to the memory card file
+static struct {
+	unsigned int interval; // seconds between two write-backs, 0 when disabled
+	bool running;
+	bool stop;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t wakeup;
+} writeback = {.interval = 0, .running = false, .stop = false, .mutex = PTHREAD_MUTEX_INITIALIZER, .wakeup = PTHREAD_COND_INITIALIZER};
+
+static void open_files_write_done(void);
+
+static void* writeback_main(void* arg) {
+	pthread_mutex_lock(&writeback.mutex);
+	while (!writeback.stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += writeback.interval;
+		pthread_cond_timedwait(&writeback.wakeup, &writeback.mutex, &deadline);
+		if (writeback.stop)
+			break;
+
+		// the clusters allocated ahead of the writes are given back and the FAT pages are written to the image
+		// first. Reads may go on while the image is synced, the pages they repair are marked dirty again and
+		// written on the next round
+		pthread_rwlock_wrlock(&metadata_lock);
+		open_files_write_done();
+		fuseps2mc_ll_write_done();
+		fat_flush(&vmc_metadata);
+		pthread_rwlock_unlock(&metadata_lock);
+		pthread_rwlock_rdlock(&metadata_lock);
+		if (mc_image_sync(&vmc_metadata) != 0)
+			fprintf(stderr, "Could not write the changes back to the memory card file: %s\n", strerror(errno));
+		pthread_rwlock_unlock(&metadata_lock);
+	}
+	pthread_mutex_unlock(&writeback.mutex);
+	return NULL;
+}
+
+static void writeback_start() {
+	if (writeback.interval == 0 || vmc_metadata.image_mode != MC_IMAGE_WRITEBACK)
+		return;
+	writeback.stop = false;
+	writeback.running = pthread_create(&writeback.thread, NULL, writeback_main, NULL) == 0;
+	if (!writeback.running)
+		fprintf(stderr, "Could not start the write-back thread, changes will be written on fsync and when unmounting\n");
+}
+
+static void writeback_stop() {
+	if (!writeback.running)
+		return;
+	pthread_mutex_lock(&writeback.mutex);
+	writeback.stop = true;
+	pthread_cond_signal(&writeback.wakeup);
+	pthread_mutex_unlock(&writeback.mutex);
+	pthread_join(writeback.thread, NULL);
+	writeback.running = false;
+}
+
+static void open_files_close_all(void);
+
+int fuseps2mc_load(void) {
 	int err = ps2mcfs_get_superblock(&vmc_metadata);
-	if (err == -1 || vmc_metadata.file == NULL) {
+	if (err == -1 || vmc_metadata.raw_data == NULL) {
 		printf("Detected error while reading superblock\n");
+		return -1;
+	}
+	if (fat_load(&vmc_metadata) != 0) {
+		printf("Detected error while reading FAT table\n");
+		return -1;
+	}
+	if (dentry_cache_init(&vmc_metadata, DENTRY_CACHE_DEFAULT_CAPACITY) != 0)
+		fprintf(stderr, "Could not allocate the path lookup cache, lookups will not be cached\n");
+	if (dir_index_init(&vmc_metadata) != 0)
+		fprintf(stderr, "Could not allocate the directory indexes, directories will be scanned on every lookup\n");
+	scrubber_start();
+	writeback_start();
+	return 0;
+}
+
+void fuseps2mc_unload(void) {
+	if (vmc_metadata.fat == NULL)
+		return;
+	scrubber_stop();
+	writeback_stop();
+	size_t ecc_corrected, ecc_uncorrectable;
+	fat_ecc_error_counts(&vmc_metadata, &ecc_corrected, &ecc_uncorrectable);
+	if (ecc_corrected || ecc_uncorrectable)
+		fprintf(stderr, "ECC errors found while mounted: %lu corrected, %lu uncorrectable\n", ecc_corrected, ecc_uncorrectable);
+	size_t lookup_hits, lookup_misses;
+	dentry_cache_stats(&vmc_metadata, &lookup_hits, &lookup_misses);
+	DEBUG_printf("Path lookup cache: %lu hits, %lu misses\n", lookup_hits, lookup_misses);
+	struct fat_fragmentation fragmentation;
+	fat_fragmentation(&vmc_metadata, &fragmentation);
+	DEBUG_printf(
+		"Fragmentation: %lu extents in %lu chains, largest of %lu free runs: %lu clusters\n",
+		fragmentation.extents, fragmentation.chains, fragmentation.free_runs, fragmentation.largest_free_run
+	);
+	open_files_close_all();
+	dentry_cache_free(&vmc_metadata);
+	dir_index_free(&vmc_metadata);
+	fat_flush(&vmc_metadata);
+	if (mc_image_sync(&vmc_metadata) != 0)
+		fprintf(stderr, "Could not write the changes back to the memory card file: %s\n", strerror(errno));
+	fat_unload(&vmc_metadata);
+}
+
+static void* do_init(struct fuse_conn_info* conn, struct fuse_config* cfg) {
+	// nothing else writes to the card, so the kernel can keep what it reads until told otherwise
+	cfg->kernel_cache = 1;
+	cfg->entry_timeout = CACHE_TIMEOUT;
+	cfg->attr_timeout = CACHE_TIMEOUT;
+	cfg->negative_timeout = CACHE_TIMEOUT;
+	if (fuseps2mc_load() != 0) {
 		struct fuse_context* ctx = fuse_get_context();
 		fuse_exit(ctx->fuse);
 	}
 	return NULL;
 }
 
+static void do_destroy(void* private_data) {
+	fuseps2mc_unload();
+}
+
 void init_stat(struct stat* stbuf) {
 	stbuf->st_gid = fuse_get_context()->gid;
 	stbuf->st_uid = fuse_get_context()->uid;
 }
 
+// files opened through FUSE, referenced by `fuse_file_info.fh`. Handles to the same file share one entry,
+// which holds the location of its directory entry and its latest contents
+struct open_file {
+	browse_result_t entry;
+	bool dirty;   // the length or first cluster in `entry.dirent` is not written to the card yet
+	bool deleted; // the directory entry was removed while the file was open, its clusters are freed on release
+	file_tail_t tail; // the end of the cluster chain, so that appends don't walk it
+	unsigned int refs;
+	struct open_file* next;
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	struct open_file* head;
+} open_files = {.mutex = PTHREAD_MUTEX_INITIALIZER, .head = NULL};
+
+/**
+ * Returns the open file whose directory entry is at `index` in the directory starting at `parent_cluster`, or NULL.
+ * The table must be locked
+*/
+static struct open_file* open_file_find(cluster_t parent_cluster, size_t index) {
+	for (struct open_file* of = open_files.head; of != NULL; of = of->next) {
+		if (!of->deleted && of->entry.parent.cluster == parent_cluster && of->entry.index == index)
+			return of;
+	}
+	return NULL;
+}
+
+static inline struct open_file* open_file_get(const struct fuse_file_info* fi) {
+	return (struct open_file*) (uintptr_t) fi->fh;
+}
+
+/**
+ * Returns the tail of the open file that holds `entry`, or NULL if it isn't open. The metadata lock must be held
+ * exclusively, which keeps the tail from changing once the table is unlocked
+*/
+static file_tail_t* open_file_tail(const browse_result_t* entry) {
+	pthread_mutex_lock(&open_files.mutex);
+	struct open_file* of = open_file_find(entry->parent.cluster, entry->index);
+	pthread_mutex_unlock(&open_files.mutex);
+	return of ? &of->tail : NULL;
+}
+
+static int open_file_acquire(const browse_result_t* entry, struct fuse_file_info* fi) {
+	pthread_mutex_lock(&open_files.mutex);
+	struct open_file* of = open_file_find(entry->parent.cluster, entry->index);
+	if (of == NULL) {
+		of = malloc(sizeof(struct open_file));
+		if (of == NULL) {
+			pthread_mutex_unlock(&open_files.mutex);
+			return -ENOMEM;
+		}
+		*of = (struct open_file) {.entry = *entry, .dirty = false, .deleted = false, .tail = FILE_TAIL_INIT, .refs = 0, .next = open_files.head};
+		open_files.head = of;
+	}
+	of->refs++;
+	pthread_mutex_unlock(&open_files.mutex);
+	fi->fh = (uintptr_t) of;
+	return 0;
+}
+
+/**
+ * Writes the pending changes of an open file to its directory entry. The table must be locked
+*/
+static void open_file_commit(struct open_file* of) {
+	if (of->dirty && !of->deleted)
+		ps2mcfs_set_child(&vmc_metadata, of->entry.parent.cluster, of->entry.index, &of->entry.dirent);
+	of->dirty = false;
+}
+
+/**
+ * Gives back the clusters allocated ahead of the writes and writes the pending changes of an open file,
+ * or frees the clusters of a deleted one. The table must be locked
+*/
+static void open_file_close(struct open_file* of) {
+	if (!of->deleted) {
+		ps2mcfs_write_done(&vmc_metadata, &of->entry.dirent, &of->tail);
+		open_file_commit(of);
+	}
+	else if (of->entry.dirent.cluster != CLUSTER_INVALID)
+		fat_truncate(&vmc_metadata, of->entry.dirent.cluster, 0);
+}
+
+static void open_file_release(struct fuse_file_info* fi) {
+	struct open_file* of = open_file_get(fi);
+	pthread_mutex_lock(&open_files.mutex);
+	open_file_commit(of);
+	if (--of->refs == 0) {
+		open_file_close(of);
+		struct open_file** link = &open_files.head;
+		while (*link != of)
+			link = &(*link)->next;
+		*link = of->next;
+		free(of);
+	}
+	pthread_mutex_unlock(&open_files.mutex);
+}
+
+/**
+ * Closes the files that are still open when unmounting, so that the card holds their latest length
+*/
+static void open_files_close_all(void) {
+	pthread_mutex_lock(&open_files.mutex);
+	while (open_files.head != NULL) {
+		struct open_file* of = open_files.head;
+		open_file_close(of);
+		open_files.head = of->next;
+		free(of);
+	}
+	pthread_mutex_unlock(&open_files.mutex);
+}
+
+/**
+ * Gives back the clusters allocated ahead of the writes to the open files, so that they are not written to the card.
+ * The metadata lock must be held exclusively
+*/
+static void open_files_write_done(void) {
+	pthread_mutex_lock(&open_files.mutex);
+	for (struct open_file* of = open_files.head; of != NULL; of = of->next) {
+		if (!of->deleted)
+			ps2mcfs_write_done(&vmc_metadata, &of->entry.dirent, &of->tail);
+	}
+	pthread_mutex_unlock(&open_files.mutex);
+}
+
+/**
+ * Removes the file at `removed`. If it is open, it is marked as deleted so that its pending changes are not written
+ * over another entry, and its clusters are kept until it is released
+*/
+static int unlink_file(const browse_result_t* removed) {
+	dir_entry_t unlinked = removed->dirent;
+	pthread_mutex_lock(&open_files.mutex);
+	struct open_file* of = open_file_find(removed->parent.cluster, removed->index);
+	if (of) {
+		of->deleted = true;
+		unlinked.cluster = CLUSTER_INVALID;
+	}
+	pthread_mutex_unlock(&open_files.mutex);
+	return ps2mcfs_unlink(&vmc_metadata, unlinked, removed->parent, removed->index);
+}
+
+/**
+ * Finds the entries of the open files in the directory starting at `dir_cluster` again, as they move when the directory
+ * is compacted. The directory is found from its "." entry, so this works wherever it has been moved to
+*/
+static void open_files_relocate(cluster_t dir_cluster) {
+	dir_entry_t dot, dir;
+	browse_result_t found;
+	if (ps2mcfs_get_child(&vmc_metadata, dir_cluster, 0, &dot) != 0 || ps2mcfs_get_child(&vmc_metadata, dot.cluster, dot.dir_entry, &dir) != 0)
+		return;
+	pthread_mutex_lock(&open_files.mutex);
+	for (struct open_file* of = open_files.head; of != NULL; of = of->next) {
+		if (of->deleted || of->entry.parent.cluster != dir_cluster)
+			continue;
+		char name[sizeof(of->entry.dirent.name) + 1] = "";
+		memcpy(name, of->entry.dirent.name, sizeof(of->entry.dirent.name));
+		if (ps2mcfs_browse(&vmc_metadata, &dir, name, &found) == 0) {
+			of->entry.parent = found.parent;
+			of->entry.index = found.index;
+		}
+	}
+	pthread_mutex_unlock(&open_files.mutex);
+}
+
+/**
+ * Same as ps2mcfs_browse(), but open files are taken from the open file table, where their length may be more recent
+*/
+static int browse(const char* path, browse_result_t* result) {
+	int err = ps2mcfs_browse(&vmc_metadata, NULL, path, result);
+	if (err)
+		return err;
+	pthread_mutex_lock(&open_files.mutex);
+	struct open_file* of = open_file_find(result->parent.cluster, result->index);
+	if (of)
+		result->dirent = of->entry.dirent;
+	pthread_mutex_unlock(&open_files.mutex);
+	return 0;
+}
+
+/**
+ * Drops the attributes and data the kernel caches for `path`, if it caches any
+*/
+static void invalidate_path(const char* path) {
+	fuse_invalidate_path(fuse_get_context()->fuse, path);
+}
+
 static int do_getattr(const char* path, struct stat* stbuf, struct fuse_file_info* fi) {
 	browse_result_t result;
-	int err = ps2mcfs_browse(&vmc_metadata, NULL, path, &result);
+	pthread_rwlock_rdlock(&metadata_lock);
+	int err = browse(path, &result);
+	pthread_rwlock_unlock(&metadata_lock);
 	if (err)
 		return err;
 	init_stat(stbuf);
@@ -47,35 +440,87 @@ static int do_getattr(const char* path, struct stat* stbuf, struct fuse_file_inf
 	return 0;
 }
 
-typedef struct {
-	void* buf;
-	fuse_fill_dir_t filler;
-} readdir_args;
-
-int readdir_cb(dir_entry_t* child, void* extra) {
-	readdir_args* args = (readdir_args*) extra;
-	struct stat dirstat;
-	init_stat(&dirstat);
-	ps2mcfs_stat(child, &dirstat);
-	return args->filler(args->buf, child->name, &dirstat, 0, 0);
-}
-
 static int do_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi, enum fuse_readdir_flags flags) {
 	browse_result_t parent;
-	ps2mcfs_browse(&vmc_metadata, NULL, path, &parent);
-	readdir_args extra = { .buf = buf, .filler = filler };
-	ps2mcfs_ls(&vmc_metadata, &parent.dirent, readdir_cb, &extra);
-	return 0;
+	pthread_rwlock_rdlock(&metadata_lock);
+	int err = ps2mcfs_browse(&vmc_metadata, NULL, path, &parent);
+	if (err)
+		goto out;
+	dir_iterator_t it;
+	if (ps2mcfs_dir_iterator_init(&vmc_metadata, &parent.dirent, offset, &it) != 0) {
+		err = -ENOMEM;
+		goto out;
+	}
+	dir_entry_t* child;
+	size_t index;
+	while ((child = ps2mcfs_dir_iterator_next(&it, &index)) != NULL) {
+		struct stat dirstat = {0};
+		init_stat(&dirstat);
+		ps2mcfs_stat(child, &dirstat);
+		// the offset of the next entry is where the listing resumes when the buffer is full
+		if (filler(buf, child->name, &dirstat, index + 1, 0) != 0)
+			break;
+	}
+	ps2mcfs_dir_iterator_free(&it);
+out:
+	pthread_rwlock_unlock(&metadata_lock);
+	return err;
 }
 
 static int do_open(const char* path, struct fuse_file_info* fi) {
-	return ps2mcfs_browse(&vmc_metadata, NULL, path, NULL);
+	browse_result_t result;
+	pthread_rwlock_rdlock(&metadata_lock);
+	int err = browse(path, &result);
+	if (!err)
+		err = open_file_acquire(&result, fi);
+	pthread_rwlock_unlock(&metadata_lock);
+	return err;
 }
 
 static int do_read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
-	browse_result_t result;
-	ps2mcfs_browse(&vmc_metadata, NULL, path, &result);
-	return ps2mcfs_read(&vmc_metadata, &result.dirent, buf, size, offset);
+	struct open_file* of = open_file_get(fi);
+	pthread_rwlock_rdlock(&metadata_lock);
+	pthread_mutex_lock(&open_files.mutex);
+	const dir_entry_t dirent = of->entry.dirent;
+	pthread_mutex_unlock(&open_files.mutex);
+	int read = ps2mcfs_read(&vmc_metadata, &dirent, buf, size, offset);
+	pthread_rwlock_unlock(&metadata_lock);
+	return read;
+}
+
+static int do_flush(const char* path, struct fuse_file_info* fi) {
+	pthread_rwlock_wrlock(&metadata_lock);
+	pthread_mutex_lock(&open_files.mutex);
+	open_file_commit(open_file_get(fi));
+	pthread_mutex_unlock(&open_files.mutex);
+	int err = fat_flush(&vmc_metadata) == 0 ? 0 : -EIO;
+	pthread_rwlock_unlock(&metadata_lock);
+	return err;
+}
+
+static int do_fsync(const char* path, int datasync, struct fuse_file_info* fi) {
+	pthread_rwlock_wrlock(&metadata_lock);
+	pthread_mutex_lock(&open_files.mutex);
+	open_file_commit(open_file_get(fi));
+	pthread_mutex_unlock(&open_files.mutex);
+	open_files_write_done();
+	int err = fat_flush(&vmc_metadata);
+	pthread_rwlock_unlock(&metadata_lock);
+	if (err != 0)
+		return -EIO;
+	// the writers are held off while the image is synced, so that it doesn't write half of a change, or the
+	// metadata of a change without its data. Reads may go on meanwhile, as in the write-back thread
+	pthread_rwlock_rdlock(&metadata_lock);
+	err = mc_image_sync(&vmc_metadata) == 0 ? 0 : -errno;
+	pthread_rwlock_unlock(&metadata_lock);
+	return err;
+}
+
+static int do_release(const char* path, struct fuse_file_info* fi) {
+	pthread_rwlock_wrlock(&metadata_lock);
+	open_file_release(fi);
+	pthread_rwlock_unlock(&metadata_lock);
+	return 0;
 }
 
 static int do_mkdir(const char* path, mode_t mode) {
@@ -84,12 +529,15 @@ static int do_mkdir(const char* path, mode_t mode) {
 	strcpy(dir_name, path);
 	strcpy(base_name, path);
 	browse_result_t parent;
+	pthread_rwlock_wrlock(&metadata_lock);
 	int err = ps2mcfs_browse(&vmc_metadata, NULL, dirname(dir_name), &parent);
-	if (err)
-		return err;
-	// use the most permissive combination of umask
-	mode = ((mode/64)|(mode/8)|mode) & 0007;
-	return ps2mcfs_mkdir(&vmc_metadata, &parent.dirent, basename(base_name), mode);
+	if (!err) {
+		// use the most permissive combination of umask
+		mode = ((mode/64)|(mode/8)|mode) & 0007;
+		err = ps2mcfs_mkdir(&vmc_metadata, &parent.dirent, basename(base_name), mode);
+	}
+	pthread_rwlock_unlock(&metadata_lock);
+	return err;
 }
 
 static int do_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
@@ -98,19 +546,26 @@ static int do_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
 	char base_name[NAME_MAX];
 	strcpy(dir_name, path);
 	strcpy(base_name, path);
-	browse_result_t parent;
+	browse_result_t parent, result;
+	pthread_rwlock_wrlock(&metadata_lock);
 	int err = ps2mcfs_browse(&vmc_metadata, NULL, dirname(dir_name), &parent);
 	if (err)
-		return err;
+		goto out;
 	mode = ((mode / 64) | (mode / 8) | mode) & 0007;
-	return ps2mcfs_create(&vmc_metadata, &parent.dirent, basename(base_name), CLUSTER_INVALID, mode);
+	const char* name = basename(base_name);
+	err = ps2mcfs_create(&vmc_metadata, &parent.dirent, name, CLUSTER_INVALID, mode);
+	if (err)
+		goto out;
+	err = ps2mcfs_browse(&vmc_metadata, &parent.dirent, name, &result);
+	if (!err)
+		err = open_file_acquire(&result, fi);
+out:
+	pthread_rwlock_unlock(&metadata_lock);
+	return err;
 }
 
 static int do_utimens(const char* path, const struct timespec tv[2], struct fuse_file_info* fi) {
 	browse_result_t result;
-	int err = ps2mcfs_browse(&vmc_metadata, NULL, path, &result);
-	if (err)
-		return err;
 	date_time_t modification;
 	if (tv[1].tv_nsec == UTIME_OMIT) {
 		// UTIMENSAT(2): If the tv_nsec field of one of the timespec structures has the special
@@ -126,86 +581,240 @@ static int do_utimens(const char* path, const struct timespec tv[2], struct fuse
 		// 1 second = 1e9 nanoseconds
 		ps2mcfs_time_to_date_time(tv[1].tv_nsec / 1000000000, &modification);
 	}
+	pthread_rwlock_wrlock(&metadata_lock);
+	int err = browse(path, &result);
+	if (err) {
+		pthread_rwlock_unlock(&metadata_lock);
+		return err;
+	}
+	pthread_mutex_lock(&open_files.mutex);
 	ps2mcfs_utime(&vmc_metadata, &result, modification);
+	// the whole entry was written, including the pending length of an open file
+	struct open_file* of = open_file_find(result.parent.cluster, result.index);
+	if (of) {
+		of->entry.dirent = result.dirent;
+		of->dirty = false;
+	}
+	pthread_mutex_unlock(&open_files.mutex);
+	pthread_rwlock_unlock(&metadata_lock);
 	return 0;
 }
 
 static int do_write(const char* path, const char* data, size_t size, off_t offset, struct fuse_file_info* fi) {
+	struct open_file* of = open_file_get(fi);
+	pthread_rwlock_wrlock(&metadata_lock);
+	// the exclusive metadata lock keeps the other requests away from the entry, the table is only locked to copy it
+	pthread_mutex_lock(&open_files.mutex);
+	dir_entry_t dirent = of->entry.dirent;
+	file_tail_t tail = of->tail;
+	pthread_mutex_unlock(&open_files.mutex);
+	int written = ps2mcfs_write_data(&vmc_metadata, &dirent, &tail, (const void*) data, size, offset);
+	pthread_mutex_lock(&open_files.mutex);
+	// the directory entry is written back on flush, fsync or release
+	if (dirent.length != of->entry.dirent.length || dirent.cluster != of->entry.dirent.cluster)
+		of->dirty = true;
+	of->entry.dirent = dirent;
+	of->tail = tail;
+	pthread_mutex_unlock(&open_files.mutex);
+	pthread_rwlock_unlock(&metadata_lock);
+	return written;
+}
+
+/**
+ * Writes a changed directory entry to the card, and to the open file that holds it if any
+*/
+static void write_entry(browse_result_t* entry) {
+	pthread_mutex_lock(&open_files.mutex);
+	ps2mcfs_set_child(&vmc_metadata, entry->parent.cluster, entry->index, &entry->dirent);
+	struct open_file* of = open_file_find(entry->parent.cluster, entry->index);
+	if (of) {
+		of->entry.dirent = entry->dirent;
+		of->dirty = false;
+		// the chain may have changed, its end is looked for again on the next append. The clusters past the end
+		// of the file were given back or reserved on purpose, so they are not trimmed on release
+		of->tail = FILE_TAIL_INIT;
+	}
+	pthread_mutex_unlock(&open_files.mutex);
+}
+
+static int do_truncate(const char* path, off_t size, struct fuse_file_info* fi) {
 	browse_result_t result;
-	int err = ps2mcfs_browse(&vmc_metadata, NULL, path, &result);
-	if (err)
-		return err;
-	return ps2mcfs_write(&vmc_metadata, &result, (const void*) data, size, offset);
+	pthread_rwlock_wrlock(&metadata_lock);
+	int err = browse(path, &result);
+	if (!err) {
+		err = ps2mcfs_truncate(&vmc_metadata, &result.dirent, open_file_tail(&result), size);
+		// the first cluster may have been allocated even if the file could not be extended
+		if (!ps2mcfs_is_directory(&result.dirent))
+			write_entry(&result);
+	}
+	pthread_rwlock_unlock(&metadata_lock);
+	return err;
+}
+
+static int do_fallocate(const char* path, int mode, off_t offset, off_t length, struct fuse_file_info* fi) {
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+	browse_result_t result;
+	pthread_rwlock_wrlock(&metadata_lock);
+	int err = browse(path, &result);
+	if (!err) {
+		err = ps2mcfs_fallocate(&vmc_metadata, &result.dirent, open_file_tail(&result), offset, length, mode & FALLOC_FL_KEEP_SIZE);
+		if (!ps2mcfs_is_directory(&result.dirent))
+			write_entry(&result);
+	}
+	pthread_rwlock_unlock(&metadata_lock);
+	return err;
+}
+
+static int do_statfs(const char* path, struct statvfs* stbuf) {
+	pthread_rwlock_rdlock(&metadata_lock);
+	ps2mcfs_statfs(&vmc_metadata, stbuf);
+	pthread_rwlock_unlock(&metadata_lock);
+	return 0;
 }
 
 static int do_unlink(const char* path) {
 	browse_result_t result;
+	pthread_rwlock_wrlock(&metadata_lock);
 	int err = ps2mcfs_browse(&vmc_metadata, NULL, path, &result);
-	if (err)
-		return err;
-	return ps2mcfs_unlink(&vmc_metadata, result.dirent, result.parent, result.index);
+	if (!err) {
+		err = unlink_file(&result);
+		open_files_relocate(result.parent.cluster);
+	}
+	pthread_rwlock_unlock(&metadata_lock);
+	// the kernel may wait for requests that need the metadata lock, so it is told only once the lock is released
+	if (!err) {
+		char dir_name[PATH_MAX];
+		strcpy(dir_name, path);
+		invalidate_path(dirname(dir_name));
+	}
+	return err;
 }
 
 static int do_rmdir(const char* path) {
 	browse_result_t result;
+	pthread_rwlock_wrlock(&metadata_lock);
 	int err = ps2mcfs_browse(&vmc_metadata, NULL, path, &result);
-	if (err)
-		return err;
-	return ps2mcfs_rmdir(&vmc_metadata, result.dirent, result.parent, result.index);
+	if (!err && !ps2mcfs_is_empty_dir(&vmc_metadata, &result.dirent))
+		err = -ENOTEMPTY;
+	if (!err) {
+		err = ps2mcfs_rmdir(&vmc_metadata, result.dirent, result.parent, result.index);
+		open_files_relocate(result.parent.cluster);
+	}
+	pthread_rwlock_unlock(&metadata_lock);
+	if (!err) {
+		char dir_name[PATH_MAX];
+		strcpy(dir_name, path);
+		invalidate_path(dirname(dir_name));
+	}
+	return err;
 }
 
-static int do_rename(const char * path_from, const char * path_to, unsigned int flags) {
+/**
+ * Implementation of rename(), with the metadata lock held
+*/
+static int rename_locked(const char * path_from, const char * path_to, unsigned int flags) {
 	browse_result_t origin, destination;
-	int err1 = ps2mcfs_browse(&vmc_metadata, NULL, path_from, &origin);
-	int err2 = ps2mcfs_browse(&vmc_metadata, NULL, path_to, &destination);
+	int err1 = browse(path_from, &origin);
+	int err2 = browse(path_to, &destination);
 
 	if (err1) {
 		return err1;
 	}
+	if (err2 && err2 != -ENOENT) {
+		return err2;
+	}
 	if ((flags & RENAME_NOREPLACE) && !err2) {
 		return -EEXIST;
 	}
 	if ((flags & RENAME_EXCHANGE) && err2) {
 		return -ENOENT;
 	}
-	// target file does not exist. create it
-	if (err2 == -ENOENT) {
-		char dir_name[PATH_MAX];
-		char base_name[NAME_MAX];
-		strcpy(dir_name, path_to);
-		strcpy(base_name, path_to);
-		// browse to the parent dir
-		if ((err2 = ps2mcfs_browse(&vmc_metadata, NULL, dirname(dir_name), &destination)))
-			return err2;
-		if ((err2 = ps2mcfs_create(&vmc_metadata, &destination.dirent, basename(base_name), origin.dirent.cluster, origin.dirent.mode)))
+	// renaming an entry to itself does nothing
+	if (!err2 && origin.parent.cluster == destination.parent.cluster && origin.index == destination.index) {
+		return 0;
+	}
+
+	char dir_name[PATH_MAX];
+	char base_name[NAME_MAX];
+	strcpy(dir_name, path_to);
+	strcpy(base_name, path_to);
+
+	pthread_mutex_lock(&open_files.mutex);
+	struct open_file* origin_file = open_file_find(origin.parent.cluster, origin.index);
+	struct open_file* destination_file = err2 ? NULL : open_file_find(destination.parent.cluster, destination.index);
+	pthread_mutex_unlock(&open_files.mutex);
+
+	if (flags & RENAME_EXCHANGE) {
+		// the pending changes of both files are written by the exchange
+		pthread_mutex_lock(&open_files.mutex);
+		ps2mcfs_exchange(&vmc_metadata, &origin, &destination);
+		if (origin_file) {
+			origin_file->entry = destination;
+			origin_file->dirty = false;
+		}
+		if (destination_file) {
+			destination_file->entry = origin;
+			destination_file->dirty = false;
+		}
+		pthread_mutex_unlock(&open_files.mutex);
+		return 0;
+	}
+
+	if (!err2) {
+		// the destination is replaced by the origin
+		if (ps2mcfs_is_directory(&destination.dirent))
+			err2 = ps2mcfs_rmdir(&vmc_metadata, destination.dirent, destination.parent, destination.index);
+		else
+			err2 = unlink_file(&destination);
+		if (err2)
 			return err2;
+		// removing the destination may have compacted its directory, which moves the entries
+		open_files_relocate(destination.parent.cluster);
+		if ((err1 = browse(path_from, &origin)))
+			return err1;
 	}
 
-	// browse again to reload dirents and parent dirents
-	if ((err1 = ps2mcfs_browse(&vmc_metadata, NULL, path_from, &origin)))
-		return err1;
-	if ((err2 = ps2mcfs_browse(&vmc_metadata, NULL, path_to, &destination)))
+	browse_result_t parent, moved;
+	if ((err2 = ps2mcfs_browse(&vmc_metadata, NULL, dirname(dir_name), &parent)))
 		return err2;
+	pthread_mutex_lock(&open_files.mutex);
+	err1 = ps2mcfs_rename(&vmc_metadata, &origin, &parent.dirent, basename(base_name), &moved);
+	// the open origin follows its entry, whose pending changes were written with it
+	origin_file = open_file_find(origin.parent.cluster, origin.index);
+	if (!err1 && origin_file) {
+		origin_file->entry = moved;
+		origin_file->dirty = false;
+	}
+	pthread_mutex_unlock(&open_files.mutex);
+	return err1;
+}
 
-	// Swap files origin <-> destination
-	ps2mcfs_set_child(&vmc_metadata, destination.parent.cluster, destination.index, &origin.dirent);
-	ps2mcfs_set_child(&vmc_metadata, origin.parent.cluster, origin.index, &destination.dirent);
-	// delete the old origin, which is now stored in destination.parent[destination.index]
-	if (!(flags & RENAME_EXCHANGE)) {
-		// prevent deleting the contents of the moved file in case they point to the same file contents
-		if (origin.dirent.cluster == destination.dirent.cluster)
-			origin.dirent.cluster = CLUSTER_INVALID;
-		ps2mcfs_unlink(&vmc_metadata, origin.dirent, destination.parent, destination.index);
+static int do_rename(const char * path_from, const char * path_to, unsigned int flags) {
+	pthread_rwlock_wrlock(&metadata_lock);
+	int err = rename_locked(path_from, path_to, flags);
+	pthread_rwlock_unlock(&metadata_lock);
+	if (!err) {
+		char dir_from[PATH_MAX];
+		char dir_to[PATH_MAX];
+		strcpy(dir_from, path_from);
+		strcpy(dir_to, path_to);
+		invalidate_path(dirname(dir_from));
+		invalidate_path(dirname(dir_to));
 	}
-	return 0;
+	return err;
 }
 
 static struct fuse_operations operations = {
 	.init = do_init,
+	.destroy = do_destroy,
 	.getattr = do_getattr,
 	.readdir = do_readdir,
 	.open = do_open,
 	.read = do_read,
+	.flush = do_flush,
+	.fsync = do_fsync,
+	.release = do_release,
 	.mkdir = do_mkdir,
 	.create = do_create,
 	.utimens = do_utimens,
@@ -213,6 +822,9 @@ static struct fuse_operations operations = {
 	.unlink = do_unlink,
 	.rmdir = do_rmdir,
 	.rename = do_rename,
+	.truncate = do_truncate,
+	.fallocate = do_fallocate,
+	.statfs = do_statfs,
 };
 
 
@@ -220,6 +832,10 @@ struct cli_options {
 	// fuseps2mc options
 	char* mc_path;
 	int sync_to_fs;
+	int repair_ecc;
+	unsigned int scrub_rate;
+	unsigned int writeback_interval;
+	int lowlevel;
 
 	// standard fuse options
 	char* mountpoint;
@@ -233,6 +849,10 @@ struct cli_options {
 
 static const struct fuse_opt CLI_OPTIONS[] = {
 	{.templ = "-S",             .offset = offsetof(struct cli_options, sync_to_fs),   .value = true},
+	{.templ = "-R",             .offset = offsetof(struct cli_options, repair_ecc),   .value = true},
+	{.templ = "-L",             .offset = offsetof(struct cli_options, lowlevel),     .value = true},
+	{.templ = "scrub=%u",       .offset = offsetof(struct cli_options, scrub_rate),   .value = 1},
+	{.templ = "writeback=%u",   .offset = offsetof(struct cli_options, writeback_interval), .value = 1},
 	{.templ = "-h",             .offset = offsetof(struct cli_options, show_help),    .value = 1},
 	{.templ = "--help",         .offset = offsetof(struct cli_options, show_help),    .value = 1},
 	{.templ = "-V",             .offset = offsetof(struct cli_options, show_version), .value = 1},
@@ -251,6 +871,11 @@ void usage(FILE* stream, const char* program_name) {
 		"Mounts a Sony PlayStation 2 memory card image as a local filesystem in userspace\n"
 		"\nfuseps2mcfs options:\n"
 		"    -S                     sync filesystem changes to the memorycard file\n"
+		"    -R                     rewrite pages with correctable ECC errors when they are read\n"
+		"    -o scrub=N             check and repair the ECC of N clusters per second while idle (default: 0, disabled)\n"
+		"    -o writeback=N         keep the changes in memory and write the changed pages to the memorycard file\n"
+		"                           every N seconds, on fsync and when unmounting (default: 0, disabled)\n"
+		"    -L                     use the low-level FUSE API, which resolves paths one component at a time\n"
 		"\nOptions:\n"
 		"    -h   --help            print help\n"
 		"    -V   --version         print version\n"
@@ -294,6 +919,10 @@ int main(int argc, char** argv) {
 	struct cli_options opts = {
 		.mc_path = NULL,
 		.sync_to_fs = 0,
+		.repair_ecc = 0,
+		.scrub_rate = 0,
+		.writeback_interval = 0,
+		.lowlevel = 0,
 
 		.mountpoint = NULL,
 		.show_help = 0,
@@ -336,44 +965,36 @@ int main(int argc, char** argv) {
 		goto out1;
 	}
 
-	if (opts.sync_to_fs) {
-		vmc_metadata.file = fopen(opts.mc_path, "rb+");
+	if (opts.sync_to_fs || opts.writeback_interval) {
 		fprintf(
 			stderr,
 			"WARNING: Opening memory card file \"%s\" for read and write operations.\n"
 			"This may cause data corruption as fuseps2mcfs is still in early development.\n"
-			"Consider running without the -S flag.\n",
+			"Consider running without the -S flag and the writeback option.\n",
 			opts.mc_path
 		);
 	}
-	else {
-		// memorycard sync operations are disabled
-		// create a memory buffer and copy the whole memory card file 
-		FILE* f = fopen(opts.mc_path, "rb+");
-		if (!f) {
-			fprintf(stderr, "error: could not open file: %s\n", opts.mc_path);
-			res = 2;
-			goto out1;
-		}
-		fseek(f, 0, SEEK_END);
-		size_t size = ftell(f);
-		fseek(f, 0, SEEK_SET);
-		vmc_metadata.file = fmemopen(NULL, size, "rb+");
-
-		while (!feof(f)) {
-			char buffer[1024];
-			fwrite(buffer, 1, fread(buffer, 1, sizeof(buffer), f), vmc_metadata.file);
-		}
-
-		fclose(f);
-		fseek(vmc_metadata.file, 0, SEEK_SET);
-	}
-	if (!vmc_metadata.file) {
-		fprintf(stderr, "error: could not open file: %s\n", opts.mc_path);
+	vmc_metadata.repair_ecc = opts.repair_ecc;
+	scrubber.rate = opts.scrub_rate;
+	writeback.interval = opts.writeback_interval;
+	// without -S memorycard sync operations are disabled: the image is mapped copy-on-write
+	// and the changes are discarded when unmounting, unless they are written back
+	enum mc_image_mode image_mode = MC_IMAGE_PRIVATE;
+	if (opts.sync_to_fs)
+		image_mode = MC_IMAGE_SHARED;
+	else if (opts.writeback_interval)
+		image_mode = MC_IMAGE_WRITEBACK;
+	if (mc_image_open(&vmc_metadata, opts.mc_path, image_mode) != 0) {
+		fprintf(stderr, "error: could not open file: %s: %s\n", opts.mc_path, strerror(errno));
 		res = 2;
 		goto out1;
 	}
 
+	if (opts.lowlevel) {
+		res = fuseps2mc_ll_main(&args, opts.mountpoint, opts.foreground, opts.singlethread);
+		goto out1;
+	}
+
 	struct fuse* fuse = fuse_new(&args, &operations, sizeof(operations), NULL);
 	if (fuse == NULL) {
 		res = 3;
@@ -422,8 +1043,7 @@ out1:
 
 	if (opts.mc_path != NULL)
 		free(opts.mc_path);
-	if (vmc_metadata.file != NULL)
-		fclose(vmc_metadata.file);
+	mc_image_close(&vmc_metadata);
 	return res;
 }
 
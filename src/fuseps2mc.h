@@ -0,0 +1,45 @@
+#ifndef __FUSEPS2MC_H__
+#define __FUSEPS2MC_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "vmc_types.h"
+
+struct fuse_args;
+
+// how long the kernel may cache entries, attributes and file data, in seconds. This process is the only writer
+// to the card, so the kernel only needs to be told about the changes it can't see itself
+#define CACHE_TIMEOUT 60.0
+
+// the mounted memory card, shared by the high-level and the low-level FUSE frontends
+extern struct vmc_meta vmc_metadata;
+
+// FUSE requests run in parallel. Requests that change the FAT or a directory take this lock exclusively,
+// the others share it, so that the data of files can be read by several threads at once
+extern pthread_rwlock_t metadata_lock;
+
+/**
+ * Reads the superblock and the FAT of the mounted card, and starts the caches and the ECC scrubber.
+ * Returns 0 on success or -1 on error
+*/
+int fuseps2mc_load(void);
+
+/**
+ * Stops the ECC scrubber, writes the FAT back to the card and releases everything fuseps2mc_load() allocated
+*/
+void fuseps2mc_unload(void);
+
+/**
+ * Gives back the clusters allocated ahead of the writes to the files open through the low-level frontend,
+ * so that they are not written to the card. The metadata lock must be held exclusively
+*/
+void fuseps2mc_ll_write_done(void);
+
+/**
+ * Mounts the card with the low-level FUSE API and serves requests until it is unmounted.
+ * Returns the exit status of the program
+*/
+int fuseps2mc_ll_main(struct fuse_args* args, const char* mountpoint, bool foreground, bool singlethread);
+
+#endif
@@ -0,0 +1,893 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <linux/fs.h> // RENAME_EXCHANGE, RENAME_NOREPLACE
+#include <linux/falloc.h> // FALLOC_FL_KEEP_SIZE
+
+#define FUSE_USE_VERSION 30
+
+#include <fuse3/fuse_lowlevel.h>
+
+#include "vmc_types.h"
+#include "mc_image.h"
+#include "fuseps2mc.h"
+#include "ps2mcfs.h"
+#include "utils.h"
+
+
+#define NODE_BUCKETS 1024
+
+// inode number of the entries listed by readdir() that have no node yet (same as the high-level library)
+#define UNKNOWN_INO 0xffffffff
+
+// an inode known to the kernel. Its node id is the address of the node, which stays the same while the kernel
+// holds a reference to it, even if its directory entry is moved by a rename or by the compaction of its directory
+struct node {
+	fuse_ino_t ino;        // inode number reported in `st_ino`
+	browse_result_t entry; // location and contents of the directory entry, only changed with the metadata lock held exclusively
+	bool dirty;            // the length or first cluster in `entry.dirent` is not written to the card yet
+	bool deleted;          // the directory entry was removed, the node is in the list of deleted nodes and its
+	                       // clusters are freed when its last open file handle is released
+	file_tail_t tail;      // the end of the cluster chain of a file, so that appends don't walk it
+	uint64_t lookups;      // references held by the kernel
+	unsigned int opens;    // open file handles
+	struct node* location_next; // next node in the same bucket of the location table, or in the list of deleted nodes
+};
+
+// the nodes, hashed by the location of their directory entry
+static struct {
+	pthread_mutex_t mutex;
+	struct node* by_location[NODE_BUCKETS];
+	struct node* deleted; // nodes whose directory entry was removed while the kernel still refers to them
+	fuse_ino_t next_ino;
+} nodes = {.mutex = PTHREAD_MUTEX_INITIALIZER, .by_location = {NULL}, .deleted = NULL, .next_ino = FUSE_ROOT_ID + 1};
+
+// the root directory, which is never forgotten
+static struct node root_node;
+
+// the mounted session, used to notify the kernel of changes to the inodes it caches
+static struct fuse_session* session;
+
+
+static inline struct node* node_get(fuse_ino_t ino) {
+	return ino == FUSE_ROOT_ID ? &root_node : (struct node*) (uintptr_t) ino;
+}
+
+static inline fuse_ino_t node_id(const struct node* node) {
+	return node == &root_node ? FUSE_ROOT_ID : (uintptr_t) node;
+}
+
+static struct node** node_bucket(cluster_t parent_cluster, size_t index) {
+	return &nodes.by_location[((parent_cluster * 2654435761u) ^ index) % NODE_BUCKETS];
+}
+
+/**
+ * Returns the node whose directory entry is at `index` in the directory starting at `parent_cluster`, or NULL.
+ * The table must be locked
+*/
+static struct node* node_find(cluster_t parent_cluster, size_t index) {
+	struct node* node = *node_bucket(parent_cluster, index);
+	while (node != NULL && (node->entry.parent.cluster != parent_cluster || node->entry.index != index))
+		node = node->location_next;
+	return node;
+}
+
+static void node_link(struct node* node) {
+	struct node** bucket = node_bucket(node->entry.parent.cluster, node->entry.index);
+	node->location_next = *bucket;
+	*bucket = node;
+}
+
+static void node_unlink(struct node* node) {
+	struct node** link = node_bucket(node->entry.parent.cluster, node->entry.index);
+	while (*link != NULL && *link != node)
+		link = &(*link)->location_next;
+	if (*link == node)
+		*link = node->location_next;
+}
+
+/**
+ * Returns the node of a directory entry with one more reference from the kernel, creating it if needed.
+ * The table must be locked. Returns NULL if out of memory
+*/
+static struct node* node_acquire(const browse_result_t* entry) {
+	struct node* node = node_find(entry->parent.cluster, entry->index);
+	if (node == NULL) {
+		node = malloc(sizeof(struct node));
+		if (node == NULL)
+			return NULL;
+		*node = (struct node) {.ino = nodes.next_ino++, .entry = *entry, .dirty = false, .deleted = false, .tail = FILE_TAIL_INIT, .lookups = 0, .opens = 0};
+		node_link(node);
+	}
+	node->lookups++;
+	return node;
+}
+
+/**
+ * Frees a node once neither the kernel nor an open file refer to it. The table must be locked
+*/
+static void node_release(struct node* node) {
+	if (node == &root_node || node->lookups > 0 || node->opens > 0)
+		return;
+	if (node->deleted) {
+		struct node** link = &nodes.deleted;
+		while (*link != node)
+			link = &(*link)->location_next;
+		*link = node->location_next;
+	}
+	else
+		node_unlink(node);
+	free(node);
+}
+
+/**
+ * Points a node to the new location and contents of its directory entry. The table must be locked
+*/
+static void node_move(struct node* node, const browse_result_t* entry) {
+	node_unlink(node);
+	node->entry = *entry;
+	node->dirty = false;
+	node_link(node);
+}
+
+/**
+ * Writes the pending changes of a node to its directory entry. The table must be locked
+*/
+static void node_commit(struct node* node) {
+	if (node->dirty && !node->deleted)
+		ps2mcfs_set_child(&vmc_metadata, node->entry.parent.cluster, node->entry.index, &node->entry.dirent);
+	node->dirty = false;
+}
+
+/**
+ * Detaches the node of a removed directory entry, so that its pending changes are not written over another entry.
+ * Returns true if the node is open, then its clusters must be kept until it is released
+*/
+static bool node_forget_location(const browse_result_t* removed) {
+	bool open = false;
+	pthread_mutex_lock(&nodes.mutex);
+	struct node* node = node_find(removed->parent.cluster, removed->index);
+	if (node != NULL && node != &root_node) {
+		node_unlink(node);
+		node->deleted = true;
+		node->location_next = nodes.deleted;
+		nodes.deleted = node;
+		open = node->opens > 0;
+	}
+	pthread_mutex_unlock(&nodes.mutex);
+	return open;
+}
+
+/**
+ * Gives back the clusters allocated ahead of the writes and writes the pending changes of a file node whose last
+ * open file handle is released, or frees the clusters of a deleted one. The table must be locked
+*/
+static void node_close(struct node* node) {
+	if (!node->deleted) {
+		ps2mcfs_write_done(&vmc_metadata, &node->entry.dirent, &node->tail);
+		node_commit(node);
+		return;
+	}
+	if (node->entry.dirent.cluster != CLUSTER_INVALID)
+		fat_truncate(&vmc_metadata, node->entry.dirent.cluster, 0);
+	node->entry.dirent.cluster = CLUSTER_INVALID;
+	node->entry.dirent.length = 0;
+	node->tail = FILE_TAIL_INIT;
+}
+
+/**
+ * Finds the entries of the nodes in `dir` again, as they move when the directory is compacted
+*/
+static void nodes_relocate(const dir_entry_t* dir) {
+	dir_entry_t parent = *dir;
+	struct node* moved = NULL;
+	pthread_mutex_lock(&nodes.mutex);
+	for (size_t i = 0; i < NODE_BUCKETS; ++i) {
+		struct node** link = &nodes.by_location[i];
+		while (*link != NULL) {
+			struct node* node = *link;
+			if (node != &root_node && node->entry.parent.cluster == parent.cluster) {
+				*link = node->location_next;
+				node->location_next = moved;
+				moved = node;
+			}
+			else
+				link = &node->location_next;
+		}
+	}
+	while (moved != NULL) {
+		struct node* node = moved;
+		moved = node->location_next;
+		char name[sizeof(node->entry.dirent.name) + 1] = "";
+		memcpy(name, node->entry.dirent.name, sizeof(node->entry.dirent.name));
+		browse_result_t found;
+		if (ps2mcfs_browse(&vmc_metadata, &parent, name, &found) == 0) {
+			node->entry.parent = found.parent;
+			node->entry.index = found.index;
+		}
+		node_link(node);
+	}
+	pthread_mutex_unlock(&nodes.mutex);
+}
+
+void fuseps2mc_ll_write_done(void) {
+	pthread_mutex_lock(&nodes.mutex);
+	for (size_t i = 0; i < NODE_BUCKETS; ++i) {
+		for (struct node* node = nodes.by_location[i]; node != NULL; node = node->location_next) {
+			if (node->opens > 0)
+				ps2mcfs_write_done(&vmc_metadata, &node->entry.dirent, &node->tail);
+		}
+	}
+	pthread_mutex_unlock(&nodes.mutex);
+}
+
+/**
+ * Frees all the nodes when unmounting. The files that are still open are closed first,
+ * so that the card holds their latest length
+*/
+static void nodes_free(void) {
+	pthread_mutex_lock(&nodes.mutex);
+	for (size_t i = 0; i < NODE_BUCKETS; ++i) {
+		while (nodes.by_location[i] != NULL) {
+			struct node* node = nodes.by_location[i];
+			nodes.by_location[i] = node->location_next;
+			if (node == &root_node)
+				continue;
+			if (node->opens > 0)
+				node_close(node);
+			free(node);
+		}
+	}
+	while (nodes.deleted != NULL) {
+		struct node* node = nodes.deleted;
+		nodes.deleted = node->location_next;
+		if (node->opens > 0)
+			node_close(node);
+		free(node);
+	}
+	pthread_mutex_unlock(&nodes.mutex);
+}
+
+/**
+ * Returns the current directory entry of a node. Files are kept up to date in the node, but directories are
+ * read again from the card, since their length changes whenever an entry is added to them
+*/
+static int node_entry(const struct node* node, browse_result_t* entry) {
+	*entry = node->entry;
+	if (!ps2mcfs_is_directory(&node->entry.dirent))
+		return 0;
+	if (ps2mcfs_get_child(&vmc_metadata, node->entry.parent.cluster, node->entry.index, &entry->dirent) != 0)
+		return -EIO;
+	return 0;
+}
+
+/**
+ * Finds the entry called `name` in `dir`. If the entry is an open file, its pending length is taken from its node,
+ * which is returned in `node` if not NULL
+*/
+static int find_entry(dir_entry_t* dir, const char* name, browse_result_t* result, struct node** node) {
+	if (!ps2mcfs_is_directory(dir))
+		return -ENOTDIR;
+	int err = ps2mcfs_browse(&vmc_metadata, dir, name, result);
+	if (err)
+		return err;
+	pthread_mutex_lock(&nodes.mutex);
+	struct node* found = node_find(result->parent.cluster, result->index);
+	if (found != NULL && !ps2mcfs_is_directory(&result->dirent))
+		result->dirent = found->entry.dirent;
+	pthread_mutex_unlock(&nodes.mutex);
+	if (node)
+		*node = found;
+	return 0;
+}
+
+static void fill_stat(fuse_req_t req, const struct node* node, const dir_entry_t* dirent, struct stat* stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = node->ino;
+	stbuf->st_uid = fuse_req_ctx(req)->uid;
+	stbuf->st_gid = fuse_req_ctx(req)->gid;
+	ps2mcfs_stat(dirent, stbuf);
+}
+
+/**
+ * Takes a reference to the node of `entry` for the kernel, and describes it in `e`
+*/
+static int fill_entry(fuse_req_t req, const browse_result_t* entry, struct fuse_entry_param* e) {
+	pthread_mutex_lock(&nodes.mutex);
+	struct node* node = node_acquire(entry);
+	if (node == NULL) {
+		pthread_mutex_unlock(&nodes.mutex);
+		return -ENOMEM;
+	}
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	e->ino = node_id(node);
+	e->attr_timeout = CACHE_TIMEOUT;
+	e->entry_timeout = CACHE_TIMEOUT;
+	fill_stat(req, node, ps2mcfs_is_directory(&entry->dirent) ? &entry->dirent : &node->entry.dirent, &e->attr);
+	pthread_mutex_unlock(&nodes.mutex);
+	return 0;
+}
+
+/**
+ * Drops the attributes of a node cached by the kernel. Safe to call while handling a request on the node,
+ * since the kernel doesn't lock inodes to invalidate their attributes
+*/
+static void node_invalidate(const struct node* node) {
+	if (session != NULL)
+		fuse_lowlevel_notify_inval_inode(session, node_id(node), -1, 0);
+}
+
+/**
+ * Returns true if the directory that starts at `dir_cluster` is `ancestor` or is inside it
+*/
+static bool is_inside(cluster_t dir_cluster, cluster_t ancestor) {
+	const cluster_t root_cluster = vmc_metadata.superblock.root_cluster;
+	// the depth is bounded in case the "." entries of a damaged card form a loop
+	for (unsigned int depth = 0; depth < vmc_metadata.superblock.last_allocatable; ++depth) {
+		if (dir_cluster == ancestor)
+			return true;
+		dir_entry_t dot;
+		if (dir_cluster == root_cluster || ps2mcfs_get_child(&vmc_metadata, dir_cluster, 0, &dot) != 0)
+			return false;
+		dir_cluster = dot.cluster;
+	}
+	return false;
+}
+
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
+	browse_result_t dir, result;
+	struct fuse_entry_param e;
+	pthread_rwlock_rdlock(&metadata_lock);
+	int err = node_entry(node_get(parent), &dir);
+	if (!err)
+		err = find_entry(&dir.dirent, name, &result, NULL);
+	if (!err)
+		err = fill_entry(req, &result, &e);
+	pthread_rwlock_unlock(&metadata_lock);
+	if (err == -ENOENT) {
+		// the kernel caches the missing entry, and forgets it when a file of that name is created
+		memset(&e, 0, sizeof(struct fuse_entry_param));
+		e.entry_timeout = CACHE_TIMEOUT;
+		fuse_reply_entry(req, &e);
+	}
+	else if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+	struct node* node = node_get(ino);
+	pthread_mutex_lock(&nodes.mutex);
+	node->lookups -= MIN(nlookup, node->lookups);
+	node_release(node);
+	pthread_mutex_unlock(&nodes.mutex);
+	fuse_reply_none(req);
+}
+
+static void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data* forgets) {
+	pthread_mutex_lock(&nodes.mutex);
+	for (size_t i = 0; i < count; ++i) {
+		struct node* node = node_get(forgets[i].ino);
+		node->lookups -= MIN(forgets[i].nlookup, node->lookups);
+		node_release(node);
+	}
+	pthread_mutex_unlock(&nodes.mutex);
+	fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	struct node* node = node_get(ino);
+	browse_result_t entry;
+	struct stat stbuf;
+	pthread_rwlock_rdlock(&metadata_lock);
+	int err = node_entry(node, &entry);
+	if (!err)
+		fill_stat(req, node, &entry.dirent, &stbuf);
+	pthread_rwlock_unlock(&metadata_lock);
+	if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_attr(req, &stbuf, CACHE_TIMEOUT);
+}
+
+/**
+ * Writes the directory entry of a file node whose length or clusters were changed, passing `err` through
+*/
+static int resize_node(struct node* node, int err) {
+	// the first cluster may have been allocated even if the file could not be extended
+	pthread_mutex_lock(&nodes.mutex);
+	node->dirty = true;
+	node_commit(node);
+	// the chain may have changed, its end is looked for again on the next append. The clusters past the end
+	// of the file were given back or reserved on purpose, so they are not trimmed on release
+	node->tail = FILE_TAIL_INIT;
+	pthread_mutex_unlock(&nodes.mutex);
+	return err;
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set, struct fuse_file_info* fi) {
+	// ownership and permission bits can't be changed (same as the high-level frontend)
+	if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+	struct node* node = node_get(ino);
+	browse_result_t entry;
+	struct stat stbuf;
+	pthread_rwlock_wrlock(&metadata_lock);
+	int err = node_entry(node, &entry);
+	if (!err && (to_set & FUSE_SET_ATTR_SIZE)) {
+		if (ps2mcfs_is_directory(&entry.dirent))
+			err = -EISDIR;
+		else
+			err = resize_node(node, ps2mcfs_truncate(&vmc_metadata, &node->entry.dirent, &node->tail, attr->st_size));
+		entry.dirent = node->entry.dirent;
+	}
+	if (!err && (to_set & (FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_MTIME_NOW))) {
+		date_time_t modification;
+		ps2mcfs_time_to_date_time((to_set & FUSE_SET_ATTR_MTIME_NOW) ? time(NULL) : attr->st_mtime, &modification);
+		pthread_mutex_lock(&nodes.mutex);
+		// the whole entry is written, including the pending length of an open file
+		ps2mcfs_utime(&vmc_metadata, &entry, modification);
+		node->entry.dirent = entry.dirent;
+		node->dirty = false;
+		pthread_mutex_unlock(&nodes.mutex);
+	}
+	if (!err)
+		fill_stat(req, node, &entry.dirent, &stbuf);
+	pthread_rwlock_unlock(&metadata_lock);
+	if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_attr(req, &stbuf, CACHE_TIMEOUT);
+}
+
+static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, bool plus) {
+	char* buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	size_t used = 0;
+	browse_result_t dir;
+	dir_iterator_t it;
+	pthread_rwlock_rdlock(&metadata_lock);
+	int err = node_entry(node_get(ino), &dir);
+	if (!err && ps2mcfs_dir_iterator_init(&vmc_metadata, &dir.dirent, offset, &it) != 0)
+		err = -ENOMEM;
+	if (err)
+		goto out;
+
+	dir_entry_t* child;
+	size_t index;
+	while ((child = ps2mcfs_dir_iterator_next(&it, &index)) != NULL) {
+		char name[sizeof(child->name) + 1] = "";
+		memcpy(name, child->name, sizeof(child->name));
+		// the offset of the next entry is where the listing resumes when the buffer is full
+		const off_t next_offset = index + 1;
+		size_t entry_size;
+		if (!plus) {
+			struct stat stbuf = {0};
+			stbuf.st_ino = UNKNOWN_INO;
+			stbuf.st_mode = ps2mcfs_is_directory(child) ? S_IFDIR : S_IFREG;
+			entry_size = fuse_add_direntry(req, buf + used, size - used, name, &stbuf, next_offset);
+		}
+		else if (index < 2) {
+			// the kernel doesn't take a reference to "." and ".."
+			struct fuse_entry_param e = {0};
+			e.attr.st_ino = UNKNOWN_INO;
+			e.attr.st_mode = S_IFDIR;
+			entry_size = fuse_add_direntry_plus(req, buf + used, size - used, name, &e, next_offset);
+		}
+		else {
+			const browse_result_t entry = {.dirent = *child, .parent = dir.dirent, .index = index};
+			struct fuse_entry_param e;
+			if (fill_entry(req, &entry, &e) != 0)
+				break;
+			entry_size = fuse_add_direntry_plus(req, buf + used, size - used, name, &e, next_offset);
+			if (entry_size > size - used) {
+				// the entry didn't fit, so the kernel won't hold the reference
+				pthread_mutex_lock(&nodes.mutex);
+				struct node* node = node_get(e.ino);
+				node->lookups--;
+				node_release(node);
+				pthread_mutex_unlock(&nodes.mutex);
+			}
+		}
+		if (entry_size > size - used)
+			break;
+		used += entry_size;
+	}
+	ps2mcfs_dir_iterator_free(&it);
+out:
+	pthread_rwlock_unlock(&metadata_lock);
+	if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+	do_readdir(req, ino, size, offset, false);
+}
+
+static void ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+	do_readdir(req, ino, size, offset, true);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	struct node* node = node_get(ino);
+	pthread_mutex_lock(&nodes.mutex);
+	node->opens++;
+	pthread_mutex_unlock(&nodes.mutex);
+	// nothing else writes to the card, so the pages cached by the kernel stay valid across opens
+	fi->keep_cache = 1;
+	fuse_reply_open(req, fi);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+	char* buf = malloc(size);
+	if (buf == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	pthread_rwlock_rdlock(&metadata_lock);
+	const dir_entry_t dirent = node_get(ino)->entry.dirent;
+	int read = ps2mcfs_read(&vmc_metadata, &dirent, buf, size, offset);
+	pthread_rwlock_unlock(&metadata_lock);
+	if (read < 0)
+		fuse_reply_err(req, -read);
+	else
+		fuse_reply_buf(req, buf, read);
+	free(buf);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char* data, size_t size, off_t offset, struct fuse_file_info* fi) {
+	struct node* node = node_get(ino);
+	pthread_rwlock_wrlock(&metadata_lock);
+	const uint32_t length = node->entry.dirent.length;
+	const cluster_t cluster = node->entry.dirent.cluster;
+	int written = ps2mcfs_write_data(&vmc_metadata, &node->entry.dirent, &node->tail, (const void*) data, size, offset);
+	// the directory entry is written back on flush, fsync or release
+	if (node->entry.dirent.length != length || node->entry.dirent.cluster != cluster) {
+		pthread_mutex_lock(&nodes.mutex);
+		node->dirty = true;
+		pthread_mutex_unlock(&nodes.mutex);
+	}
+	pthread_rwlock_unlock(&metadata_lock);
+	if (written < 0)
+		fuse_reply_err(req, -written);
+	else
+		fuse_reply_write(req, written);
+}
+
+static void ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info* fi) {
+	if (mode & ~FALLOC_FL_KEEP_SIZE) {
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+	struct node* node = node_get(ino);
+	pthread_rwlock_wrlock(&metadata_lock);
+	int err = -EISDIR;
+	if (!ps2mcfs_is_directory(&node->entry.dirent))
+		err = resize_node(node, ps2mcfs_fallocate(&vmc_metadata, &node->entry.dirent, &node->tail, offset, length, mode & FALLOC_FL_KEEP_SIZE));
+	pthread_rwlock_unlock(&metadata_lock);
+	fuse_reply_err(req, -err);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+	struct statvfs stbuf;
+	pthread_rwlock_rdlock(&metadata_lock);
+	ps2mcfs_statfs(&vmc_metadata, &stbuf);
+	pthread_rwlock_unlock(&metadata_lock);
+	fuse_reply_statfs(req, &stbuf);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	pthread_rwlock_wrlock(&metadata_lock);
+	pthread_mutex_lock(&nodes.mutex);
+	node_commit(node_get(ino));
+	pthread_mutex_unlock(&nodes.mutex);
+	int err = fat_flush(&vmc_metadata) == 0 ? 0 : EIO;
+	pthread_rwlock_unlock(&metadata_lock);
+	fuse_reply_err(req, err);
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi) {
+	pthread_rwlock_wrlock(&metadata_lock);
+	pthread_mutex_lock(&nodes.mutex);
+	node_commit(node_get(ino));
+	pthread_mutex_unlock(&nodes.mutex);
+	fuseps2mc_ll_write_done();
+	int err = fat_flush(&vmc_metadata) == 0 ? 0 : EIO;
+	pthread_rwlock_unlock(&metadata_lock);
+	// the writers are held off while the image is synced, as in the write-back thread
+	pthread_rwlock_rdlock(&metadata_lock);
+	if (!err && mc_image_sync(&vmc_metadata) != 0)
+		err = errno;
+	pthread_rwlock_unlock(&metadata_lock);
+	fuse_reply_err(req, err);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	struct node* node = node_get(ino);
+	pthread_rwlock_wrlock(&metadata_lock);
+	pthread_mutex_lock(&nodes.mutex);
+	node_commit(node);
+	if (--node->opens == 0)
+		node_close(node);
+	node_release(node);
+	pthread_mutex_unlock(&nodes.mutex);
+	pthread_rwlock_unlock(&metadata_lock);
+	fuse_reply_err(req, 0);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, struct fuse_file_info* fi) {
+	browse_result_t dir, result;
+	struct fuse_entry_param e;
+	if (strlen(name) >= sizeof(dir.dirent.name)) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+	mode = ((mode / 64) | (mode / 8) | mode) & 0007;
+	pthread_rwlock_wrlock(&metadata_lock);
+	int err = node_entry(node_get(parent), &dir);
+	if (!err)
+		err = ps2mcfs_create(&vmc_metadata, &dir.dirent, name, CLUSTER_INVALID, mode);
+	if (!err)
+		err = find_entry(&dir.dirent, name, &result, NULL);
+	if (!err)
+		err = fill_entry(req, &result, &e);
+	if (!err) {
+		pthread_mutex_lock(&nodes.mutex);
+		node_get(e.ino)->opens++;
+		pthread_mutex_unlock(&nodes.mutex);
+	}
+	pthread_rwlock_unlock(&metadata_lock);
+	if (err)
+		fuse_reply_err(req, -err);
+	else {
+		fi->keep_cache = 1;
+		fuse_reply_create(req, &e, fi);
+	}
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode) {
+	browse_result_t dir, result;
+	struct fuse_entry_param e;
+	if (strlen(name) >= sizeof(dir.dirent.name)) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+	// use the most permissive combination of umask
+	mode = ((mode / 64) | (mode / 8) | mode) & 0007;
+	pthread_rwlock_wrlock(&metadata_lock);
+	int err = node_entry(node_get(parent), &dir);
+	if (!err)
+		err = ps2mcfs_mkdir(&vmc_metadata, &dir.dirent, name, mode);
+	if (!err)
+		err = find_entry(&dir.dirent, name, &result, NULL);
+	if (!err)
+		err = fill_entry(req, &result, &e);
+	pthread_rwlock_unlock(&metadata_lock);
+	if (err)
+		fuse_reply_err(req, -err);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+/**
+ * Removes the entry called `name` from a directory, which must be a file, or an empty directory if `is_dir` is set
+*/
+static int remove_entry(struct node* parent, const char* name, bool is_dir) {
+	browse_result_t dir, result;
+	int err = node_entry(parent, &dir);
+	if (!err)
+		err = find_entry(&dir.dirent, name, &result, NULL);
+	if (err)
+		return err;
+	if (ps2mcfs_is_directory(&result.dirent) != is_dir)
+		return is_dir ? -ENOTDIR : -EISDIR;
+	if (is_dir && !ps2mcfs_is_empty_dir(&vmc_metadata, &result.dirent))
+		return -ENOTEMPTY;
+	// the clusters of an open file are freed when it is released
+	if (node_forget_location(&result))
+		result.dirent.cluster = CLUSTER_INVALID;
+	if (is_dir)
+		err = ps2mcfs_rmdir(&vmc_metadata, result.dirent, result.parent, result.index);
+	else
+		err = ps2mcfs_unlink(&vmc_metadata, result.dirent, result.parent, result.index);
+	// removing the entry may have compacted the directory, which moves the entries
+	if (node_entry(parent, &dir) == 0)
+		nodes_relocate(&dir.dirent);
+	node_invalidate(parent);
+	return err;
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
+	pthread_rwlock_wrlock(&metadata_lock);
+	int err = remove_entry(node_get(parent), name, false);
+	pthread_rwlock_unlock(&metadata_lock);
+	fuse_reply_err(req, -err);
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name) {
+	pthread_rwlock_wrlock(&metadata_lock);
+	int err = remove_entry(node_get(parent), name, true);
+	pthread_rwlock_unlock(&metadata_lock);
+	fuse_reply_err(req, -err);
+}
+
+/**
+ * Implementation of rename(), with the metadata lock held
+*/
+static int rename_locked(struct node* parent, const char* name, struct node* new_parent, const char* new_name, unsigned int flags) {
+	browse_result_t dir, new_dir, origin, destination;
+	struct node* origin_node;
+	struct node* destination_node;
+	if (strlen(new_name) >= sizeof(dir.dirent.name))
+		return -ENAMETOOLONG;
+	int err = node_entry(parent, &dir);
+	if (!err)
+		err = node_entry(new_parent, &new_dir);
+	if (!err)
+		err = find_entry(&dir.dirent, name, &origin, &origin_node);
+	if (err)
+		return err;
+	int destination_err = find_entry(&new_dir.dirent, new_name, &destination, &destination_node);
+	if (destination_err && destination_err != -ENOENT)
+		return destination_err;
+	if ((flags & RENAME_NOREPLACE) && !destination_err)
+		return -EEXIST;
+	if ((flags & RENAME_EXCHANGE) && destination_err)
+		return -ENOENT;
+	// renaming an entry to itself does nothing
+	if (!destination_err && origin.parent.cluster == destination.parent.cluster && origin.index == destination.index)
+		return 0;
+	// a directory can't be moved inside itself
+	if (ps2mcfs_is_directory(&origin.dirent) && is_inside(new_dir.dirent.cluster, origin.dirent.cluster))
+		return -EINVAL;
+
+	if (flags & RENAME_EXCHANGE) {
+		if (ps2mcfs_is_directory(&destination.dirent) && is_inside(dir.dirent.cluster, destination.dirent.cluster))
+			return -EINVAL;
+		// the pending changes of both files are written by the exchange
+		ps2mcfs_exchange(&vmc_metadata, &origin, &destination);
+		pthread_mutex_lock(&nodes.mutex);
+		if (origin_node)
+			node_move(origin_node, &destination);
+		if (destination_node)
+			node_move(destination_node, &origin);
+		pthread_mutex_unlock(&nodes.mutex);
+		node_invalidate(parent);
+		node_invalidate(new_parent);
+		return 0;
+	}
+
+	if (!destination_err) {
+		// the destination is replaced by the origin
+		if (ps2mcfs_is_directory(&destination.dirent) && !ps2mcfs_is_directory(&origin.dirent))
+			return -EISDIR;
+		if (!ps2mcfs_is_directory(&destination.dirent) && ps2mcfs_is_directory(&origin.dirent))
+			return -ENOTDIR;
+		if ((err = remove_entry(new_parent, new_name, ps2mcfs_is_directory(&destination.dirent))))
+			return err;
+		// the entries may have moved, find them again
+		err = node_entry(parent, &dir);
+		if (!err)
+			err = node_entry(new_parent, &new_dir);
+		if (!err)
+			err = find_entry(&dir.dirent, name, &origin, &origin_node);
+		if (err)
+			return err;
+	}
+
+	browse_result_t moved;
+	err = ps2mcfs_rename(&vmc_metadata, &origin, &new_dir.dirent, new_name, &moved);
+	// the node follows its entry, whose pending changes were written with it
+	if (!err && origin_node) {
+		pthread_mutex_lock(&nodes.mutex);
+		node_move(origin_node, &moved);
+		pthread_mutex_unlock(&nodes.mutex);
+	}
+	node_invalidate(parent);
+	node_invalidate(new_parent);
+	return err;
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t new_parent, const char* new_name, unsigned int flags) {
+	pthread_rwlock_wrlock(&metadata_lock);
+	int err = rename_locked(node_get(parent), name, node_get(new_parent), new_name, flags);
+	pthread_rwlock_unlock(&metadata_lock);
+	fuse_reply_err(req, -err);
+}
+
+static struct fuse_lowlevel_ops ll_operations = {
+	.lookup = ll_lookup,
+	.forget = ll_forget,
+	.forget_multi = ll_forget_multi,
+	.getattr = ll_getattr,
+	.setattr = ll_setattr,
+	.readdir = ll_readdir,
+	.readdirplus = ll_readdirplus,
+	.open = ll_open,
+	.read = ll_read,
+	.write = ll_write,
+	.flush = ll_flush,
+	.fsync = ll_fsync,
+	.release = ll_release,
+	.create = ll_create,
+	.mkdir = ll_mkdir,
+	.unlink = ll_unlink,
+	.rmdir = ll_rmdir,
+	.rename = ll_rename,
+	.fallocate = ll_fallocate,
+	.statfs = ll_statfs,
+};
+
+
+int fuseps2mc_ll_main(struct fuse_args* args, const char* mountpoint, bool foreground, bool singlethread) {
+	int res;
+	struct fuse_session* se = fuse_session_new(args, &ll_operations, sizeof(ll_operations), NULL);
+	if (se == NULL)
+		return 3;
+
+	if (fuse_set_signal_handlers(se) != 0) {
+		res = 6;
+		goto out1;
+	}
+
+	if (fuse_session_mount(se, mountpoint) != 0) {
+		res = 4;
+		goto out2;
+	}
+
+	if (fuse_daemonize(foreground) != 0) {
+		res = 5;
+		goto out3;
+	}
+
+	// the card is loaded after daemonizing, since the ECC scrubber thread wouldn't survive the fork
+	if (fuseps2mc_load() != 0) {
+		res = 7;
+		goto out3;
+	}
+	session = se;
+	root_node = (struct node) {.ino = FUSE_ROOT_ID, .dirty = false, .deleted = false, .tail = FILE_TAIL_INIT, .lookups = 1, .opens = 0};
+	ps2mcfs_browse(&vmc_metadata, NULL, "/", &root_node.entry);
+	node_link(&root_node);
+
+	if (singlethread)
+		res = fuse_session_loop(se);
+	else {
+		struct fuse_loop_config loop_config = {0};
+		loop_config.clone_fd = 0;
+		loop_config.max_idle_threads = 100;
+		#if FUSE_USE_VERSION < 32
+		res = fuse_session_loop_mt(se, loop_config.clone_fd);
+		#else
+		res = fuse_session_loop_mt(se, &loop_config);
+		#endif
+	}
+	if (res)
+		res = 8;
+
+	session = NULL;
+	nodes_free();
+	fuseps2mc_unload();
+out3:
+	fuse_session_unmount(se);
+out2:
+	fuse_remove_signal_handlers(se);
+out1:
+	fuse_session_destroy(se);
+	return res;
+}
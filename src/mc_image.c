@@ -0,0 +1,208 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mc_image.h"
+#include "vmc_types.h"
+
+// granularity of the dirty block tracking of write-back images, the size of a memory page on most hosts
+#define MC_IMAGE_BLOCK_SIZE 4096
+#define BITS_PER_WORD (sizeof(unsigned long) * CHAR_BIT)
+
+
+int mc_image_open(struct vmc_meta* vmc_meta, const char* path, enum mc_image_mode mode) {
+	// a private mapping is never written back, so the file itself may be read-only
+	int fd = open(path, mode == MC_IMAGE_PRIVATE ? O_RDONLY : O_RDWR);
+	if (fd == -1)
+		return -1;
+	int err = mc_image_open_fd(vmc_meta, fd, mode);
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return err;
+}
+
+int mc_image_open_fd(struct vmc_meta* vmc_meta, int fd, enum mc_image_mode mode) {
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+		return -1;
+	if (st.st_size == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	// a write-back image is mapped copy-on-write, and writes its changes to the file itself
+	int flags = mode == MC_IMAGE_SHARED ? MAP_SHARED : MAP_PRIVATE;
+	void* data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+	if (data == MAP_FAILED)
+		return -1;
+	unsigned long* dirty_blocks = NULL;
+	unsigned long* metadata_blocks = NULL;
+	if (mode == MC_IMAGE_WRITEBACK) {
+		const size_t block_count = (st.st_size + MC_IMAGE_BLOCK_SIZE - 1) / MC_IMAGE_BLOCK_SIZE;
+		dirty_blocks = calloc((block_count + BITS_PER_WORD - 1) / BITS_PER_WORD, sizeof(unsigned long));
+		metadata_blocks = calloc((block_count + BITS_PER_WORD - 1) / BITS_PER_WORD, sizeof(unsigned long));
+		if (dirty_blocks == NULL || metadata_blocks == NULL) {
+			munmap(data, st.st_size);
+			free(dirty_blocks);
+			free(metadata_blocks);
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	vmc_meta->fd = dup(fd);
+	if (vmc_meta->fd == -1) {
+		munmap(data, st.st_size);
+		free(dirty_blocks);
+		free(metadata_blocks);
+		return -1;
+	}
+	vmc_meta->dirty_blocks = dirty_blocks;
+	vmc_meta->metadata_blocks = metadata_blocks;
+	vmc_meta->raw_data = data;
+	vmc_meta->raw_size = st.st_size;
+	vmc_meta->image_mode = mode;
+	return 0;
+}
+
+/**
+ * Sets the bits of the blocks that hold the `size` bytes at `offset`
+*/
+static void set_blocks(unsigned long* blocks, physical_offset_t offset, size_t size) {
+	const size_t last = (offset + size - 1) / MC_IMAGE_BLOCK_SIZE;
+	for (size_t block = offset / MC_IMAGE_BLOCK_SIZE; block <= last; ++block)
+		__atomic_fetch_or(&blocks[block / BITS_PER_WORD], 1UL << (block % BITS_PER_WORD), __ATOMIC_RELEASE);
+}
+
+void mc_image_mark_dirty(const struct vmc_meta* vmc_meta, physical_offset_t offset, size_t size) {
+	if (vmc_meta->dirty_blocks == NULL || size == 0)
+		return;
+	set_blocks(vmc_meta->dirty_blocks, offset, size);
+}
+
+void mc_image_mark_metadata(const struct vmc_meta* vmc_meta, physical_offset_t offset, size_t size) {
+	if (vmc_meta->dirty_blocks == NULL || size == 0)
+		return;
+	// the block is dirty before it is metadata, write_back() takes the metadata bits first
+	set_blocks(vmc_meta->dirty_blocks, offset, size);
+	set_blocks(vmc_meta->metadata_blocks, offset, size);
+}
+
+/**
+ * Writes the blocks of a write-back image from `first` to `last` (both included) to the image file
+*/
+static int write_blocks(const struct vmc_meta* vmc_meta, size_t first, size_t last) {
+	const size_t start = first * MC_IMAGE_BLOCK_SIZE;
+	const size_t end = (last + 1) * MC_IMAGE_BLOCK_SIZE < vmc_meta->raw_size ? (last + 1) * MC_IMAGE_BLOCK_SIZE : vmc_meta->raw_size;
+	for (size_t written = start; written < end;) {
+		ssize_t res = pwrite(vmc_meta->fd, vmc_meta->raw_data + written, end - written, written);
+		if (res == -1 && errno == EINTR)
+			continue;
+		if (res == -1)
+			return -1;
+		written += res;
+	}
+	return 0;
+}
+
+static inline bool block_is_set(const unsigned long* blocks, size_t block) {
+	return blocks[block / BITS_PER_WORD] & (1UL << (block % BITS_PER_WORD));
+}
+
+/**
+ * Writes the blocks of a write-back image whose bits are set in `blocks` to the image file,
+ * merging adjacent blocks into a single write
+*/
+static int write_block_set(const struct vmc_meta* vmc_meta, const unsigned long* blocks, size_t block_count) {
+	size_t block = 0;
+	while (block < block_count) {
+		if (!block_is_set(blocks, block)) {
+			++block;
+			continue;
+		}
+		size_t last = block;
+		while (last + 1 < block_count && block_is_set(blocks, last + 1))
+			++last;
+		if (write_blocks(vmc_meta, block, last) != 0)
+			return -1;
+		block = last + 1;
+	}
+	return 0;
+}
+
+/**
+ * Writes the dirty blocks of a write-back image to the image file. The blocks that hold file data are written
+ * and synced first, then the blocks that hold the FAT and the directory entries, so that a crash in between
+ * leaves metadata that still describes the old data.
+ * The blocks are taken from the dirty set before being written, so the blocks changed meanwhile are written next time
+*/
+static int write_back(const struct vmc_meta* vmc_meta) {
+	const size_t block_count = (vmc_meta->raw_size + MC_IMAGE_BLOCK_SIZE - 1) / MC_IMAGE_BLOCK_SIZE;
+	const size_t word_count = (block_count + BITS_PER_WORD - 1) / BITS_PER_WORD;
+	unsigned long* data = malloc(2 * word_count * sizeof(unsigned long));
+	if (data == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	unsigned long* metadata = data + word_count;
+	bool has_data = false, has_metadata = false;
+	for (size_t w = 0; w < word_count; ++w) {
+		metadata[w] = __atomic_exchange_n(&vmc_meta->metadata_blocks[w], 0, __ATOMIC_ACQUIRE);
+		data[w] = __atomic_exchange_n(&vmc_meta->dirty_blocks[w], 0, __ATOMIC_ACQUIRE);
+		metadata[w] &= data[w];
+		data[w] &= ~metadata[w];
+		has_data |= data[w] != 0;
+		has_metadata |= metadata[w] != 0;
+	}
+
+	int err = write_block_set(vmc_meta, data, block_count);
+	if (!err && has_data && has_metadata)
+		err = fdatasync(vmc_meta->fd);
+	if (!err)
+		err = write_block_set(vmc_meta, metadata, block_count);
+	if (err) {
+		// the blocks stay dirty, to be retried on the next sync. Writing again the ones that made it is harmless
+		int saved_errno = errno;
+		for (size_t block = 0; block < block_count; ++block) {
+			if (block_is_set(data, block))
+				mc_image_mark_dirty(vmc_meta, block * MC_IMAGE_BLOCK_SIZE, 1);
+			if (block_is_set(metadata, block))
+				mc_image_mark_metadata(vmc_meta, block * MC_IMAGE_BLOCK_SIZE, 1);
+		}
+		errno = saved_errno;
+	}
+	free(data);
+	return err;
+}
+
+int mc_image_sync(const struct vmc_meta* vmc_meta) {
+	if (vmc_meta->raw_data == NULL)
+		return 0;
+	if (vmc_meta->image_mode == MC_IMAGE_SHARED)
+		return msync(vmc_meta->raw_data, vmc_meta->raw_size, MS_SYNC);
+	if (vmc_meta->image_mode == MC_IMAGE_WRITEBACK) {
+		if (write_back(vmc_meta) != 0)
+			return -1;
+		return fdatasync(vmc_meta->fd);
+	}
+	return 0;
+}
+
+void mc_image_close(struct vmc_meta* vmc_meta) {
+	if (vmc_meta->raw_data != NULL)
+		munmap(vmc_meta->raw_data, vmc_meta->raw_size);
+	if (vmc_meta->fd != -1)
+		close(vmc_meta->fd);
+	free(vmc_meta->dirty_blocks);
+	free(vmc_meta->metadata_blocks);
+	vmc_meta->dirty_blocks = NULL;
+	vmc_meta->metadata_blocks = NULL;
+	vmc_meta->raw_data = NULL;
+	vmc_meta->raw_size = 0;
+	vmc_meta->fd = -1;
+}
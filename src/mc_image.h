@@ -0,0 +1,42 @@
+#ifndef __MC_IMAGE_H__
+#define __MC_IMAGE_H__
+
+#include "vmc_types.h"
+
+
+/**
+ * Maps the memory card image file at `path` into memory and fills in the image fields of `vmc_meta`.
+ * Returns 0 on success or -1 on error (with errno set)
+*/
+int mc_image_open(struct vmc_meta* vmc_meta, const char* path, enum mc_image_mode mode);
+
+/**
+ * Same as mc_image_open() for an already open file. The file descriptor is duplicated, so the caller keeps ownership of `fd`
+*/
+int mc_image_open_fd(struct vmc_meta* vmc_meta, int fd, enum mc_image_mode mode);
+
+/**
+ * Records that `size` bytes at `offset` were changed in the mapped image, so that a write-back image writes them
+ * to the image file on the next mc_image_sync(). Does nothing for the other modes. Safe to call from several threads
+*/
+void mc_image_mark_dirty(const struct vmc_meta* vmc_meta, physical_offset_t offset, size_t size);
+
+/**
+ * Same as mc_image_mark_dirty(), for changes to the FAT or to directory entries. mc_image_sync() writes these blocks
+ * only once the other dirty blocks reached the image file, so that the metadata never points to data that isn't there
+*/
+void mc_image_mark_metadata(const struct vmc_meta* vmc_meta, physical_offset_t offset, size_t size);
+
+/**
+ * Makes sure the changes done to a shared image reached the image file. A write-back image writes the blocks
+ * marked as dirty to the image file first, the metadata blocks last
+ * Returns 0 on success or -1 on error (with errno set)
+*/
+int mc_image_sync(const struct vmc_meta* vmc_meta);
+
+/**
+ * Unmaps the image and closes its file
+*/
+void mc_image_close(struct vmc_meta* vmc_meta);
+
+#endif
@@ -1,3 +1,4 @@
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -8,13 +9,87 @@
 #include "ecc.h"
 #include "utils.h"
 
+// pages are assembled in a buffer of this many erase blocks, which is written with a single fwrite
+#define MC_WRITER_BUFFER_BLOCKS 64
+
+
+/**
+ * Output of whole pages, buffered so that the image is written in large chunks
+ */
+struct page_writer {
+    FILE* output_file;
+    bool use_ecc;
+    size_t data_size;     // bytes of data in a page
+    size_t page_size;     // bytes of data plus the spare area
+    uint8_t* buffer;
+    size_t capacity;      // pages that fit in `buffer`
+    size_t buffered;      // pages in `buffer` that weren't written yet
+    size_t pages_written; // pages written so far, including the buffered ones
+    bool failed;
+};
+
+static void page_writer_flush(struct page_writer* writer) {
+    if (writer->buffered && fwrite(writer->buffer, writer->page_size, writer->buffered, writer->output_file) != writer->buffered)
+        writer->failed = true;
+    writer->buffered = 0;
+}
+
+/**
+ * Returns the next page of the output, filled with 0xFF
+ */
+static uint8_t* page_writer_start_page(struct page_writer* writer) {
+    if (writer->buffered == writer->capacity)
+        page_writer_flush(writer);
+    uint8_t* page = writer->buffer + writer->buffered * writer->page_size;
+    writer->buffered++;
+    writer->pages_written++;
+    memset(page, 0xFF, writer->page_size);
+    return page;
+}
+
+/**
+ * Adds the ECC bytes to a page returned by page_writer_start_page(), once its data was written
+ */
+static void page_writer_end_page(const struct page_writer* writer, uint8_t* page) {
+    if (!writer->use_ecc)
+        return;
+    memset(page + writer->data_size, 0, PAGE_SPARE_PART_SIZE);
+    ecc512_calculate(page + writer->data_size, page);
+}
+
+/**
+ * Writes `count` copies of a page
+ */
+static void page_writer_repeat(struct page_writer* writer, const uint8_t* page, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+        memcpy(page_writer_start_page(writer), page, writer->page_size);
+}
 
 int mc_writer_write_empty(const superblock_t* superblock, FILE* output_file) {
-    size_t physical_page_size = superblock->page_size;
-    if (superblock->card_flags & CF_USE_ECC) {
-        physical_page_size += PAGE_SPARE_PART_SIZE; // account byte spare area
+    struct page_writer writer = {
+        .output_file = output_file,
+        .use_ecc = superblock->card_flags & CF_USE_ECC,
+        .data_size = superblock->page_size,
+        .page_size = superblock->page_size,
+        .capacity = MC_WRITER_BUFFER_BLOCKS * superblock->pages_per_block,
+    };
+    if (writer.use_ecc) {
+        writer.page_size += PAGE_SPARE_PART_SIZE; // account byte spare area
     }
-    uint8_t* page_buffer = malloc(physical_page_size);
+    writer.buffer = malloc(writer.capacity * writer.page_size);
+    // the two kinds of empty pages are the same everywhere, their ECC is only calculated once
+    uint8_t* erased_page = malloc(writer.page_size);     // all 0xFF, spare area included
+    uint8_t* erased_ecc_page = malloc(writer.page_size); // all 0xFF, with the ECC of that data
+    if (!writer.buffer || !erased_page || !erased_ecc_page) {
+        free(writer.buffer);
+        free(erased_page);
+        free(erased_ecc_page);
+        return -1;
+    }
+    memset(erased_page, 0xFF, writer.page_size);
+    memset(erased_ecc_page, 0xFF, writer.page_size);
+    page_writer_end_page(&writer, erased_ecc_page);
+
     const time_t the_time = time(NULL);
     date_time_t datetime;
     ps2mcfs_time_to_date_time(the_time, &datetime);
@@ -55,104 +130,85 @@ int mc_writer_write_empty(const superblock_t* superblock, FILE* output_file) {
     #define DEBUG_LOG(fmt, ...) \
         DEBUG_printf( \
             "[off: 0x%06lx   clus: %4lu   block: %4lu] " fmt "\n", \
-            ftell(output_file), \
-            ftell(output_file) / physical_page_size / superblock->pages_per_cluster, \
-            ftell(output_file) / physical_page_size / superblock->pages_per_block __VA_OPT__(,) \
+            writer.pages_written * writer.page_size, \
+            writer.pages_written / superblock->pages_per_cluster, \
+            writer.pages_written / superblock->pages_per_block __VA_OPT__(,) \
             __VA_ARGS__ \
         )
 
-    #define WRITE_ECC() if (superblock->card_flags & CF_USE_ECC) { \
-        memset(page_buffer + superblock->page_size, 0, PAGE_SPARE_PART_SIZE); \
-        ecc512_calculate(page_buffer + superblock->page_size, page_buffer); \
-    }
-
+    uint8_t* page;
     DEBUG_LOG("Writing superblock");
-    memset(page_buffer, 0xFF, physical_page_size);
-    memcpy(page_buffer, superblock, sizeof(superblock_t));
-    WRITE_ECC();
-    fwrite(page_buffer, physical_page_size, 1, output_file);
+    page = page_writer_start_page(&writer);
+    memcpy(page, superblock, sizeof(superblock_t));
+    page_writer_end_page(&writer, page);
 
     // fill the rest of the pages of the block with 0xFF plus ECC data
-    memset(page_buffer, 0xFF, physical_page_size);
-    WRITE_ECC();
-    for (int i = 0; i < superblock->pages_per_block - 1; i++)
-        fwrite(page_buffer, physical_page_size, 1, output_file);
+    page_writer_repeat(&writer, erased_ecc_page, superblock->pages_per_block - 1);
 
     DEBUG_printf("Max indirect FAT table entries: %d\n", max_indirect_fat_entries);
     while (indirect_fat_entries_written < max_indirect_fat_entries) {
         DEBUG_LOG("Writing indirect FAT table clusters (%u / %u)", indirect_fat_entries_written + 1, max_indirect_fat_entries);
-        memset(page_buffer, 0xFF, physical_page_size);
+        page = page_writer_start_page(&writer);
         for (int i = 0; i < superblock->page_size / sizeof(uint32_t) && indirect_fat_entries_written < max_indirect_fat_entries; ++i, ++indirect_fat_entries_written) {
             // add an offset corresponding to 1 block (the superblock)
             uint32_t fat_cluster = clusters_per_block + max_indirect_fat_clusters + indirect_fat_entries_written;
-            memcpy(page_buffer + i * sizeof(fat_cluster), &fat_cluster, sizeof(fat_cluster));
+            memcpy(page + i * sizeof(fat_cluster), &fat_cluster, sizeof(fat_cluster));
         }
-        WRITE_ECC();
-        fwrite(page_buffer, physical_page_size, 1, output_file);
-    }
-    while (ftell(output_file) / physical_page_size / superblock->pages_per_cluster < clusters_per_block + max_indirect_fat_clusters) {
-        memset(page_buffer, 0xFF, physical_page_size);
-        WRITE_ECC();
-        fwrite(page_buffer, physical_page_size, 1, output_file);
+        page_writer_end_page(&writer, page);
     }
+    const size_t fat_start_page = (clusters_per_block + max_indirect_fat_clusters) * superblock->pages_per_cluster;
+    if (writer.pages_written < fat_start_page)
+        page_writer_repeat(&writer, erased_ecc_page, fat_start_page - writer.pages_written);
 
     while (fat_entries_written < max_fat_entries) {
         DEBUG_LOG("Writing FAT table (%u / %u)", fat_entries_written + 1, max_fat_entries);
-        memset(page_buffer, 0xFF, physical_page_size);
+        page = page_writer_start_page(&writer);
         for (int i = 0; i < superblock->page_size / sizeof(union fat_entry) && fat_entries_written < max_fat_entries; ++i, ++fat_entries_written) {
             union fat_entry entry = {.entry = {.occupied = 0, .next_cluster = CLUSTER_INVALID}};
             if (fat_entries_written == 0) {
                 entry.entry.occupied = 1;
             }
-            memcpy(page_buffer + i * sizeof(union fat_entry), &entry, sizeof(union fat_entry));
+            memcpy(page + i * sizeof(union fat_entry), &entry, sizeof(union fat_entry));
         }
-        WRITE_ECC();
-        fwrite(page_buffer, physical_page_size, 1, output_file);
+        page_writer_end_page(&writer, page);
     }
 
     while (root_directory_entries_written < ROOT_DIR_ENTRIES[0].length) {
         DEBUG_LOG("Writing root dir entry (%u / %u)", root_directory_entries_written + 1, ROOT_DIR_ENTRIES[0].length);
         unsigned copy_count = MIN(dirents_per_page, ROOT_DIR_ENTRIES[0].length - root_directory_entries_written);
-        memset(page_buffer, 0xFF, physical_page_size);
-        memcpy(page_buffer, &ROOT_DIR_ENTRIES[root_directory_entries_written], sizeof(dir_entry_t) * copy_count);
-        WRITE_ECC();
-        fwrite(page_buffer, physical_page_size, 1, output_file);
+        page = page_writer_start_page(&writer);
+        memcpy(page, &ROOT_DIR_ENTRIES[root_directory_entries_written], sizeof(dir_entry_t) * copy_count);
+        page_writer_end_page(&writer, page);
         root_directory_entries_written += copy_count;
         allocatable_pages_written += 1;
     }
 
     // write pages containing ECC data for the rest of the erase-block
     DEBUG_LOG("Writing padding data with ECC for erase block");
-    memset(page_buffer, 0xFF, physical_page_size);
-    WRITE_ECC();
-    while (ftell(output_file) % (superblock->pages_per_block * physical_page_size) != 0) {
-        fwrite(page_buffer, physical_page_size, 1, output_file);
-        ++allocatable_pages_written;
-    }
+    const size_t block_padding = (superblock->pages_per_block - writer.pages_written % superblock->pages_per_block) % superblock->pages_per_block;
+    page_writer_repeat(&writer, erased_ecc_page, block_padding);
+    allocatable_pages_written += block_padding;
 
     DEBUG_LOG("Writing cleared allocatable clusters");
-    memset(page_buffer, 0xFF, physical_page_size);
-    for (; allocatable_pages_written < superblock->last_allocatable * superblock->pages_per_cluster; allocatable_pages_written++)
-        fwrite(page_buffer, physical_page_size, 1, output_file);
+    const size_t allocatable_pages = superblock->last_allocatable * superblock->pages_per_cluster;
+    if (allocatable_pages_written < allocatable_pages)
+        page_writer_repeat(&writer, erased_page, allocatable_pages - allocatable_pages_written);
 
     DEBUG_LOG("Writing erase block2");
-    memset(page_buffer, 0xFF, physical_page_size);
-    for (int i = 0; i < superblock->pages_per_block; i++)
-        fwrite(page_buffer, physical_page_size, 1, output_file);
+    page_writer_repeat(&writer, erased_page, superblock->pages_per_block);
 
     DEBUG_LOG("Writing erase block1");
-    for (int i = 0; i < superblock->pages_per_block; i++) {
-        memset(page_buffer, 0xFF, physical_page_size);
-        // erase block1 contains a copy of the superblock
-        if (i == 0)
-            memcpy(page_buffer, superblock, sizeof(superblock_t));
-        WRITE_ECC();
-        fwrite(page_buffer, physical_page_size, 1, output_file);
-    }
-
-    free(page_buffer);
-    return 0;
+    // erase block1 contains a copy of the superblock
+    page = page_writer_start_page(&writer);
+    memcpy(page, superblock, sizeof(superblock_t));
+    page_writer_end_page(&writer, page);
+    page_writer_repeat(&writer, erased_ecc_page, superblock->pages_per_block - 1);
+
+    page_writer_flush(&writer);
+    free(writer.buffer);
+    free(erased_page);
+    free(erased_ecc_page);
+    return writer.failed ? -1 : 0;
 
     #undef DEBUG_LOG
-    #undef WRITE_ECC
 }
@@ -7,7 +7,7 @@
 
 static const unsigned PAGE_SPARE_PART_SIZE = 16;
 
-/**Writes an empty memory card file with the geometry described by the given superblock*/
+/**Writes an empty memory card file with the geometry described by the given superblock. Returns 0 on success or -1 on error*/
 int mc_writer_write_empty(const superblock_t* superblock, FILE* output_file);
 
 #endif
\ No newline at end of file
@@ -92,9 +92,10 @@ int main(int argc, char** argv) {
         exit(EXIT_FAILURE);
     }
 
-    mc_writer_write_empty(&superblock, output_file);
-    
-    fclose(output_file);
+    if (mc_writer_write_empty(&superblock, output_file) != 0 || fclose(output_file) != 0) {
+        fprintf(stderr, "Could not write file: %s\n", option_output_filename);
+        exit(EXIT_FAILURE);
+    }
     if (option_output_filename)
         free(option_output_filename);
 
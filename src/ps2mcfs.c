@@ -10,6 +10,8 @@
 
 #include "vmc_types.h"
 #include "fat.h"
+#include "dentry_cache.h"
+#include "dir_index.h"
 #include "ps2mcfs.h"
 #include "utils.h"
 
@@ -41,19 +43,17 @@ time_t date_time_to_timestamp(const date_time_t* const dt) {
 }
 
 int ps2mcfs_get_superblock(struct vmc_meta* metadata_out) {
-	if (metadata_out->file == NULL) {
+	if (metadata_out->raw_data == NULL) {
 		return -1;
 	}
-	fseek(metadata_out->file, 0, SEEK_END);
-	size_t size = ftell(metadata_out->file);
+	size_t size = metadata_out->raw_size;
 
 	if (size < sizeof(superblock_t)) {
 		// data is too small to contain a superblock
 		fprintf(stderr, "Memory card file is to small to contain a superblock. Size: %lu. Minimum: %lu \n", size, sizeof(superblock_t));
 		return -1;
 	}
-	fseek(metadata_out->file, 0, SEEK_SET);
-	fread(&metadata_out->superblock, sizeof(superblock_t), 1, metadata_out->file);
+	memcpy(&metadata_out->superblock, metadata_out->raw_data, sizeof(superblock_t));
 
 	if (strncmp(metadata_out->superblock.magic, DEFAULT_SUPERBLOCK.magic, sizeof(DEFAULT_SUPERBLOCK.magic)) != 0) {
 		fprintf(
@@ -96,7 +96,6 @@ int ps2mcfs_get_superblock(struct vmc_meta* metadata_out) {
 		printf("Unknown card type: %d. (expected 2)\n", metadata_out->superblock.type);
 		return -1;
 	}
-	//metadata_out->file = file;
 	printf("Mounted card flags: %x\n", metadata_out->superblock.card_flags);
 	return 0;
 }
@@ -110,39 +109,117 @@ int ps2mcfs_get_child(const struct vmc_meta* vmc_meta, cluster_t clus0, unsigned
 
 int ps2mcfs_set_child(const struct vmc_meta* vmc_meta, cluster_t clus0, unsigned int entrynum, dir_entry_t* src) {
 	DEBUG_printf("Updating directory entry at index %u starting from cluster %u to: \"%s\" (cluster: %u, size: %u)\n", entrynum, clus0, src->name, src->cluster, src->length);
-	size_t sz = fat_write_bytes(vmc_meta, clus0, entrynum * sizeof(dir_entry_t), sizeof(dir_entry_t), src);
+	size_t sz = fat_write_dir_bytes(vmc_meta, clus0, entrynum * sizeof(dir_entry_t), sizeof(dir_entry_t), src);
+	// forget both the entry that was overwritten and older copies of the new one
+	dentry_cache_invalidate_entry(vmc_meta, clus0, entrynum, src->name);
+	dir_index_set(vmc_meta, clus0, entrynum, src);
 	if(sz != sizeof(dir_entry_t))
 		return -ENOENT;
 	return 0;
 }
 
-void ps2mcfs_ls(const struct vmc_meta* vmc_meta, dir_entry_t* parent, int(* cb)(dir_entry_t* child, void* extra), void* extra) {
-	size_t dirents_per_cluster = fat_cluster_capacity(vmc_meta) / sizeof(dir_entry_t);
-	cluster_t clus = parent->cluster;
-	for (int i = 0; i < parent->length; ++i) {
-		if (i % dirents_per_cluster == 0 && i != 0) {
-			if ((clus = fat_seek(vmc_meta, clus, 1)) == CLUSTER_INVALID)
+int ps2mcfs_dir_iterator_init(const struct vmc_meta* vmc_meta, const dir_entry_t* dir, size_t offset, dir_iterator_t* it) {
+	it->vmc_meta = vmc_meta;
+	it->dir_cluster = dir->cluster;
+	it->length = dir->length;
+	it->index = offset;
+	it->buffer_start = 0;
+	it->buffer_count = 0;
+	it->buffer = malloc(fat_cluster_capacity(vmc_meta));
+	return it->buffer ? 0 : -ENOMEM;
+}
+
+dir_entry_t* ps2mcfs_dir_iterator_next(dir_iterator_t* it, size_t* index) {
+	const size_t dirents_per_cluster = fat_cluster_capacity(it->vmc_meta) / sizeof(dir_entry_t);
+	while (it->index < it->length) {
+		if (it->index < it->buffer_start || it->index >= it->buffer_start + it->buffer_count) {
+			// read the whole cluster that holds the next entry
+			const size_t first = it->index - it->index % dirents_per_cluster;
+			const size_t count = MIN(dirents_per_cluster, it->length - first);
+			if (fat_read_bytes(it->vmc_meta, it->dir_cluster, first * sizeof(dir_entry_t), count * sizeof(dir_entry_t), it->buffer) != count * sizeof(dir_entry_t)) {
+				it->length = it->index;
 				break;
+			}
+			it->buffer_start = first;
+			it->buffer_count = count;
 		}
-		dir_entry_t child;
-		ps2mcfs_get_child(vmc_meta, clus, i % dirents_per_cluster, &child);
+		dir_entry_t* child = &it->buffer[it->index - it->buffer_start];
+		if (index)
+			*index = it->index;
+		it->index++;
+		if (child->mode & DF_EXISTS)
+			return child;
+		DEBUG_printf("Skipping deleted directory entry \"%s\" (mode: %u, cluster: %u)\n", child->name, child->mode, child->cluster);
+	}
+	return NULL;
+}
 
-		if (child.mode & DF_EXISTS) {
-			if (cb(&child, extra) != 0)
-				break;
+void ps2mcfs_dir_iterator_free(dir_iterator_t* it) {
+	free(it->buffer);
+	it->buffer = NULL;
+}
+
+bool ps2mcfs_is_empty_dir(const struct vmc_meta* vmc_meta, const dir_entry_t* dir) {
+	dir_iterator_t it;
+	if (ps2mcfs_dir_iterator_init(vmc_meta, dir, 2, &it) != 0)
+		return false;
+	const bool empty = ps2mcfs_dir_iterator_next(&it, NULL) == NULL;
+	ps2mcfs_dir_iterator_free(&it);
+	return empty;
+}
+
+void ps2mcfs_ls(const struct vmc_meta* vmc_meta, dir_entry_t* parent, int(* cb)(dir_entry_t* child, void* extra), void* extra) {
+	dir_iterator_t it;
+	if (ps2mcfs_dir_iterator_init(vmc_meta, parent, 0, &it) != 0)
+		return;
+	dir_entry_t* child;
+	while ((child = ps2mcfs_dir_iterator_next(&it, NULL)) != NULL) {
+		if (cb(child, extra) != 0)
+			break;
+	}
+	ps2mcfs_dir_iterator_free(&it);
+}
+
+/**
+ * Finds the child of `parent` named after the first `name_len` characters of `name`,
+ * from the lookup cache, the name index of the directory or, if neither is available, by scanning the directory
+ */
+static int ps2mcfs_find_child(const struct vmc_meta* vmc_meta, const dir_entry_t* parent, const char* name, size_t name_len, dir_entry_t* dirent, size_t* index) {
+	if (dentry_cache_lookup(vmc_meta, parent->cluster, name, name_len, dirent, index) && *index < parent->length)
+		return 0;
+
+	int err = dir_index_find(vmc_meta, parent, name, name_len, index);
+	if (err == -ENOENT)
+		return err;
+	if (err == 0) {
+		ps2mcfs_get_child(vmc_meta, parent->cluster, *index, dirent);
+		if (!(dirent->mode & DF_EXISTS) || strncmp(dirent->name, name, name_len) != 0 || dirent->name[name_len] != '\0') {
+			// the index is out of date, drop it and fall back to a scan
+			dir_index_forget(vmc_meta, parent->cluster);
+			err = -ENOSYS;
 		}
-		else {
-			DEBUG_printf("Skipping deleted directory entry \"%s/%s\" (mode: %u, cluster: %u)\n", parent->name, child.name, child.mode, child.cluster);
+	}
+	if (err != 0) {
+		const size_t dirents_per_cluster = fat_cluster_capacity(vmc_meta) / sizeof(dir_entry_t);
+		cluster_t clus = parent->cluster;
+		for (*index = 0; *index < parent->length; ++*index) {
+			if (*index % dirents_per_cluster == 0 && *index != 0)
+				clus = fat_seek(vmc_meta, clus, 1);
+			ps2mcfs_get_child(vmc_meta, clus, *index % dirents_per_cluster, dirent);
+			if ((dirent->mode & DF_EXISTS) && strncmp(dirent->name, name, name_len) == 0 && dirent->name[name_len] == '\0')
+				break;
 		}
+		if (*index == parent->length)
+			return -ENOENT;
 	}
+	dentry_cache_insert(vmc_meta, parent->cluster, *index, name, name_len, dirent);
+	return 0;
 }
 
 /**
  * Fetch the dirent that corresponds to 'path' the dirent, parent and offset is returned in the dest pointer
  */
 int ps2mcfs_browse(const struct vmc_meta* vmc_meta, dir_entry_t* root, const char* path, browse_result_t* dest) {
-	const size_t dirents_per_cluster = fat_cluster_capacity(vmc_meta) / sizeof(dir_entry_t);
-
 	const char* slash = strchr(path, '/');
 	bool is_basename = false;
 	if (!slash) { // slash not found, we're at the base file name
@@ -153,11 +230,11 @@ int ps2mcfs_browse(const struct vmc_meta* vmc_meta, dir_entry_t* root, const cha
 	if (root) {
 		dirent = *root;
 	}
-	else {
+	else if (!dentry_cache_lookup(vmc_meta, vmc_meta->superblock.root_cluster, ".", 1, &dirent, NULL)) {
 		ps2mcfs_get_child(vmc_meta, vmc_meta->superblock.root_cluster, 0, &dirent);
+		dentry_cache_insert(vmc_meta, vmc_meta->superblock.root_cluster, 0, ".", 1, &dirent);
 	}
 
-	cluster_t clus = dirent.cluster;
 	size_t dirent_index = 0;
 
 	if (slash != path) {
@@ -171,15 +248,9 @@ int ps2mcfs_browse(const struct vmc_meta* vmc_meta, dir_entry_t* root, const cha
 			ps2mcfs_get_child(vmc_meta, dirent.cluster, dirent.dir_entry, &dirent); // get parent entry from grandparent
 		}
 		else if (strcmp(path, ".") != 0) {
-			for (dirent_index = 0; dirent_index < root->length; dirent_index++) {
-				if (dirent_index % dirents_per_cluster == 0 && dirent_index != 0)
-					clus = fat_seek(vmc_meta, clus, 1);
-				ps2mcfs_get_child(vmc_meta, clus, dirent_index % dirents_per_cluster, &dirent);
-				if ((dirent.mode & DF_EXISTS) && strncmp(dirent.name, path, slash-path) == 0)
-					break;
-			}
-			if (dirent_index == root->length)
-				return -ENOENT;
+			int err = ps2mcfs_find_child(vmc_meta, root, path, slash-path, &dirent, &dirent_index);
+			if (err)
+				return err;
 		}
 	}
 	if (is_basename) {
@@ -208,6 +279,16 @@ void ps2mcfs_stat(const dir_entry_t* const dirent, struct stat* stbuf) {
 	stbuf->st_mode += (dirent->mode & 7) * 0111;
 }
 
+void ps2mcfs_statfs(const struct vmc_meta* vmc_meta, struct statvfs* stbuf) {
+	memset(stbuf, 0, sizeof(struct statvfs));
+	stbuf->f_bsize = fat_cluster_capacity(vmc_meta);
+	stbuf->f_frsize = fat_cluster_capacity(vmc_meta);
+	stbuf->f_blocks = vmc_meta->superblock.last_allocatable;
+	stbuf->f_bfree = fat_free_cluster_count(vmc_meta);
+	stbuf->f_bavail = stbuf->f_bfree;
+	stbuf->f_namemax = sizeof(((dir_entry_t*) NULL)->name) - 1;
+}
+
 int ps2mcfs_read(const struct vmc_meta* vmc_meta, const dir_entry_t* dirent, void* buf, size_t size, off_t offset)  {
 	if (offset > dirent->length)
 		return 0;
@@ -216,8 +297,38 @@ int ps2mcfs_read(const struct vmc_meta* vmc_meta, const dir_entry_t* dirent, voi
 	return fat_read_bytes(vmc_meta, dirent->cluster, offset, size, buf);
 }
 
-int ps2mcfs_add_child(const struct vmc_meta* vmc_meta, dir_entry_t* parent, dir_entry_t* new_child) {
+/**
+ * Finds the first deleted entry of `parent`, from its name index or by scanning it
+*/
+static int ps2mcfs_find_free_slot(const struct vmc_meta* vmc_meta, const dir_entry_t* parent, size_t* index) {
+	int err = dir_index_find_free(vmc_meta, parent, index);
+	if (err != -ENOSYS)
+		return err;
+	dir_iterator_t it;
+	if (ps2mcfs_dir_iterator_init(vmc_meta, parent, 2, &it) != 0)
+		return -ENOMEM;
+	// the iterator skips deleted entries, so they show up as gaps between the indexes it returns
+	size_t expected = 2, i;
+	while (ps2mcfs_dir_iterator_next(&it, &i) != NULL && i == expected)
+		++expected;
+	ps2mcfs_dir_iterator_free(&it);
+	if (expected >= parent->length)
+		return -ENOENT;
+	*index = expected;
+	return 0;
+}
+
+/**
+ * Stores a new entry in `parent`, in the slot of a deleted entry if there is one or at the end of the directory otherwise.
+ * The index of the new entry is returned in `index`
+*/
+int ps2mcfs_add_child(const struct vmc_meta* vmc_meta, dir_entry_t* parent, dir_entry_t* new_child, size_t* index) {
 	DEBUG_printf("Adding new child \"%s/%s\"\n", parent->name, new_child->name);
+	if (ps2mcfs_find_free_slot(vmc_meta, parent, index) == 0) {
+		ps2mcfs_set_child(vmc_meta, parent->cluster, *index, new_child);
+		return 0;
+	}
+
 	const size_t dirents_per_cluster = fat_cluster_capacity(vmc_meta) / sizeof(dir_entry_t);
 	const size_t new_size = div_ceil(parent->length + 1, dirents_per_cluster);
 	cluster_t last = fat_truncate(vmc_meta, parent->cluster, new_size);
@@ -225,6 +336,7 @@ int ps2mcfs_add_child(const struct vmc_meta* vmc_meta, dir_entry_t* parent, dir_
 		return -ENOSPC;
 
 	ps2mcfs_set_child(vmc_meta, parent->cluster, parent->length, new_child);
+	*index = parent->length;
 	dir_entry_t dummy;
 	parent->length++;
 	// now need to write the updated parent length into the parent's dir entry
@@ -245,7 +357,8 @@ int ps2mcfs_mkdir(const struct vmc_meta* vmc_meta, dir_entry_t* parent, const ch
 	new_child.mode = mode | DF_DIRECTORY | DF_EXISTS;
 	new_child.length = 2;
 	ps2mcfs_time_to_date_time(time(NULL), &new_child.creation);
-	new_child.cluster = fat_allocate(vmc_meta, div_ceil(2, dirents_per_cluster));
+	// directories are placed near their parent, since they are read together when browsing
+	new_child.cluster = fat_allocate_near(vmc_meta, div_ceil(2, dirents_per_cluster), parent->cluster);
 	new_child.modification = new_child.creation;
 	new_child.attributes = 0;
 	strcpy(new_child.name, name);
@@ -254,7 +367,8 @@ int ps2mcfs_mkdir(const struct vmc_meta* vmc_meta, dir_entry_t* parent, const ch
 		return -ENOSPC;
 	}
 
-	int err = ps2mcfs_add_child(vmc_meta, parent, &new_child);
+	size_t index;
+	int err = ps2mcfs_add_child(vmc_meta, parent, &new_child, &index);
 	if (err) {
 		fat_truncate(vmc_meta, new_child.cluster, 0);
 		return err;
@@ -264,7 +378,7 @@ int ps2mcfs_mkdir(const struct vmc_meta* vmc_meta, dir_entry_t* parent, const ch
 	dir_entry_t dummy;
 	// TODO: what else should be filled here?
 	dummy.cluster = parent->cluster;
-	dummy.dir_entry = parent->length-1;
+	dummy.dir_entry = index;
 	dummy.mode = new_child.mode;
 	strcpy(dummy.name, ".");
 	ps2mcfs_set_child(vmc_meta, new_child.cluster, 0, &dummy);
@@ -285,28 +399,262 @@ int ps2mcfs_create(const struct vmc_meta* vmc_meta, dir_entry_t* parent, const c
 	new_child.attributes = 0;
 	strcpy(new_child.name, name);
 
-	int err = ps2mcfs_add_child(vmc_meta, parent, &new_child);
+	size_t index;
+	int err = ps2mcfs_add_child(vmc_meta, parent, &new_child, &index);
 	if (err)
 		return err;
 	return 0;
 }
 
-int ps2mcfs_write(const struct vmc_meta* vmc_meta, const browse_result_t* dirent, const void* buf, size_t size, off_t offset) {
-	if (offset + size > dirent->dirent.length) {
-		dir_entry_t new_entry = dirent->dirent;
-		if (new_entry.cluster == CLUSTER_INVALID) {
-			new_entry.cluster = fat_allocate(vmc_meta, 1);
-		}
-		size_t k = fat_cluster_capacity(vmc_meta);
-		size_t needed_clusters = div_ceil(offset+size, k);
-		cluster_t clusn = fat_truncate(vmc_meta, new_entry.cluster, needed_clusters);
-		if (clusn == CLUSTER_INVALID)
+/**
+ * Makes the cluster chain of a file hold at least `size` bytes, allocating its first cluster if it has none.
+ * With a `tail`, the chain is extended from its last cluster and grows ahead of the writes, in batches
+*/
+static int ps2mcfs_reserve(const struct vmc_meta* vmc_meta, dir_entry_t* dirent, file_tail_t* tail, size_t size) {
+	if (size == 0)
+		return 0;
+	const size_t needed = div_ceil(size, fat_cluster_capacity(vmc_meta));
+	if (dirent->cluster == CLUSTER_INVALID) {
+		// the whole chain is allocated at once, in a free run that holds it
+		dirent->cluster = fat_allocate(vmc_meta, needed);
+		if (dirent->cluster == CLUSTER_INVALID)
 			return -ENOSPC;
-		new_entry.length = offset + size;
+		if (tail)
+			*tail = FILE_TAIL_INIT;
+		return 0;
+	}
+	if (tail == NULL)
+		return fat_extend(vmc_meta, dirent->cluster, needed) == CLUSTER_INVALID ? -ENOSPC : 0;
+
+	if (tail->last == CLUSTER_INVALID) {
+		// the end of the chain is only looked for once
+		size_t position;
+		const struct fat_chain_index* chain = fat_chain_index_get(vmc_meta, dirent->cluster, &position);
+		if (chain == NULL)
+			return -EIO;
+		tail->last = chain->clusters[chain->length - 1];
+		tail->length = chain->length - position;
+	}
+	if (needed <= tail->length)
+		return 0;
+	// allocate as many clusters as the chain already has, up to a limit, so that appends allocate every now and then
+	const size_t missing = needed - tail->length;
+	size_t batch = MAX(missing, MIN(tail->length, PS2MCFS_WRITE_AHEAD_CLUSTERS));
+	cluster_t last = fat_truncate(vmc_meta, tail->last, batch + 1);
+	if (last == CLUSTER_INVALID && batch > missing) {
+		batch = missing;
+		last = fat_truncate(vmc_meta, tail->last, batch + 1);
+	}
+	if (last == CLUSTER_INVALID)
+		return -ENOSPC;
+	tail->last = last;
+	tail->length += batch;
+	tail->ahead |= batch > missing;
+	return 0;
+}
+
+void ps2mcfs_write_done(const struct vmc_meta* vmc_meta, const dir_entry_t* dirent, file_tail_t* tail) {
+	// only the clusters allocated ahead of the writes are freed, the ones reserved by fallocate are kept
+	if (tail->ahead && dirent->cluster != CLUSTER_INVALID && tail->last != CLUSTER_INVALID) {
+		const size_t used = MAX(div_ceil(dirent->length, fat_cluster_capacity(vmc_meta)), 1);
+		if (used < tail->length)
+			fat_truncate(vmc_meta, dirent->cluster, used);
+	}
+	*tail = FILE_TAIL_INIT;
+}
+
+/**
+ * Writes zeros from `from` up to `to` in a file whose chain already holds those bytes
+*/
+static void ps2mcfs_zero_fill(const struct vmc_meta* vmc_meta, const dir_entry_t* dirent, size_t from, size_t to) {
+	static const uint8_t zeros[4096] = {0};
+	while (from < to) {
+		const size_t size = MIN(sizeof(zeros), to - from);
+		fat_write_bytes(vmc_meta, dirent->cluster, from, size, zeros);
+		from += size;
+	}
+}
+
+int ps2mcfs_write_data(const struct vmc_meta* vmc_meta, dir_entry_t* dirent, file_tail_t* tail, const void* buf, size_t size, off_t offset) {
+	if (offset + size > UINT32_MAX)
+		return -EFBIG;
+	if (offset + size > dirent->length) {
+		int err = ps2mcfs_reserve(vmc_meta, dirent, tail, offset + size);
+		if (err)
+			return err;
+		// the clusters may hold the data of a previous file, the gap left by writing past the end must read as zeros
+		if (offset > dirent->length)
+			ps2mcfs_zero_fill(vmc_meta, dirent, dirent->length, offset);
+		dirent->length = offset + size;
+	}
+	return fat_write_bytes(vmc_meta, dirent->cluster, offset, size, buf);
+}
+
+int ps2mcfs_truncate(const struct vmc_meta* vmc_meta, dir_entry_t* dirent, file_tail_t* tail, off_t length) {
+	if (ps2mcfs_is_directory(dirent))
+		return -EISDIR;
+	if (length < 0)
+		return -EINVAL;
+	if (length > UINT32_MAX)
+		return -EFBIG;
+	if (tail)
+		ps2mcfs_write_done(vmc_meta, dirent, tail);
+	if (length > dirent->length) {
+		int err = ps2mcfs_reserve(vmc_meta, dirent, NULL, length);
+		if (err)
+			return err;
+		ps2mcfs_zero_fill(vmc_meta, dirent, dirent->length, length);
+	}
+	else if (dirent->cluster != CLUSTER_INVALID) {
+		// the clusters reserved past the end of the file are freed as well
+		fat_truncate(vmc_meta, dirent->cluster, div_ceil(length, fat_cluster_capacity(vmc_meta)));
+		if (length == 0)
+			dirent->cluster = CLUSTER_INVALID;
+	}
+	dirent->length = length;
+	return 0;
+}
+
+int ps2mcfs_fallocate(const struct vmc_meta* vmc_meta, dir_entry_t* dirent, file_tail_t* tail, off_t offset, off_t length, bool keep_size) {
+	if (ps2mcfs_is_directory(dirent))
+		return -EISDIR;
+	if (offset < 0 || length <= 0)
+		return -EINVAL;
+	if (offset + length > UINT32_MAX)
+		return -EFBIG;
+	if (tail)
+		ps2mcfs_write_done(vmc_meta, dirent, tail);
+	int err = ps2mcfs_reserve(vmc_meta, dirent, NULL, offset + length);
+	if (err)
+		return err;
+	if (!keep_size && offset + length > dirent->length) {
+		ps2mcfs_zero_fill(vmc_meta, dirent, dirent->length, offset + length);
+		dirent->length = offset + length;
+	}
+	return 0;
+}
+
+int ps2mcfs_write(const struct vmc_meta* vmc_meta, const browse_result_t* dirent, const void* buf, size_t size, off_t offset) {
+	dir_entry_t new_entry = dirent->dirent;
+	int written = ps2mcfs_write_data(vmc_meta, &new_entry, NULL, buf, size, offset);
+	if (new_entry.length != dirent->dirent.length || new_entry.cluster != dirent->dirent.cluster)
 		ps2mcfs_set_child(vmc_meta, dirent->parent.cluster, dirent->index, &new_entry);
-		return fat_write_bytes(vmc_meta, new_entry.cluster, offset, size, buf);
+	return written;
+}
+
+/**
+ * Points the "." and ".." entries of a directory to the slot of its entry in its parent
+*/
+static void ps2mcfs_set_dir_location(const struct vmc_meta* vmc_meta, const dir_entry_t* dir, cluster_t parent_cluster, size_t index) {
+	dir_entry_t dot;
+	for (unsigned i = 0; i < 2; ++i) {
+		if (ps2mcfs_get_child(vmc_meta, dir->cluster, i, &dot) != 0)
+			continue;
+		dot.cluster = parent_cluster;
+		dot.dir_entry = index;
+		ps2mcfs_set_child(vmc_meta, dir->cluster, i, &dot);
+	}
+}
+
+int ps2mcfs_rename(const struct vmc_meta* vmc_meta, const browse_result_t* origin, dir_entry_t* new_parent, const char* new_name, browse_result_t* result) {
+	DEBUG_printf("Moving \"%s/%s\" to \"%s/%s\"\n", origin->parent.name, origin->dirent.name, new_parent->name, new_name);
+	const size_t name_len = strlen(new_name);
+	if (name_len >= sizeof(origin->dirent.name))
+		return -ENAMETOOLONG;
+	dir_entry_t moved = origin->dirent;
+	memset(moved.name, 0, sizeof(moved.name));
+	memcpy(moved.name, new_name, name_len);
+	size_t index = origin->index;
+	if (origin->parent.cluster == new_parent->cluster) {
+		ps2mcfs_set_child(vmc_meta, origin->parent.cluster, index, &moved);
+	}
+	else {
+		int err = ps2mcfs_add_child(vmc_meta, new_parent, &moved, &index);
+		if (err)
+			return err;
+		// the old slot is deleted without freeing the clusters, which now belong to the new entry
+		dir_entry_t tombstone = origin->dirent;
+		tombstone.mode &= ~DF_EXISTS;
+		ps2mcfs_set_child(vmc_meta, origin->parent.cluster, origin->index, &tombstone);
+		if (ps2mcfs_is_directory(&moved))
+			ps2mcfs_set_dir_location(vmc_meta, &moved, new_parent->cluster, index);
 	}
-	return fat_write_bytes(vmc_meta, dirent->dirent.cluster, offset, size, buf);
+	if (result) {
+		result->dirent = moved;
+		result->parent = *new_parent;
+		result->index = index;
+	}
+	return 0;
+}
+
+void ps2mcfs_exchange(const struct vmc_meta* vmc_meta, browse_result_t* a, browse_result_t* b) {
+	DEBUG_printf("Exchanging \"%s/%s\" and \"%s/%s\"\n", a->parent.name, a->dirent.name, b->parent.name, b->dirent.name);
+	dir_entry_t new_a = b->dirent, new_b = a->dirent;
+	memcpy(new_a.name, a->dirent.name, sizeof(new_a.name));
+	memcpy(new_b.name, b->dirent.name, sizeof(new_b.name));
+	ps2mcfs_set_child(vmc_meta, a->parent.cluster, a->index, &new_a);
+	ps2mcfs_set_child(vmc_meta, b->parent.cluster, b->index, &new_b);
+	if (ps2mcfs_is_directory(&new_a))
+		ps2mcfs_set_dir_location(vmc_meta, &new_a, a->parent.cluster, a->index);
+	if (ps2mcfs_is_directory(&new_b))
+		ps2mcfs_set_dir_location(vmc_meta, &new_b, b->parent.cluster, b->index);
+	a->dirent = new_a;
+	b->dirent = new_b;
+}
+
+/**
+ * Moves the entries of `dir` down into the slots of the deleted ones, in a single pass over the directory.
+ * The "." and ".." entries of the moved subdirectories are updated to point to their new slot,
+ * then the directory is shrunk and its new length is written to its parent
+*/
+int ps2mcfs_compact_dir(const struct vmc_meta* vmc_meta, dir_entry_t* dir) {
+	DEBUG_printf("Compacting directory \"%s\" (%u entries)\n", dir->name, dir->length);
+	dir_iterator_t it;
+	if (ps2mcfs_dir_iterator_init(vmc_meta, dir, 2, &it) != 0)
+		return -ENOMEM;
+	size_t length = 2;
+	size_t index;
+	dir_entry_t* child;
+	while ((child = ps2mcfs_dir_iterator_next(&it, &index)) != NULL) {
+		// entries only move to lower slots, which the iterator has already left behind
+		if (index != length) {
+			ps2mcfs_set_child(vmc_meta, dir->cluster, length, child);
+			if (ps2mcfs_is_directory(child))
+				ps2mcfs_set_dir_location(vmc_meta, child, dir->cluster, length);
+		}
+		++length;
+	}
+	ps2mcfs_dir_iterator_free(&it);
+	if (length == dir->length)
+		return 0;
+
+	const size_t dirents_per_cluster = fat_cluster_capacity(vmc_meta) / sizeof(dir_entry_t);
+	fat_truncate(vmc_meta, dir->cluster, div_ceil(length, dirents_per_cluster));
+	for (size_t i = length; i < dir->length; ++i)
+		dentry_cache_invalidate_entry(vmc_meta, dir->cluster, i, "");
+	dir_index_truncate(vmc_meta, dir->cluster, length);
+	dir->length = length;
+	dir_entry_t dot;
+	ps2mcfs_get_child(vmc_meta, dir->cluster, 0, &dot); // `dir`'s '.' entry, which points to its parent
+	ps2mcfs_set_child(vmc_meta, dot.cluster, dot.dir_entry, dir);
+	return 0;
+}
+
+/**
+ * Counts the deleted entries of `dir`, from its name index or by scanning it
+*/
+static size_t ps2mcfs_count_deleted(const struct vmc_meta* vmc_meta, const dir_entry_t* dir) {
+	size_t deleted;
+	if (dir_index_free_count(vmc_meta, dir, &deleted) == 0)
+		return deleted;
+	dir_iterator_t it;
+	if (ps2mcfs_dir_iterator_init(vmc_meta, dir, 2, &it) != 0)
+		return 0;
+	size_t existing = 0;
+	while (ps2mcfs_dir_iterator_next(&it, NULL) != NULL)
+		++existing;
+	ps2mcfs_dir_iterator_free(&it);
+	return it.length - 2 - existing;
 }
 
 int ps2mcfs_unlink(const struct vmc_meta* vmc_meta, const dir_entry_t unlinked_file, const dir_entry_t parent, size_t index_in_parent) {
@@ -314,43 +662,60 @@ int ps2mcfs_unlink(const struct vmc_meta* vmc_meta, const dir_entry_t unlinked_f
 	// free all the clusters in the deleted file (if it's not empty)
 	if (unlinked_file.cluster != CLUSTER_INVALID)
 		fat_truncate(vmc_meta, unlinked_file.cluster, 0);
+	// the entries of a removed directory are gone, and its clusters may be reused by a new directory
+	if (ps2mcfs_is_directory(&unlinked_file)) {
+		dentry_cache_invalidate_dir(vmc_meta, unlinked_file.cluster);
+		dir_index_forget(vmc_meta, unlinked_file.cluster);
+	}
 
-	dir_entry_t temp;
-	// remove the dirent in the parents list of dirents by shifting the siblings
-	for (int i = index_in_parent; i < parent.length - 1; ++i) {
-		ps2mcfs_get_child(vmc_meta, parent.cluster, i + 1, &temp);
-		ps2mcfs_set_child(vmc_meta, parent.cluster, i, &temp);
-		// the reverse link subdirectory entry (".") also has to be updated in each shifted sibling
-		// to reflect its new position in the parent's list of entries
-		cluster_t cluster = temp.cluster;
-		ps2mcfs_get_child(vmc_meta, cluster, 0, &temp);
-		temp.dir_entry = i;
-		ps2mcfs_set_child(vmc_meta, cluster, 0, &temp);
-	}
-
-	// we now need to decrement the length of the parent dir entry
-	// and update that inside its parent
-	ps2mcfs_get_child(vmc_meta, parent.cluster, 0, &temp); // dirent's '.' entry
-	cluster_t parent_parent_cluster = temp.cluster; // get the cluster of `parent` parent
-	size_t parent_index_in_parent = temp.dir_entry; // get index of `parent` direntry in its parent directory
-	temp = parent;
-	--temp.length;
-	ps2mcfs_set_child(vmc_meta, parent_parent_cluster, parent_index_in_parent, &temp);
+	// the entry is only marked as deleted, its slot is reused by the next new entry of the directory
+	dir_entry_t tombstone = unlinked_file;
+	tombstone.mode &= ~DF_EXISTS;
+	ps2mcfs_set_child(vmc_meta, parent.cluster, index_in_parent, &tombstone);
+
+	// directories with many deleted entries are compacted
+	if (parent.length - 2 < PS2MCFS_COMPACT_MIN_DELETED)
+		return 0;
+	const size_t deleted = ps2mcfs_count_deleted(vmc_meta, &parent);
+	if (deleted >= PS2MCFS_COMPACT_MIN_DELETED && deleted * 2 >= parent.length - 2) {
+		dir_entry_t compacted = parent;
+		return ps2mcfs_compact_dir(vmc_meta, &compacted);
+	}
 	return 0;
 }
 
-int ps2mcfs_rmdir(const struct vmc_meta* vmc_meta, const dir_entry_t removed_dir, const dir_entry_t parent, size_t index_in_parent) {
-	// Remove children starting at index=2 (skip `.` and `..` dummy entries)
-	for (int i = 2; i < removed_dir.length; ++i) {
-		// get and free all the clusters
-		dir_entry_t child;
-		ps2mcfs_get_child(vmc_meta, removed_dir.cluster, i, &child);
-		if (child.mode & DF_DIRECTORY) {
-			ps2mcfs_rmdir(vmc_meta, removed_dir, child, i);
+/**
+ * Frees the clusters of every file and subdirectory below `dir`. The entries of `dir` are left as they are,
+ * so that the directory isn't compacted (which would move the entries that are yet to be visited)
+*/
+static int ps2mcfs_free_children(const struct vmc_meta* vmc_meta, const dir_entry_t* dir) {
+	dir_iterator_t it;
+	if (ps2mcfs_dir_iterator_init(vmc_meta, dir, 2, &it) != 0)
+		return -ENOMEM;
+	int err = 0;
+	dir_entry_t* child;
+	while ((child = ps2mcfs_dir_iterator_next(&it, NULL)) != NULL) {
+		// deleted entries are skipped, their clusters may belong to other files by now
+		if (ps2mcfs_is_directory(child)) {
+			const dir_entry_t subdir = *child;
+			err = ps2mcfs_free_children(vmc_meta, &subdir);
+			if (err)
+				break;
+			dentry_cache_invalidate_dir(vmc_meta, subdir.cluster);
+			dir_index_forget(vmc_meta, subdir.cluster);
 		}
-		fat_truncate(vmc_meta, child.cluster, 0);
+		if (child->cluster != CLUSTER_INVALID)
+			fat_truncate(vmc_meta, child->cluster, 0);
 	}
-	// NOTE: The above is not stricly necessary as rm -r calls unlink() for each file before calling rmdir
+	ps2mcfs_dir_iterator_free(&it);
+	return err;
+}
 
+int ps2mcfs_rmdir(const struct vmc_meta* vmc_meta, const dir_entry_t removed_dir, const dir_entry_t parent, size_t index_in_parent) {
+	// Free the children starting at index=2 (skip `.` and `..` dummy entries)
+	// NOTE: This is not stricly necessary as rm -r calls unlink() for each file before calling rmdir
+	int err = ps2mcfs_free_children(vmc_meta, &removed_dir);
+	if (err)
+		return err;
 	return ps2mcfs_unlink(vmc_meta, removed_dir, parent, index_in_parent);
 }
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <sys/stat.h> // struct stat
+#include <sys/statvfs.h> // struct statvfs
 
 #include "fat.h"
 
@@ -20,11 +21,46 @@ bool ps2mcfs_is_file(const dir_entry_t* const dirent);
 */
 int ps2mcfs_get_superblock(struct vmc_meta* metadata_out);
 
+typedef struct {
+	const struct vmc_meta* vmc_meta;
+	cluster_t dir_cluster;
+	size_t length;       // number of entries in the directory
+	size_t index;        // index of the next entry to visit
+	size_t buffer_start; // index of the first entry in `buffer`
+	size_t buffer_count; // number of entries in `buffer`
+	dir_entry_t* buffer; // the entries of one cluster of the directory
+} dir_iterator_t;
+
+/**
+ * Prepares an iterator over the entries of `dir`, starting at the entry with index `offset`.
+ * Returns 0 on success or -ENOMEM
+*/
+int ps2mcfs_dir_iterator_init(const struct vmc_meta* vmc_meta, const dir_entry_t* dir, size_t offset, dir_iterator_t* it);
+
+/**
+ * Returns the next existing entry of the directory (deleted entries are skipped), or NULL after the last one.
+ * Its index in the directory is stored in `index` if not NULL. Each cluster of the directory is read once,
+ * the returned entry is only valid until the next call
+*/
+dir_entry_t* ps2mcfs_dir_iterator_next(dir_iterator_t* it, size_t* index);
+
+void ps2mcfs_dir_iterator_free(dir_iterator_t* it);
+
+/**
+ * Returns true if the directory has no entries other than "." and ".."
+*/
+bool ps2mcfs_is_empty_dir(const struct vmc_meta* vmc_meta, const dir_entry_t* dir);
+
 void ps2mcfs_ls(const struct vmc_meta* vmc_meta, dir_entry_t* parent, int(* cb)(dir_entry_t* child, void* extra), void* extra);
 int ps2mcfs_browse(const struct vmc_meta* vmc_meta, dir_entry_t* root, const char* path, browse_result_t* dest);
 dir_entry_t ps2mcfs_locate(const struct vmc_meta* vmc_meta, browse_result_t* src);
 
 void ps2mcfs_stat(const dir_entry_t* const dirent, struct stat* stbuf);
+
+/**
+ * Describes the size and the free space of the card, counted in clusters
+*/
+void ps2mcfs_statfs(const struct vmc_meta* vmc_meta, struct statvfs* stbuf);
 int ps2mcfs_read(const struct vmc_meta* vmc_meta, const dir_entry_t* dirent, void* buf, size_t size, off_t offset);
 
 void ps2mcfs_utime(const struct vmc_meta* vmc_meta, browse_result_t* dirent, date_time_t modification);
@@ -44,9 +80,74 @@ int ps2mcfs_create(const struct vmc_meta* vmc_meta, dir_entry_t* parent, const c
 */
 int ps2mcfs_write(const struct vmc_meta* vmc_meta, const browse_result_t* dirent, const void* buf, size_t size, off_t offset);
 
+// clusters allocated at most ahead of the writes that extend a file
+#define PS2MCFS_WRITE_AHEAD_CLUSTERS 64
+
+/**
+ * The end of the cluster chain of a file that is being written, kept along with its open file handle
+*/
+typedef struct {
+	cluster_t last; // last cluster of the chain, CLUSTER_INVALID when it has to be looked for
+	size_t length;  // number of clusters in the chain
+	bool ahead;     // clusters were allocated ahead of the writes, see ps2mcfs_write_done()
+} file_tail_t;
 
+#define FILE_TAIL_INIT ((file_tail_t) {.last = CLUSTER_INVALID, .length = 0, .ahead = false})
+
+/**
+ * Same as ps2mcfs_write(), but the new length and first cluster of the file are only updated in `dirent`.
+ * The caller has to write the directory entry back with ps2mcfs_set_child().
+ * With a `tail` (which may be NULL), appending doesn't walk the chain: it is extended from its last cluster,
+ * in batches that may go past the end of the file until ps2mcfs_write_done() is called
+*/
+int ps2mcfs_write_data(const struct vmc_meta* vmc_meta, dir_entry_t* dirent, file_tail_t* tail, const void* buf, size_t size, off_t offset);
+
+/**
+ * Frees the clusters that ps2mcfs_write_data() allocated past the end of the file, and resets `tail`
+*/
+void ps2mcfs_write_done(const struct vmc_meta* vmc_meta, const dir_entry_t* dirent, file_tail_t* tail);
+
+/**
+ * Changes the length of a file, freeing the clusters past the new end or filling the new bytes with zeros.
+ * As with ps2mcfs_write_data(), only `dirent` is updated. The clusters allocated ahead of the writes with `tail`
+ * (which may be NULL) are given back first, and `tail` is reset
+*/
+int ps2mcfs_truncate(const struct vmc_meta* vmc_meta, dir_entry_t* dirent, file_tail_t* tail, off_t length);
+
+/**
+ * Reserves the clusters that hold the bytes from `offset` to `offset + length` of a file, so that writing them later
+ * doesn't allocate. Unless `keep_size` is set, the file is extended with zeros up to the end of the range.
+ * As with ps2mcfs_truncate(), only `dirent` is updated and `tail` is reset, so that ps2mcfs_write_done()
+ * doesn't take the reserved clusters for clusters allocated ahead of the writes
+*/
+int ps2mcfs_fallocate(const struct vmc_meta* vmc_meta, dir_entry_t* dirent, file_tail_t* tail, off_t offset, off_t length, bool keep_size);
+
+/**
+ * Moves the entry found at `origin` into `new_parent`, with the name `new_name`. An entry with that name must not exist.
+ * The new location of the entry is returned in `result` if not NULL
+*/
+int ps2mcfs_rename(const struct vmc_meta* vmc_meta, const browse_result_t* origin, dir_entry_t* new_parent, const char* new_name, browse_result_t* result);
+
+/**
+ * Swaps the contents of two entries, which keep their names
+*/
+void ps2mcfs_exchange(const struct vmc_meta* vmc_meta, browse_result_t* a, browse_result_t* b);
+
+
+// unlink() compacts a directory when it has this many deleted entries, and they are at least half of its entries (not counting "." and "..")
+#define PS2MCFS_COMPACT_MIN_DELETED 16
+
+/**
+ * Removes a file, by marking its directory entry as deleted. The directory is compacted if it has too many deleted entries
+*/
 int ps2mcfs_unlink(const struct vmc_meta* vmc_meta, const dir_entry_t unlinked_file, const dir_entry_t parent, size_t index_in_parent);
 
+/**
+ * Moves the entries of a directory into the slots of its deleted entries and shrinks it.
+ * `dir` must be up to date, and its length is updated
+*/
+int ps2mcfs_compact_dir(const struct vmc_meta* vmc_meta, dir_entry_t* dir);
+
 int ps2mcfs_rmdir(const struct vmc_meta* vmc_meta, const dir_entry_t removed_dir, const dir_entry_t parent, size_t index_in_parent);
 
 int ps2mcfs_get_child(const struct vmc_meta* vmc_meta, cluster_t clus0, unsigned int entrynum, dir_entry_t* dest);
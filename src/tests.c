@@ -1,6 +1,14 @@
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <munit/munit.h>
 
+#include "dentry_cache.h"
+#include "defrag.h"
+#include "dir_index.h"
+#include "ecc.h"
+#include "fsck.h"
+#include "mc_image.h"
 #include "mc_writer.h"
 #include "ps2mcfs.h"
 #include "vmc_types.h"
@@ -38,6 +46,11 @@ static MunitResult test_new_empty_card_with_ecc(const MunitParameter params[], v
 	size_t expected_occupied_clusters = div_ceil(2 * sizeof(dirent), vmc_meta->superblock.page_size * vmc_meta->superblock.pages_per_cluster);
 	munit_assert_long(occupied_clusters, ==, expected_occupied_clusters);
 
+	// the directory tree is consistent, and the clusters reached from the root directory have the right ECC bytes
+	struct fsck_report report;
+	munit_assert_int(fsck_check(vmc_meta, 1, false, NULL, &report), ==, 0);
+	munit_assert_true(fsck_is_clean(&report));
+
 	return MUNIT_OK;
 }
 
@@ -72,31 +85,1073 @@ static MunitResult test_fat_truncate(const MunitParameter params[], void* data)
 }
 
 
+static MunitResult test_fat_write_pages(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	const size_t p_capacity = vmc_meta->superblock.page_size;
+
+	cluster_t clus = fat_allocate(vmc_meta, 4);
+	uint8_t written[4 * 1024], read[4 * 1024];
+	memset(written, 0xAB, sizeof(written));
+	munit_assert_long(fat_write_bytes(vmc_meta, clus, 0, sizeof(written), written), ==, sizeof(written));
+
+	// partial writes keep the rest of their pages, whole page writes replace them entirely
+	memset(written + 700, 0x11, 1000);
+	munit_assert_long(fat_write_bytes(vmc_meta, clus, 700, 1000, written + 700), ==, 1000);
+	memset(written + 2048, 0x22, 1024);
+	munit_assert_long(fat_write_bytes(vmc_meta, clus, 2048, 1024, written + 2048), ==, 1024);
+	munit_assert_long(fat_read_bytes(vmc_meta, clus, 0, sizeof(read), read), ==, sizeof(read));
+	munit_assert_memory_equal(sizeof(read), read, written);
+
+	// every page must still carry valid ECC bytes
+	if (vmc_meta->ecc_bytes) {
+		for (size_t i = 0; i < sizeof(written) / p_capacity; ++i) {
+			uint8_t* page = vmc_meta->raw_data + fat_logical_to_physical_offset(vmc_meta, clus, i * p_capacity);
+			munit_assert_int(ecc512_check(page + p_capacity, page), ==, ECC_CHECK_OK);
+		}
+	}
+	return MUNIT_OK;
+}
+
+
+static MunitResult test_fat_ecc_errors(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	size_t corrected, uncorrectable;
+
+	cluster_t clus = fat_allocate(vmc_meta, 1);
+	uint8_t written[1024], read[1024];
+	for (size_t i = 0; i < sizeof(written); ++i)
+		written[i] = i;
+	fat_write_bytes(vmc_meta, clus, 0, sizeof(written), written);
+	uint8_t* first_page = vmc_meta->raw_data + fat_logical_to_physical_offset(vmc_meta, clus, 0);
+	uint8_t* second_page = vmc_meta->raw_data + fat_logical_to_physical_offset(vmc_meta, clus, 512);
+
+	// single bit errors are corrected, but the image is left alone unless asked to repair it
+	first_page[10] ^= 0x04;
+	munit_assert_long(fat_read_bytes(vmc_meta, clus, 0, sizeof(read), read), ==, sizeof(read));
+	munit_assert_memory_equal(sizeof(read), read, written);
+	fat_ecc_error_counts(vmc_meta, &corrected, &uncorrectable);
+	munit_assert_long(corrected, ==, 1);
+	munit_assert_long(uncorrectable, ==, 0);
+	munit_assert_int(first_page[10], !=, written[10]);
+
+	// reads don't change the page, they leave it to the next flush
+	vmc_meta->repair_ecc = true;
+	fat_read_bytes(vmc_meta, clus, 0, sizeof(read), read);
+	munit_assert_int(first_page[10], !=, written[10]);
+	fat_flush(vmc_meta);
+	munit_assert_int(first_page[10], ==, written[10]);
+	fat_read_bytes(vmc_meta, clus, 0, sizeof(read), read);
+	fat_ecc_error_counts(vmc_meta, &corrected, &uncorrectable);
+	munit_assert_long(corrected, ==, 2);
+
+	// double bit errors are reported
+	second_page[0] ^= 0x03;
+	fat_read_bytes(vmc_meta, clus, 512, 10, read);
+	fat_ecc_error_counts(vmc_meta, &corrected, &uncorrectable);
+	munit_assert_long(corrected, ==, 2);
+	munit_assert_long(uncorrectable, ==, 1);
+
+	// a partial write corrects the part of the page it keeps
+	first_page[300] ^= 0x80;
+	fat_write_bytes(vmc_meta, clus, 0, 10, written);
+	munit_assert_int(first_page[300], ==, written[300]);
+	munit_assert_int(ecc512_check(first_page + 512, first_page), ==, ECC_CHECK_OK);
+	return MUNIT_OK;
+}
+
+
+static MunitResult test_fat_scrub(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	size_t corrected, uncorrectable;
+
+	cluster_t clus = fat_allocate(vmc_meta, 2);
+	uint8_t written[2048];
+	for (size_t i = 0; i < sizeof(written); ++i)
+		written[i] = i * 7;
+	fat_write_bytes(vmc_meta, clus, 0, sizeof(written), written);
+	uint8_t* page = vmc_meta->raw_data + fat_logical_to_physical_offset(vmc_meta, clus, 1536);
+	page[42] ^= 0x20;
+
+	// free clusters are skipped, allocated ones are repaired in place
+	munit_assert_int(fat_scrub_cluster(vmc_meta, fat_find_free_cluster(vmc_meta, 0)), ==, 0);
+	cluster_t second = fat_get_table_entry(vmc_meta, clus).entry.next_cluster;
+	munit_assert_int(fat_scrub_cluster(vmc_meta, second), ==, 1);
+	munit_assert_int(page[42], ==, written[1536 + 42]);
+	fat_ecc_error_counts(vmc_meta, &corrected, &uncorrectable);
+	munit_assert_long(corrected, ==, 1);
+	munit_assert_long(uncorrectable, ==, 0);
+	munit_assert_int(fat_scrub_cluster(vmc_meta, second), ==, 1);
+	fat_ecc_error_counts(vmc_meta, &corrected, &uncorrectable);
+	munit_assert_long(corrected, ==, 1);
+	return MUNIT_OK;
+}
+
+
+static MunitResult test_fat_flush(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+
+	// clusters past the first FAT page have their entries stored in the second page of a FAT cluster
+	cluster_t clus = fat_allocate(vmc_meta, 300);
+	munit_assert_int(clus, !=, CLUSTER_INVALID);
+	munit_assert_long(count_occupied_clusters(vmc_meta), ==, 301);
+
+	// changes must survive reloading the table from the card
+	munit_assert_int(fat_flush(vmc_meta), ==, 0);
+	fat_unload(vmc_meta);
+	munit_assert_int(fat_load(vmc_meta), ==, 0);
+	munit_assert_long(count_occupied_clusters(vmc_meta), ==, 301);
+	munit_assert_int(fat_seek(vmc_meta, clus, 299), !=, CLUSTER_INVALID);
+	munit_assert_int(fat_seek(vmc_meta, clus, 300), ==, CLUSTER_INVALID);
+
+	// unflushed changes are discarded when unloading
+	fat_truncate(vmc_meta, clus, 0);
+	fat_unload(vmc_meta);
+	munit_assert_int(fat_load(vmc_meta), ==, 0);
+	munit_assert_long(count_occupied_clusters(vmc_meta), ==, 301);
+
+	// a damaged superblock is refused
+	fat_unload(vmc_meta);
+	const uint32_t last_allocatable = vmc_meta->superblock.last_allocatable;
+	vmc_meta->superblock.last_allocatable = 0;
+	munit_assert_int(fat_load(vmc_meta), ==, -1);
+	munit_assert_null(vmc_meta->fat);
+	vmc_meta->superblock.last_allocatable = last_allocatable;
+	munit_assert_int(fat_load(vmc_meta), ==, 0);
+	return MUNIT_OK;
+}
+
+
+static MunitResult test_fat_free_space(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	const size_t allocatable = vmc_meta->superblock.last_allocatable;
+	munit_assert_long(fat_free_cluster_count(vmc_meta), ==, allocatable - 1);
+
+	cluster_t first = fat_allocate(vmc_meta, 100);
+	cluster_t second = fat_allocate(vmc_meta, 100);
+	munit_assert_long(fat_free_cluster_count(vmc_meta), ==, allocatable - 201);
+	munit_assert_long(fat_free_cluster_count(vmc_meta), ==, allocatable - count_occupied_clusters(vmc_meta));
+
+	// freed clusters are found again, also when the search has to wrap around
+	cluster_t hole = fat_seek(vmc_meta, first, 70);
+	fat_truncate(vmc_meta, first, 70);
+	munit_assert_int(fat_find_free_cluster(vmc_meta, 0), ==, hole);
+	munit_assert_int(fat_find_free_cluster(vmc_meta, allocatable - 1), ==, allocatable - 1);
+	fat_set_table_entry(vmc_meta, allocatable - 1, FAT_ENTRY_TERMINATOR);
+	munit_assert_int(fat_find_free_cluster(vmc_meta, allocatable - 1), ==, hole);
+	fat_set_table_entry(vmc_meta, allocatable - 1, FAT_ENTRY_FREE);
+
+	fat_truncate(vmc_meta, first, 0);
+	fat_truncate(vmc_meta, second, 0);
+	munit_assert_long(fat_free_cluster_count(vmc_meta), ==, allocatable - 1);
+
+	// exhaust the card
+	munit_assert_int(fat_allocate(vmc_meta, allocatable), ==, CLUSTER_INVALID);
+	munit_assert_long(fat_free_cluster_count(vmc_meta), ==, allocatable - 1);
+	munit_assert_int(fat_allocate(vmc_meta, allocatable - 1), !=, CLUSTER_INVALID);
+	munit_assert_long(fat_free_cluster_count(vmc_meta), ==, 0);
+	munit_assert_int(fat_find_free_cluster(vmc_meta, 0), ==, CLUSTER_INVALID);
+	return MUNIT_OK;
+}
+
+static MunitResult test_fat_best_fit(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	struct fat_fragmentation stats;
+	fat_fragmentation(vmc_meta, &stats);
+	munit_assert_size(stats.chains, ==, 1); // the root directory
+	munit_assert_size(stats.extents, ==, 1);
+	munit_assert_size(stats.free_runs, ==, 1);
+
+	// leave holes of 3 and 2 clusters between the chains
+	cluster_t a = fat_allocate(vmc_meta, 5);
+	cluster_t b = fat_allocate(vmc_meta, 3);
+	cluster_t c = fat_allocate(vmc_meta, 5);
+	cluster_t d = fat_allocate(vmc_meta, 2);
+	cluster_t e = fat_allocate(vmc_meta, 5);
+	munit_assert_int(b, ==, a + 5);
+	munit_assert_int(e, ==, d + 2);
+	fat_truncate(vmc_meta, b, 0);
+	fat_truncate(vmc_meta, d, 0);
+	fat_fragmentation(vmc_meta, &stats);
+	munit_assert_size(stats.free_runs, ==, 3);
+
+	// each chain goes to the smallest hole that holds it, or to the largest one when none does
+	munit_assert_int(fat_allocate(vmc_meta, 2), ==, d);
+	munit_assert_int(fat_allocate(vmc_meta, 1), ==, b);
+	cluster_t large = fat_allocate(vmc_meta, 40);
+	munit_assert_int(large, ==, e + 5);
+	fat_fragmentation(vmc_meta, &stats);
+	munit_assert_size(stats.chains, ==, 7);
+	munit_assert_size(stats.extents, ==, 7);
+
+	// a chain that can't grow in place continues in the run that fits the rest, which fragments it
+	munit_assert_int(fat_truncate(vmc_meta, a, 7), !=, CLUSTER_INVALID);
+	munit_assert_int(fat_seek(vmc_meta, a, 5), ==, b + 1);
+	fat_fragmentation(vmc_meta, &stats);
+	munit_assert_size(stats.extents, ==, 8);
+	munit_assert_size(stats.free_runs, ==, 1);
+	munit_assert_size(stats.largest_free_run, ==, fat_free_cluster_count(vmc_meta));
+
+	// new chains can also be placed next to another one
+	fat_truncate(vmc_meta, c, 0);
+	munit_assert_int(fat_allocate_near(vmc_meta, 1, large), ==, large + 40);
+	munit_assert_int(fat_allocate_near(vmc_meta, 1, a), ==, c);
+	return MUNIT_OK;
+}
+
+
+static MunitResult test_fat_chain_index(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	const size_t k = fat_cluster_capacity(vmc_meta);
+
+	cluster_t first = fat_allocate(vmc_meta, 3);
+	cluster_t other = fat_allocate(vmc_meta, 3);
+	munit_assert_int(fat_logical_to_physical_offset(vmc_meta, first, 2 * k + 10), ==, fat_logical_to_physical_offset(vmc_meta, fat_seek(vmc_meta, first, 2), 10));
+	// offsets inside a chain may also be resolved from one of its middle clusters
+	munit_assert_int(fat_logical_to_physical_offset(vmc_meta, fat_seek(vmc_meta, first, 1), k), ==, fat_logical_to_physical_offset(vmc_meta, first, 2 * k));
+
+	// the index must follow changes to the chain
+	fat_truncate(vmc_meta, first, 2);
+	fat_truncate(vmc_meta, other, 4);
+	fat_truncate(vmc_meta, first, 3);
+	munit_assert_int(fat_logical_to_physical_offset(vmc_meta, first, 2 * k), ==, fat_logical_to_physical_offset(vmc_meta, fat_seek(vmc_meta, first, 2), 0));
+	munit_assert_int(fat_logical_to_physical_offset(vmc_meta, other, 3 * k), ==, fat_logical_to_physical_offset(vmc_meta, fat_seek(vmc_meta, other, 3), 0));
+
+	// unaligned transfers that span several pages and clusters
+	uint8_t written[3000], read[3000];
+	for (size_t i = 0; i < sizeof(written); ++i)
+		written[i] = i * 7;
+	munit_assert_long(fat_write_bytes(vmc_meta, first, 50, sizeof(written), written), ==, sizeof(written));
+	munit_assert_long(fat_write_bytes(vmc_meta, other, 0, sizeof(written), written), ==, sizeof(written));
+	munit_assert_long(fat_read_bytes(vmc_meta, first, 50, sizeof(read), read), ==, sizeof(read));
+	munit_assert_memory_equal(sizeof(read), read, written);
+	munit_assert_long(fat_read_bytes(vmc_meta, fat_seek(vmc_meta, first, 1), 200, 1000, read), ==, 1000);
+	munit_assert_memory_equal(1000, read, written + k + 200 - 50);
+
+	// transfers stop at the end of the chain
+	munit_assert_long(fat_read_bytes(vmc_meta, first, 3 * k - 10, 100, read), ==, 10);
+	return MUNIT_OK;
+}
+
+
+#define PARALLEL_READ_CHAINS (2 * FAT_CHAIN_INDEX_SLOTS)
+#define PARALLEL_READ_THREADS 4
+
+struct parallel_read_args {
+	const struct vmc_meta* vmc_meta;
+	const cluster_t* chains;
+	unsigned int thread;
+	bool ok;
+};
+
+static void* parallel_read_main(void* arg) {
+	struct parallel_read_args* args = arg;
+	const size_t k = fat_cluster_capacity(args->vmc_meta);
+	uint8_t buf[3 * k];
+	args->ok = true;
+	for (unsigned int round = 0; round < 50; ++round) {
+		// every thread visits the chains in a different order, so that the chain indexes keep being replaced
+		const unsigned int i = (round * (args->thread + 1) * 7 + args->thread) % PARALLEL_READ_CHAINS;
+		if (fat_read_bytes(args->vmc_meta, args->chains[i], 0, sizeof(buf), buf) != sizeof(buf))
+			args->ok = false;
+		for (size_t j = 0; j < sizeof(buf); ++j) {
+			if (buf[j] != (uint8_t) (i + j / k))
+				args->ok = false;
+		}
+	}
+	return NULL;
+}
+
+static MunitResult test_fat_parallel_reads(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	const size_t k = fat_cluster_capacity(vmc_meta);
+	// more chains than chain index slots, interleaved so that none of them is contiguous
+	cluster_t chains[PARALLEL_READ_CHAINS];
+	for (unsigned int i = 0; i < PARALLEL_READ_CHAINS; ++i)
+		chains[i] = fat_allocate(vmc_meta, 1);
+	for (unsigned int n = 2; n <= 3; ++n) {
+		for (unsigned int i = 0; i < PARALLEL_READ_CHAINS; ++i)
+			munit_assert_int(fat_truncate(vmc_meta, chains[i], n), !=, CLUSTER_INVALID);
+	}
+	uint8_t cluster[k];
+	for (unsigned int i = 0; i < PARALLEL_READ_CHAINS; ++i) {
+		for (unsigned int j = 0; j < 3; ++j) {
+			memset(cluster, i + j, k);
+			munit_assert_long(fat_write_bytes(vmc_meta, chains[i], j * k, k, cluster), ==, k);
+		}
+	}
+
+	pthread_t threads[PARALLEL_READ_THREADS];
+	struct parallel_read_args args[PARALLEL_READ_THREADS];
+	for (unsigned int t = 0; t < PARALLEL_READ_THREADS; ++t) {
+		args[t] = (struct parallel_read_args) {.vmc_meta = vmc_meta, .chains = chains, .thread = t, .ok = false};
+		munit_assert_int(pthread_create(&threads[t], NULL, parallel_read_main, &args[t]), ==, 0);
+	}
+	for (unsigned int t = 0; t < PARALLEL_READ_THREADS; ++t) {
+		pthread_join(threads[t], NULL);
+		munit_assert_true(args[t].ok);
+	}
+	return MUNIT_OK;
+}
+
+
+static MunitResult test_dentry_cache(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	// a small cache, so that entries are evicted too
+	munit_assert_int(dentry_cache_init(vmc_meta, 4), ==, 0);
+	browse_result_t root, dir, file;
+	size_t hits, misses;
+
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/", &root), ==, 0);
+	munit_assert_int(ps2mcfs_mkdir(vmc_meta, &root.dirent, "A", 7), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/A", &dir), ==, 0);
+	munit_assert_int(ps2mcfs_create(vmc_meta, &dir.dirent, "x", CLUSTER_INVALID, 7), ==, 0);
+	munit_assert_int(ps2mcfs_create(vmc_meta, &dir.dirent, "y", CLUSTER_INVALID, 7), ==, 0);
+	munit_assert_int(ps2mcfs_create(vmc_meta, &root.dirent, "abc", CLUSTER_INVALID, 7), ==, 0);
+
+	// the second lookup is served by the cache
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/A/x", &file), ==, 0);
+	dentry_cache_stats(vmc_meta, &hits, &misses);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/A/x", &file), ==, 0);
+	size_t new_hits, new_misses;
+	dentry_cache_stats(vmc_meta, &new_hits, &new_misses);
+	munit_assert_long(new_hits, ==, hits + 3);
+	munit_assert_long(new_misses, ==, misses);
+	munit_assert_int(file.index, ==, 2);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/ab", NULL), ==, -ENOENT);
+
+	// writes that change an entry are visible to later lookups
+	munit_assert_int(ps2mcfs_write(vmc_meta, &file, "data", 4, 0), ==, 4);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/A/x", &file), ==, 0);
+	munit_assert_int(file.dirent.length, ==, 4);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/", &root), ==, 0);
+	munit_assert_int(root.dirent.length, ==, 4);
+
+	// unlinked entries are not found anymore, and their slot is reused
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/A/y", &file), ==, 0);
+	munit_assert_int(file.index, ==, 3);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/A/x", &file), ==, 0);
+	munit_assert_int(ps2mcfs_unlink(vmc_meta, file.dirent, file.parent, file.index), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/A/x", NULL), ==, -ENOENT);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/A/y", &file), ==, 0);
+	munit_assert_int(file.index, ==, 3);
+	munit_assert_int(ps2mcfs_create(vmc_meta, &dir.dirent, "w", CLUSTER_INVALID, 7), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/A/w", &file), ==, 0);
+	munit_assert_int(file.index, ==, 2);
+
+	// the entries of a removed directory are not found in a new directory that reuses its clusters
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/A", &dir), ==, 0);
+	const cluster_t removed_cluster = dir.dirent.cluster;
+	munit_assert_int(ps2mcfs_rmdir(vmc_meta, dir.dirent, dir.parent, dir.index), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/A", NULL), ==, -ENOENT);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/", &root), ==, 0);
+	munit_assert_int(ps2mcfs_mkdir(vmc_meta, &root.dirent, "B", 7), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/B", &dir), ==, 0);
+	munit_assert_int(dir.dirent.cluster, ==, removed_cluster);
+	munit_assert_int(ps2mcfs_create(vmc_meta, &dir.dirent, "z", CLUSTER_INVALID, 7), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/B/y", NULL), ==, -ENOENT);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/B/z", NULL), ==, 0);
+	return MUNIT_OK;
+}
+
+
+static MunitResult test_dir_index(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	munit_assert_int(dir_index_init(vmc_meta), ==, 0);
+	browse_result_t root, file;
+	char name[32];
+
+	// the index of the root directory is built by the first lookup and kept up to date by the next creations
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/", &root), ==, 0);
+	munit_assert_int(ps2mcfs_create(vmc_meta, &root.dirent, "save0", CLUSTER_INVALID, 7), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/save0", &file), ==, 0);
+	for (int i = 1; i < 40; ++i) {
+		snprintf(name, sizeof(name), "save%d", i);
+		munit_assert_int(ps2mcfs_create(vmc_meta, &root.dirent, name, CLUSTER_INVALID, 7), ==, 0);
+	}
+	for (int i = 0; i < 40; ++i) {
+		snprintf(name, sizeof(name), "/save%d", i);
+		munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, name, &file), ==, 0);
+		munit_assert_long(file.index, ==, 2 + i);
+		munit_assert_string_equal(file.dirent.name, name + 1);
+	}
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/save40", NULL), ==, -ENOENT);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/save", NULL), ==, -ENOENT);
+
+	// unlinked entries are forgotten, and their slots are reused in order
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/save39", &file), ==, 0);
+	munit_assert_int(ps2mcfs_unlink(vmc_meta, file.dirent, file.parent, file.index), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/save10", &file), ==, 0);
+	munit_assert_int(ps2mcfs_unlink(vmc_meta, file.dirent, file.parent, file.index), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/save10", NULL), ==, -ENOENT);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/save39", NULL), ==, -ENOENT);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/save11", &file), ==, 0);
+	munit_assert_long(file.index, ==, 13);
+	munit_assert_int(ps2mcfs_create(vmc_meta, &root.dirent, "new", CLUSTER_INVALID, 7), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/new", &file), ==, 0);
+	munit_assert_long(file.index, ==, 12);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/", &root), ==, 0);
+	munit_assert_int(root.dirent.length, ==, 42);
+	return MUNIT_OK;
+}
+
+
+static MunitResult check_compact_dir(struct vmc_meta* vmc_meta) {
+	browse_result_t root, dir, file;
+	char name[32];
+
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/", &root), ==, 0);
+	munit_assert_int(ps2mcfs_mkdir(vmc_meta, &root.dirent, "saves", 7), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/saves", &dir), ==, 0);
+	for (int i = 0; i < 40; ++i) {
+		snprintf(name, sizeof(name), "save%d", i);
+		if (i % 4 == 3)
+			munit_assert_int(ps2mcfs_mkdir(vmc_meta, &dir.dirent, name, 7), ==, 0);
+		else
+			munit_assert_int(ps2mcfs_create(vmc_meta, &dir.dirent, name, CLUSTER_INVALID, 7), ==, 0);
+	}
+	const size_t occupied = count_occupied_clusters(vmc_meta);
+
+	// the directory is compacted when half of its entries are deleted
+	for (int i = 0; i < 40; i += 2) {
+		snprintf(name, sizeof(name), "/saves/save%d", i);
+		munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, name, &file), ==, 0);
+		munit_assert_int(ps2mcfs_unlink(vmc_meta, file.dirent, file.parent, file.index), ==, 0);
+		munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/saves", &dir), ==, 0);
+		munit_assert_int(dir.dirent.length, ==, i < 38 ? 42 : 22);
+	}
+	munit_assert_long(count_occupied_clusters(vmc_meta), ==, occupied - 10);
+
+	// the remaining entries keep their order, and moved subdirectories point to their new slot
+	for (int i = 1; i < 40; i += 2) {
+		snprintf(name, sizeof(name), "/saves/save%d", i);
+		munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, name, &file), ==, 0);
+		munit_assert_long(file.index, ==, 2 + i / 2);
+		if (ps2mcfs_is_directory(&file.dirent)) {
+			dir_entry_t dot;
+			munit_assert_int(ps2mcfs_get_child(vmc_meta, file.dirent.cluster, 0, &dot), ==, 0);
+			munit_assert_int(dot.cluster, ==, dir.dirent.cluster);
+			munit_assert_long(dot.dir_entry, ==, file.index);
+			munit_assert_int(ps2mcfs_get_child(vmc_meta, file.dirent.cluster, 1, &dot), ==, 0);
+			munit_assert_int(dot.cluster, ==, dir.dirent.cluster);
+			munit_assert_long(dot.dir_entry, ==, file.index);
+			snprintf(name, sizeof(name), "/saves/save%d/..", i);
+			browse_result_t parent;
+			munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, name, &parent), ==, 0);
+			munit_assert_string_equal(parent.dirent.name, "saves");
+		}
+	}
+	struct fsck_report report;
+	munit_assert_int(fsck_check(vmc_meta, 1, false, NULL, &report), ==, 0);
+	munit_assert_true(fsck_is_clean(&report));
+	return MUNIT_OK;
+}
+
+static MunitResult test_compact_dir(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	munit_assert_int(dir_index_init(vmc_meta), ==, 0);
+	return check_compact_dir(vmc_meta);
+}
+
+static MunitResult test_compact_dir_without_index(const MunitParameter params[], void* data) {
+	return check_compact_dir(data);
+}
+
+
+static MunitResult test_rmdir(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	munit_assert_int(dir_index_init(vmc_meta), ==, 0);
+	browse_result_t root, dir, subdir, file;
+	char name[32];
+	const char contents[] = "save data";
+
+	// more subdirectories than needed to compact the directory if they were unlinked one by one
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/", &root), ==, 0);
+	munit_assert_int(ps2mcfs_mkdir(vmc_meta, &root.dirent, "saves", 7), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/saves", &dir), ==, 0);
+	const size_t occupied = count_occupied_clusters(vmc_meta) - 1;
+	for (int i = 0; i < 40; ++i) {
+		snprintf(name, sizeof(name), "save%d", i);
+		munit_assert_int(ps2mcfs_mkdir(vmc_meta, &dir.dirent, name, 7), ==, 0);
+		snprintf(name, sizeof(name), "/saves/save%d", i);
+		munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, name, &subdir), ==, 0);
+		munit_assert_int(ps2mcfs_create(vmc_meta, &subdir.dirent, "icon.sys", CLUSTER_INVALID, 7), ==, 0);
+		snprintf(name, sizeof(name), "/saves/save%d/icon.sys", i);
+		munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, name, &file), ==, 0);
+		munit_assert_int(ps2mcfs_write(vmc_meta, &file, contents, sizeof(contents), 0), ==, sizeof(contents));
+	}
+
+	// every cluster below the removed directory is freed
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/saves", &dir), ==, 0);
+	munit_assert_int(ps2mcfs_rmdir(vmc_meta, dir.dirent, dir.parent, dir.index), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/saves", NULL), ==, -ENOENT);
+	munit_assert_long(count_occupied_clusters(vmc_meta), ==, occupied);
+	return MUNIT_OK;
+}
+
+
+static MunitResult test_dir_iterator(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	browse_result_t root;
+	char name[32];
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/", &root), ==, 0);
+	for (int i = 0; i < 5; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		munit_assert_int(ps2mcfs_create(vmc_meta, &root.dirent, name, CLUSTER_INVALID, 7), ==, 0);
+	}
+	// delete "file1" by hand, leaving its slot in place
+	dir_entry_t deleted;
+	munit_assert_int(ps2mcfs_get_child(vmc_meta, root.dirent.cluster, 3, &deleted), ==, 0);
+	deleted.mode &= ~DF_EXISTS;
+	ps2mcfs_set_child(vmc_meta, root.dirent.cluster, 3, &deleted);
+
+	// each cluster of the directory is read once
+	dir_iterator_t it;
+	munit_assert_int(ps2mcfs_dir_iterator_init(vmc_meta, &root.dirent, 0, &it), ==, 0);
+	const uint64_t reads = fat_io_generation(vmc_meta);
+	const char* expected[] = {".", "..", "file0", "file2", "file3", "file4"};
+	const size_t expected_index[] = {0, 1, 2, 4, 5, 6};
+	dir_entry_t* child;
+	size_t index, count = 0;
+	while ((child = ps2mcfs_dir_iterator_next(&it, &index)) != NULL) {
+		munit_assert_string_equal(child->name, expected[count]);
+		munit_assert_long(index, ==, expected_index[count]);
+		++count;
+	}
+	munit_assert_long(count, ==, 6);
+	munit_assert_long(fat_io_generation(vmc_meta) - reads, ==, 4);
+	ps2mcfs_dir_iterator_free(&it);
+
+	// a listing can be resumed from the index after the last entry returned
+	munit_assert_int(ps2mcfs_dir_iterator_init(vmc_meta, &root.dirent, 3, &it), ==, 0);
+	munit_assert_not_null(child = ps2mcfs_dir_iterator_next(&it, &index));
+	munit_assert_string_equal(child->name, "file2");
+	munit_assert_long(index, ==, 4);
+	ps2mcfs_dir_iterator_free(&it);
+	return MUNIT_OK;
+}
+
+
+static MunitResult test_truncate(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	const size_t k = fat_cluster_capacity(vmc_meta);
+	const size_t free_clusters = fat_free_cluster_count(vmc_meta);
+	dir_entry_t file = {.mode = DF_FILE | DF_EXISTS | 7, .cluster = CLUSTER_INVALID, .length = 0};
+	uint8_t buf[3000];
+	memset(buf, 0xAA, sizeof(buf));
+	munit_assert_int(ps2mcfs_write_data(vmc_meta, &file, NULL, buf, sizeof(buf), 0), ==, sizeof(buf));
+
+	// shrinking frees the clusters past the new end, extending reads as zeros
+	munit_assert_int(ps2mcfs_truncate(vmc_meta, &file, NULL, 100), ==, 0);
+	munit_assert_size(fat_free_cluster_count(vmc_meta), ==, free_clusters - 1);
+	munit_assert_int(ps2mcfs_truncate(vmc_meta, &file, NULL, 2 * k + 10), ==, 0);
+	munit_assert_size(fat_free_cluster_count(vmc_meta), ==, free_clusters - 3);
+	munit_assert_int(ps2mcfs_read(vmc_meta, &file, buf, sizeof(buf), 0), ==, 2 * k + 10);
+	munit_assert_uint8(buf[99], ==, 0xAA);
+	for (size_t i = 100; i < 2 * k + 10; ++i)
+		munit_assert_uint8(buf[i], ==, 0);
+
+	// writing past the end leaves a gap of zeros
+	munit_assert_int(ps2mcfs_write_data(vmc_meta, &file, NULL, "x", 1, 2 * k + 20), ==, 1);
+	munit_assert_int(ps2mcfs_read(vmc_meta, &file, buf, 11, 2 * k + 10), ==, 11);
+	for (size_t i = 0; i < 10; ++i)
+		munit_assert_uint8(buf[i], ==, 0);
+
+	munit_assert_int(ps2mcfs_truncate(vmc_meta, &file, NULL, 0), ==, 0);
+	munit_assert_int(file.cluster, ==, CLUSTER_INVALID);
+	munit_assert_size(fat_free_cluster_count(vmc_meta), ==, free_clusters);
+	return MUNIT_OK;
+}
+
+static MunitResult test_fallocate(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	const size_t k = fat_cluster_capacity(vmc_meta);
+	const size_t free_clusters = fat_free_cluster_count(vmc_meta);
+	dir_entry_t file = {.mode = DF_FILE | DF_EXISTS | 7, .cluster = CLUSTER_INVALID, .length = 0};
+
+	// reserved clusters are kept by the writes that don't reach them, and used by the ones that do
+	munit_assert_int(ps2mcfs_fallocate(vmc_meta, &file, NULL, 0, 64 * k, true), ==, 0);
+	munit_assert_int(file.length, ==, 0);
+	munit_assert_size(fat_free_cluster_count(vmc_meta), ==, free_clusters - 64);
+	uint8_t buf[1000];
+	memset(buf, 0x55, sizeof(buf));
+	for (size_t offset = 0; offset < 64 * k; offset += sizeof(buf))
+		munit_assert_int(ps2mcfs_write_data(vmc_meta, &file, NULL, buf, MIN(sizeof(buf), 64 * k - offset), offset), >, 0);
+	munit_assert_int(file.length, ==, 64 * k);
+	munit_assert_size(fat_free_cluster_count(vmc_meta), ==, free_clusters - 64);
+
+	// without keep_size the file grows
+	munit_assert_int(ps2mcfs_fallocate(vmc_meta, &file, NULL, 64 * k, 10, false), ==, 0);
+	munit_assert_int(file.length, ==, 64 * k + 10);
+	munit_assert_size(fat_free_cluster_count(vmc_meta), ==, free_clusters - 65);
+	munit_assert_int(ps2mcfs_fallocate(vmc_meta, &file, NULL, 0, (free_clusters + 1) * k, true), ==, -ENOSPC);
+	munit_assert_size(fat_free_cluster_count(vmc_meta), ==, free_clusters - 65);
+
+	struct statvfs st;
+	ps2mcfs_statfs(vmc_meta, &st);
+	munit_assert_size(st.f_bsize, ==, k);
+	munit_assert_size(st.f_bfree, ==, free_clusters - 65);
+	munit_assert_size(st.f_blocks, ==, vmc_meta->superblock.last_allocatable);
+	return MUNIT_OK;
+}
+
+static MunitResult test_append(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	const size_t k = fat_cluster_capacity(vmc_meta);
+	const size_t free_clusters = fat_free_cluster_count(vmc_meta);
+	dir_entry_t file = {.mode = DF_FILE | DF_EXISTS | 7, .cluster = CLUSTER_INVALID, .length = 0};
+	file_tail_t tail = FILE_TAIL_INIT;
+	uint8_t chunk[4096];
+	const size_t size = 1000 * sizeof(chunk) / 10 + 123;
+
+	// the chain grows ahead of the appends, and is cut back to the length of the file when done
+	for (size_t offset = 0; offset < size; offset += sizeof(chunk)) {
+		memset(chunk, offset / sizeof(chunk), sizeof(chunk));
+		const size_t s = MIN(sizeof(chunk), size - offset);
+		munit_assert_int(ps2mcfs_write_data(vmc_meta, &file, &tail, chunk, s, offset), ==, s);
+	}
+	munit_assert_int(file.length, ==, size);
+	munit_assert_true(tail.ahead);
+	munit_assert_size(fat_free_cluster_count(vmc_meta), <, free_clusters - div_ceil(size, k));
+	ps2mcfs_write_done(vmc_meta, &file, &tail);
+	munit_assert_size(fat_free_cluster_count(vmc_meta), ==, free_clusters - div_ceil(size, k));
+	munit_assert_int(fat_seek(vmc_meta, file.cluster, div_ceil(size, k) - 1), !=, CLUSTER_INVALID);
+	munit_assert_int(fat_seek(vmc_meta, file.cluster, div_ceil(size, k)), ==, CLUSTER_INVALID);
+
+	for (size_t offset = 0; offset < size; offset += sizeof(chunk)) {
+		const size_t s = MIN(sizeof(chunk), size - offset);
+		munit_assert_int(ps2mcfs_read(vmc_meta, &file, chunk, s, offset), ==, s);
+		for (size_t i = 0; i < s; ++i)
+			munit_assert_uint8(chunk[i], ==, (uint8_t) (offset / sizeof(chunk)));
+	}
+
+	// clusters reserved by fallocate are kept, even when it takes over the clusters allocated ahead of the writes
+	munit_assert_int(ps2mcfs_write_data(vmc_meta, &file, &tail, chunk, k, size), ==, k);
+	munit_assert_true(tail.ahead);
+	munit_assert_int(ps2mcfs_fallocate(vmc_meta, &file, &tail, 0, size + 10 * k, true), ==, 0);
+	munit_assert_false(tail.ahead);
+	munit_assert_int(ps2mcfs_write_data(vmc_meta, &file, &tail, chunk, 1, size + k), ==, 1);
+	ps2mcfs_write_done(vmc_meta, &file, &tail);
+	munit_assert_size(fat_free_cluster_count(vmc_meta), ==, free_clusters - div_ceil(size + 10 * k, k));
+	return MUNIT_OK;
+}
+
+static MunitResult test_rename(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	browse_result_t root, dir, file, moved;
+	const char contents[] = "BADATA-SYSTEM";
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/", &root), ==, 0);
+	munit_assert_int(ps2mcfs_mkdir(vmc_meta, &root.dirent, "saves", 7), ==, 0);
+	munit_assert_int(ps2mcfs_create(vmc_meta, &root.dirent, "icon.sys", CLUSTER_INVALID, 7), ==, 0);
+
+	// data written through an entry that is kept in memory is only visible after writing the entry back
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/icon.sys", &file), ==, 0);
+	munit_assert_int(ps2mcfs_write_data(vmc_meta, &file.dirent, NULL, contents, sizeof(contents), 0), ==, sizeof(contents));
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/icon.sys", &moved), ==, 0);
+	munit_assert_int(moved.dirent.length, ==, 0);
+	ps2mcfs_set_child(vmc_meta, file.parent.cluster, file.index, &file.dirent);
+
+	// the moved file keeps its contents, and its old name is gone
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/icon.sys", &file), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/saves", &dir), ==, 0);
+	munit_assert_int(ps2mcfs_rename(vmc_meta, &file, &dir.dirent, "a name that does not fit in an entry", NULL), ==, -ENAMETOOLONG);
+	munit_assert_int(ps2mcfs_rename(vmc_meta, &file, &dir.dirent, "icon2.sys", &moved), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/icon.sys", NULL), ==, -ENOENT);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/saves/icon2.sys", &file), ==, 0);
+	munit_assert_long(file.index, ==, moved.index);
+	munit_assert_int(file.dirent.length, ==, sizeof(contents));
+	char buf[sizeof(contents)];
+	munit_assert_int(ps2mcfs_read(vmc_meta, &file.dirent, buf, sizeof(buf), 0), ==, sizeof(contents));
+	munit_assert_memory_equal(sizeof(contents), buf, contents);
+
+	// a moved directory points to its new parent
+	munit_assert_int(ps2mcfs_mkdir(vmc_meta, &root.dirent, "other", 7), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/other", &dir), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/saves", &file), ==, 0);
+	munit_assert_int(ps2mcfs_rename(vmc_meta, &file, &dir.dirent, "saves", NULL), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/other/saves/..", &file), ==, 0);
+	munit_assert_string_equal(file.dirent.name, "other");
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/other/saves/icon2.sys", &file), ==, 0);
+
+	// exchanged entries keep their names, and an exchanged directory points to its new slot
+	browse_result_t title;
+	munit_assert_int(ps2mcfs_create(vmc_meta, &root.dirent, "title.db", CLUSTER_INVALID, 7), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/title.db", &title), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/other/saves", &dir), ==, 0);
+	ps2mcfs_exchange(vmc_meta, &dir, &title);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/other/saves", &dir), ==, 0);
+	munit_assert_false(ps2mcfs_is_directory(&dir.dirent));
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/title.db/icon2.sys", &file), ==, 0);
+	munit_assert_int(file.dirent.length, ==, sizeof(contents));
+	dir_entry_t dot;
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/title.db", &title), ==, 0);
+	munit_assert_int(ps2mcfs_get_child(vmc_meta, title.dirent.cluster, 0, &dot), ==, 0);
+	munit_assert_int(dot.cluster, ==, root.dirent.cluster);
+	munit_assert_long(dot.dir_entry, ==, title.index);
+	return MUNIT_OK;
+}
+
+
+static MunitResult test_defrag(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	const char* paths[] = {"/saves/icon.sys", "/saves/data/game.dat", "/title.db"};
+	browse_result_t root, dir, file;
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/", &root), ==, 0);
+	munit_assert_int(ps2mcfs_mkdir(vmc_meta, &root.dirent, "saves", 7), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/saves", &dir), ==, 0);
+	munit_assert_int(ps2mcfs_mkdir(vmc_meta, &dir.dirent, "data", 7), ==, 0);
+	munit_assert_int(ps2mcfs_create(vmc_meta, &dir.dirent, "icon.sys", CLUSTER_INVALID, 7), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/saves/data", &dir), ==, 0);
+	munit_assert_int(ps2mcfs_create(vmc_meta, &dir.dirent, "game.dat", CLUSTER_INVALID, 7), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/", &root), ==, 0);
+	munit_assert_int(ps2mcfs_create(vmc_meta, &root.dirent, "title.db", CLUSTER_INVALID, 7), ==, 0);
+
+	// appending to the files in turns interleaves their clusters
+	const size_t k_capacity = fat_cluster_capacity(vmc_meta);
+	uint8_t* buf = malloc(k_capacity);
+	for (unsigned round = 0; round < 6; ++round) {
+		for (unsigned i = 0; i < 3; ++i) {
+			memset(buf, 'a' + round * 3 + i, k_capacity);
+			munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, paths[i], &file), ==, 0);
+			munit_assert_int(ps2mcfs_write(vmc_meta, &file, buf, k_capacity, round * k_capacity), ==, k_capacity);
+		}
+	}
+	struct fat_fragmentation before, after;
+	fat_fragmentation(vmc_meta, &before);
+	munit_assert_size(before.extents, >, before.chains);
+
+	struct defrag_stats stats;
+	munit_assert_int(defrag_card(vmc_meta, &stats), ==, 0);
+	munit_assert_size(stats.chains_moved, >, 0);
+	fat_fragmentation(vmc_meta, &after);
+	munit_assert_size(after.chains, ==, before.chains);
+	munit_assert_size(after.extents, ==, after.chains);
+	munit_assert_size(after.free_runs, ==, 1);
+
+	// the files keep their contents, and the directories point to their parents
+	for (unsigned i = 0; i < 3; ++i) {
+		munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, paths[i], &file), ==, 0);
+		for (unsigned round = 0; round < 6; ++round) {
+			munit_assert_int(ps2mcfs_read(vmc_meta, &file.dirent, buf, k_capacity, round * k_capacity), ==, k_capacity);
+			munit_assert_int(buf[0], ==, 'a' + round * 3 + i);
+			munit_assert_int(buf[k_capacity - 1], ==, 'a' + round * 3 + i);
+		}
+	}
+	dir_entry_t dot;
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/saves", &dir), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/saves/data", &file), ==, 0);
+	munit_assert_int(ps2mcfs_get_child(vmc_meta, file.dirent.cluster, 0, &dot), ==, 0);
+	munit_assert_int(dot.cluster, ==, dir.dirent.cluster);
+	munit_assert_long(dot.dir_entry, ==, file.index);
+	munit_assert_int(ps2mcfs_get_child(vmc_meta, file.dirent.cluster, 1, &dot), ==, 0);
+	munit_assert_int(dot.cluster, ==, dir.dirent.cluster);
+
+	// a defragmented card is left as it is
+	munit_assert_int(defrag_card(vmc_meta, &stats), ==, 0);
+	munit_assert_size(stats.clusters_moved, ==, 0);
+
+	// a cluster that is in two chains is refused
+	fat_set_table_entry(vmc_meta, fat_seek(vmc_meta, dir.dirent.cluster, 0), (union fat_entry) {.entry = {.next_cluster = file.dirent.cluster, .occupied = 1}});
+	munit_assert_int(defrag_card(vmc_meta, &stats), ==, -EUCLEAN);
+	free(buf);
+	return MUNIT_OK;
+}
+
+
+static MunitResult test_fsck(const MunitParameter params[], void* data) {
+	struct vmc_meta* vmc_meta = data;
+	const size_t k_capacity = fat_cluster_capacity(vmc_meta);
+	const char* paths[] = {"/saves/icon.sys", "/title.db", "/view.ico"};
+	uint8_t* buf = calloc(3, k_capacity);
+	browse_result_t root, dir, file;
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/", &root), ==, 0);
+	munit_assert_int(ps2mcfs_mkdir(vmc_meta, &root.dirent, "saves", 7), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/saves", &dir), ==, 0);
+	munit_assert_int(ps2mcfs_create(vmc_meta, &dir.dirent, "icon.sys", CLUSTER_INVALID, 7), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/", &root), ==, 0);
+	munit_assert_int(ps2mcfs_create(vmc_meta, &root.dirent, "title.db", CLUSTER_INVALID, 7), ==, 0);
+	munit_assert_int(ps2mcfs_create(vmc_meta, &root.dirent, "view.ico", CLUSTER_INVALID, 7), ==, 0);
+	for (unsigned i = 0; i < 3; ++i) {
+		munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, paths[i], &file), ==, 0);
+		munit_assert_int(ps2mcfs_write(vmc_meta, &file, buf, 3 * k_capacity, 0), ==, 3 * k_capacity);
+	}
+
+	struct fsck_report report;
+	munit_assert_int(fsck_check(vmc_meta, 4, false, NULL, &report), ==, 0);
+	munit_assert_true(fsck_is_clean(&report));
+	munit_assert_size(report.files, ==, 3);
+	munit_assert_size(report.directories, ==, 1);
+
+	// a lost chain, a chain that runs into a free cluster and a "." entry that points to the wrong slot
+	fat_allocate(vmc_meta, 2);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/view.ico", &file), ==, 0);
+	fat_set_table_entry(vmc_meta, fat_seek(vmc_meta, file.dirent.cluster, 1), FAT_ENTRY_FREE);
+	dir_entry_t dot;
+	munit_assert_int(ps2mcfs_get_child(vmc_meta, dir.dirent.cluster, 0, &dot), ==, 0);
+	dot.dir_entry = 99;
+	ps2mcfs_set_child(vmc_meta, dir.dirent.cluster, 0, &dot);
+	munit_assert_int(fsck_check(vmc_meta, 4, true, NULL, &report), ==, 0);
+	munit_assert_size(report.broken_chains, ==, 1);
+	munit_assert_size(report.length_mismatches, ==, 1);
+	munit_assert_size(report.lost_clusters, ==, 3); // including the end of the broken chain
+	munit_assert_size(report.bad_dir_locations, ==, 1);
+	munit_assert_size(report.cross_links, ==, 0);
+	munit_assert_size(report.repairs, ==, 6);
+
+	// the repairs leave a clean card, with the broken file cut short
+	munit_assert_int(fsck_check(vmc_meta, 1, false, NULL, &report), ==, 0);
+	munit_assert_true(fsck_is_clean(&report));
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/view.ico", &file), ==, 0);
+	munit_assert_int(file.dirent.length, ==, k_capacity);
+
+	// cross-linked chains are only reported
+	browse_result_t other;
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/saves/icon.sys", &file), ==, 0);
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/title.db", &other), ==, 0);
+	fat_set_table_entry(vmc_meta, other.dirent.cluster, (union fat_entry) {.entry = {.next_cluster = fat_seek(vmc_meta, file.dirent.cluster, 1), .occupied = 1}});
+	munit_assert_int(fsck_check(vmc_meta, 4, true, NULL, &report), ==, 0);
+	munit_assert_size(report.cross_links, ==, 1);
+	munit_assert_size(report.lost_clusters, ==, 2);
+	munit_assert_int(fsck_check(vmc_meta, 4, false, NULL, &report), ==, 0);
+	munit_assert_size(report.cross_links, ==, 1);
+	munit_assert_false(fsck_is_clean(&report));
+
+	// a directory that contains itself is reported once, instead of being walked forever
+	munit_assert_int(ps2mcfs_mkdir(vmc_meta, &dir.dirent, "loop", 7), ==, 0);
+	browse_result_t loop;
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/saves/loop", &loop), ==, 0);
+	dir_entry_t looped = loop.dirent;
+	munit_assert_int(ps2mcfs_browse(vmc_meta, NULL, "/", &root), ==, 0);
+	looped.cluster = vmc_meta->superblock.root_cluster;
+	looped.length = root.dirent.length;
+	ps2mcfs_set_child(vmc_meta, loop.parent.cluster, loop.index, &looped);
+	munit_assert_int(fsck_check(vmc_meta, 4, false, NULL, &report), ==, 0);
+	munit_assert_size(report.cross_links, ==, 2);
+	ps2mcfs_set_child(vmc_meta, loop.parent.cluster, loop.index, &loop.dirent);
+
+	// ".." is checked like "."
+	munit_assert_int(ps2mcfs_get_child(vmc_meta, dir.dirent.cluster, 1, &dot), ==, 0);
+	dot.dir_entry = 99;
+	ps2mcfs_set_child(vmc_meta, dir.dirent.cluster, 1, &dot);
+	munit_assert_int(fsck_check(vmc_meta, 4, true, NULL, &report), ==, 0);
+	munit_assert_size(report.bad_dir_locations, ==, 1);
+	munit_assert_int(ps2mcfs_get_child(vmc_meta, dir.dirent.cluster, 1, &dot), ==, 0);
+	munit_assert_int(dot.dir_entry, ==, dir.index);
+
+	// the clusters out of reach of a directory that can't be read are kept, and nothing is lost without the root
+	const size_t free_clusters = fat_free_cluster_count(vmc_meta);
+	fat_set_table_entry(vmc_meta, dir.dirent.cluster, FAT_ENTRY_FREE);
+	munit_assert_int(fsck_check(vmc_meta, 4, true, NULL, &report), ==, 0);
+	munit_assert_size(report.lost_clusters, >, 0);
+	munit_assert_size(fat_free_cluster_count(vmc_meta), ==, free_clusters + 1);
+	fat_set_table_entry(vmc_meta, vmc_meta->superblock.root_cluster, FAT_ENTRY_FREE);
+	munit_assert_int(fsck_check(vmc_meta, 4, true, NULL, &report), ==, 0);
+	munit_assert_size(report.broken_chains, ==, 1);
+	munit_assert_size(report.lost_clusters, ==, 0);
+	munit_assert_size(fat_free_cluster_count(vmc_meta), ==, free_clusters + 2);
+	free(buf);
+	return MUNIT_OK;
+}
+
+
+static MunitResult test_ecc_kernels(const MunitParameter params[], void* data) {
+	const char* default_kernel = ecc512_kernel_name();
+	const char* kernels[] = { "avx2", "popcnt", "words", "table" };
+	uint8_t page[512], expected[12], calculated[12];
+
+	for (unsigned i = 0; i < 200; ++i) {
+		for (unsigned j = 0; j < sizeof(page); ++j)
+			page[j] = i < 2 ? -i : munit_rand_int_range(0, 255);
+		munit_assert_true(ecc512_select_kernel("table"));
+		ecc512_calculate(expected, page);
+		for (unsigned k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+			if (!ecc512_select_kernel(kernels[k]))
+				continue;
+			ecc512_calculate(calculated, page);
+			munit_assert_memory_equal(sizeof(expected), calculated, expected);
+			munit_assert_int(ecc512_check(expected, page), ==, ECC_CHECK_OK);
+		}
+	}
+	munit_assert_true(ecc512_select_kernel(default_kernel));
+	return MUNIT_OK;
+}
+
+
+static MunitResult test_ecc_correction(const MunitParameter params[], void* data) {
+	uint8_t page[512], original[512], ecc[12], original_ecc[12];
+	for (unsigned j = 0; j < sizeof(page); ++j)
+		original[j] = munit_rand_int_range(0, 255);
+	ecc512_calculate(original_ecc, original);
+
+	// every single bit error is corrected, in the data or in the ECC bytes
+	for (unsigned bit = 0; bit < 8 * (sizeof(page) + sizeof(ecc)); ++bit) {
+		memcpy(page, original, sizeof(page));
+		memcpy(ecc, original_ecc, sizeof(ecc));
+		uint8_t* target = bit < 8 * sizeof(page) ? page : ecc - sizeof(page);
+		target[bit / 8] ^= 1 << (bit % 8);
+		enum ecc_check_result result = ecc512_check(ecc, page);
+		static const uint8_t used_ecc_bits[3] = {0x77, 0x7F, 0x7F};
+		if (bit / 8 >= sizeof(page) && !(used_ecc_bits[(bit / 8 - sizeof(page)) % 3] & (1 << (bit % 8)))) {
+			// unused bits of the ECC bytes are ignored
+			munit_assert_int(result, ==, ECC_CHECK_OK);
+			continue;
+		}
+		munit_assert_int(result, ==, ECC_CHECK_CORRECTED);
+		munit_assert_memory_equal(sizeof(page), page, original);
+		munit_assert_memory_equal(sizeof(ecc), ecc, original_ecc);
+	}
+
+	// two errors in the same chunk are detected
+	memcpy(page, original, sizeof(page));
+	page[3] ^= 0x10;
+	page[100] ^= 0x01;
+	munit_assert_int(ecc512_check(original_ecc, page), ==, ECC_CHECK_FAILED);
+	memcpy(page, original, sizeof(page));
+	page[200] ^= 0x11;
+	munit_assert_int(ecc512_check(original_ecc, page), ==, ECC_CHECK_FAILED);
+	return MUNIT_OK;
+}
+
+
+static MunitResult test_private_image(const MunitParameter params[], void* data) {
+	FILE* file = tmpfile();
+	superblock_t superblock = DEFAULT_SUPERBLOCK;
+	mc_writer_write_empty(&superblock, file);
+	fflush(file);
+
+	// changes done to a private image never reach the file
+	struct vmc_meta vmc_meta = {0};
+	munit_assert_int(mc_image_open_fd(&vmc_meta, fileno(file), MC_IMAGE_PRIVATE), ==, 0);
+	munit_assert_int(ps2mcfs_get_superblock(&vmc_meta), ==, 0);
+	munit_assert_int(fat_load(&vmc_meta), ==, 0);
+	munit_assert_int(fat_allocate(&vmc_meta, 10), !=, CLUSTER_INVALID);
+	fat_flush(&vmc_meta);
+	munit_assert_int(mc_image_sync(&vmc_meta), ==, 0);
+	fat_unload(&vmc_meta);
+	mc_image_close(&vmc_meta);
+
+	munit_assert_int(mc_image_open_fd(&vmc_meta, fileno(file), MC_IMAGE_SHARED), ==, 0);
+	munit_assert_int(ps2mcfs_get_superblock(&vmc_meta), ==, 0);
+	munit_assert_int(fat_load(&vmc_meta), ==, 0);
+	munit_assert_long(count_occupied_clusters(&vmc_meta), ==, 1);
+	fat_unload(&vmc_meta);
+	mc_image_close(&vmc_meta);
+	fclose(file);
+	return MUNIT_OK;
+}
+
+static MunitResult test_writeback_image(const MunitParameter params[], void* data) {
+	FILE* file = tmpfile();
+	superblock_t superblock = DEFAULT_SUPERBLOCK;
+	superblock.card_flags |= CF_USE_ECC;
+	mc_writer_write_empty(&superblock, file);
+	fflush(file);
+
+	struct vmc_meta vmc_meta = {0};
+	struct vmc_meta reader = {0};
+	munit_assert_int(mc_image_open_fd(&vmc_meta, fileno(file), MC_IMAGE_WRITEBACK), ==, 0);
+	munit_assert_int(ps2mcfs_get_superblock(&vmc_meta), ==, 0);
+	munit_assert_int(fat_load(&vmc_meta), ==, 0);
+	const cluster_t clus = fat_allocate(&vmc_meta, 3);
+	munit_assert_int(clus, !=, CLUSTER_INVALID);
+	const char text[] = "written back";
+	munit_assert_size(fat_write_bytes(&vmc_meta, clus, 1000, sizeof(text), text), ==, sizeof(text));
+	fat_flush(&vmc_meta);
+
+	// the changes only reach the file when the image is synced
+	munit_assert_int(mc_image_open_fd(&reader, fileno(file), MC_IMAGE_PRIVATE), ==, 0);
+	munit_assert_int(ps2mcfs_get_superblock(&reader), ==, 0);
+	munit_assert_int(fat_load(&reader), ==, 0);
+	munit_assert_long(count_occupied_clusters(&reader), ==, 1);
+	fat_unload(&reader);
+	mc_image_close(&reader);
+
+	munit_assert_int(mc_image_sync(&vmc_meta), ==, 0);
+	munit_assert_int(mc_image_open_fd(&reader, fileno(file), MC_IMAGE_PRIVATE), ==, 0);
+	munit_assert_int(ps2mcfs_get_superblock(&reader), ==, 0);
+	munit_assert_int(fat_load(&reader), ==, 0);
+	munit_assert_long(count_occupied_clusters(&reader), ==, 4);
+	char buf[sizeof(text)];
+	munit_assert_size(fat_read_bytes(&reader, clus, 1000, sizeof(buf), buf), ==, sizeof(buf));
+	munit_assert_string_equal(buf, text);
+	munit_assert_memory_equal(reader.raw_size, reader.raw_data, vmc_meta.raw_data);
+	size_t corrected, uncorrectable;
+	fat_ecc_error_counts(&reader, &corrected, &uncorrectable);
+	munit_assert_size(corrected + uncorrectable, ==, 0);
+	fat_unload(&reader);
+	mc_image_close(&reader);
+
+	fat_unload(&vmc_meta);
+	mc_image_close(&vmc_meta);
+	fclose(file);
+	return MUNIT_OK;
+}
+
+
+static struct vmc_meta* open_new_card(superblock_t superblock) {
+	FILE* file = tmpfile();
+	mc_writer_write_empty(&superblock, file);
+	fflush(file);
+
+	struct vmc_meta* vmc_meta = calloc(1, sizeof(struct vmc_meta));
+	mc_image_open_fd(vmc_meta, fileno(file), MC_IMAGE_SHARED);
+	fclose(file);
+	ps2mcfs_get_superblock(vmc_meta);
+	fat_load(vmc_meta);
+	return vmc_meta;
+}
+
 static void* fixture_memory_card_with_ecc_setup(const MunitParameter params[], void* user_data) {
 	(void) params;
 
-	struct vmc_meta* vmc_meta = malloc(sizeof(struct vmc_meta));
-	vmc_meta->file = fmemopen(NULL, 8650752, "w+");// 8MB card
 	superblock_t superblock = DEFAULT_SUPERBLOCK;
 	superblock.card_flags |= CF_USE_ECC;
-	mc_writer_write_empty(&superblock, vmc_meta->file);
+	return open_new_card(superblock);
+}
 
-	vmc_meta->ecc_bytes = 12;
-	vmc_meta->page_spare_area_size = 16;
-	fseek(vmc_meta->file, 0, SEEK_SET);
-	fread(&vmc_meta->superblock, sizeof(vmc_meta->superblock), 1, vmc_meta->file);
-	return vmc_meta;
+static void* fixture_memory_card_setup(const MunitParameter params[], void* user_data) {
+	(void) params;
+
+	return open_new_card(DEFAULT_SUPERBLOCK);
 }
 
 static void fixture_vmc_meta_teardown(void* fixture) {
   struct vmc_meta* vmc_meta = fixture;
-  fclose(vmc_meta->file);
+  dentry_cache_free(vmc_meta);
+  dir_index_free(vmc_meta);
+  fat_unload(vmc_meta);
+  mc_image_close(vmc_meta);
   free(vmc_meta);
 }
 
 static MunitTest test_suite_tests[] = {
 	{ (char*) "/mkfsps2", test_new_empty_card_with_ecc, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/ps2mcfs/dentry_cache", test_dentry_cache, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/ps2mcfs/dir_index", test_dir_index, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/ps2mcfs/compact_dir", test_compact_dir, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/ps2mcfs/compact_dir_without_index", test_compact_dir_without_index, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/ps2mcfs/rmdir", test_rmdir, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/ps2mcfs/truncate", test_truncate, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/ps2mcfs/fallocate", test_fallocate, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/ps2mcfs/append", test_append, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/ps2mcfs/rename", test_rename, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/ps2mcfs/defrag", test_defrag, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/ps2mcfs/fsck", test_fsck, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/ps2mcfs/dir_iterator", test_dir_iterator, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/ecc/kernels", test_ecc_kernels, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/ecc/correction", test_ecc_correction, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/image/private", test_private_image, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/image/writeback", test_writeback_image, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL },
 	{ (char*) "/fat/truncate", test_fat_truncate, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/fat/free_space", test_fat_free_space, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/fat/best_fit", test_fat_best_fit, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/fat/chain_index", test_fat_chain_index, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/fat/chain_index_without_ecc", test_fat_chain_index, fixture_memory_card_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/fat/parallel_reads", test_fat_parallel_reads, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/fat/write_pages", test_fat_write_pages, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/fat/write_pages_without_ecc", test_fat_write_pages, fixture_memory_card_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/fat/ecc_errors", test_fat_ecc_errors, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/fat/scrub", test_fat_scrub, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
+	{ (char*) "/fat/flush", test_fat_flush, fixture_memory_card_with_ecc_setup, fixture_vmc_meta_teardown, MUNIT_TEST_OPTION_NONE, NULL },
 
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
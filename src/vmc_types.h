@@ -116,12 +116,30 @@ static const superblock_t DEFAULT_SUPERBLOCK = {
 	.card_flags = 0x2a // ecc disabled
 };
 
+enum mc_image_mode {
+	MC_IMAGE_SHARED,  // changes are written to the image file
+	MC_IMAGE_PRIVATE, // changes are only kept in memory and are lost when the image is closed
+	MC_IMAGE_WRITEBACK, // changes are kept in memory, and the changed blocks are written to the image file by mc_image_sync()
+};
+
+struct fat_cache; // in-memory copy of the FAT table, see fat_load()
+struct dentry_cache; // recently resolved directory entries, see dentry_cache_init()
+struct dir_index_cache; // name indexes of recently used directories, see dir_index_init()
+
 struct vmc_meta {
 	superblock_t superblock;
-	FILE* file;
-	//void* raw_data;
+	uint8_t* raw_data; // the whole memory card image, mapped into memory. see mc_image_open()
+	size_t raw_size;
+	int fd;
+	enum mc_image_mode image_mode;
+	unsigned long* dirty_blocks; // blocks of a write-back image changed since they were last written, see mc_image_mark_dirty()
+	unsigned long* metadata_blocks; // dirty blocks that hold the FAT or directory entries, see mc_image_mark_metadata()
 	size_t page_spare_area_size;
 	uint8_t ecc_bytes;
+	bool repair_ecc; // when set, pages with correctable ECC errors are fixed in the image once read, on the next fat_flush()
+	struct fat_cache* fat; // NULL until fat_load() is called
+	struct dentry_cache* dentries; // NULL when path lookups are not cached
+	struct dir_index_cache* dir_indexes; // NULL when directories are scanned on every lookup
 };
 
 #endif